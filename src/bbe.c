@@ -34,12 +34,6 @@
 #include <string.h>
 #endif
 
-#ifdef PACKAGE
-static char *program = PACKAGE;
-#else
-static char *program = "bbe";
-#endif
-
 #ifdef VERSION
 static char *version = VERSION;
 #else
@@ -53,40 +47,7 @@ static char *email_address = "tjsa@iki.fi";
 #endif
 
 
-/* global block */
-struct block block;
-
-/* commands to be executed */
-struct commands cmds;
-
-/* extra info for panic */
-char *panic_info = NULL;
-
-/* -s switch state */
-int output_only_block = 0;
-
-/* c command conversions */
-char *convert_strings[] = {
-    "BCDASC",
-    "ASCBCD",
-          "",
-};
-/* commands to be executed at start of buffer */
-#define BLOCK_START_COMMANDS "DIJLFBN>"
-
-/* commands to be executed for each byte  */
-#define BYTE_COMMANDS "acdirsywjpl&|^~ufx"
-
-/* commands to be executed at end of buffer  */
-#define BLOCK_END_COMMANDS "A<"
-
-/* format types for p command */
-char *p_formats="DOHAB";
-
-/* formats for F and B commands */
-char *FB_formats="DOH";
-
-static char short_opts[] = "b:e:f:o:s?V";
+static char short_opts[] = "b:e:f:o:F:sxSCLX:RP:M:D:N:K:k:?V";
 
 #ifdef HAVE_GETOPT_LONG
 static struct option long_opts[] = {
@@ -94,626 +55,107 @@ static struct option long_opts[] = {
     {"expression",1,NULL,'e'},
     {"file",1,NULL,'f'},
     {"output",1,NULL,'o'},
+    {"files-from",1,NULL,'F'},
     {"help",0,NULL,'?'},
     {"version",0,NULL,'V'},
     {"suppress",0,NULL,'s'},
+    {"hexdump",0,NULL,'x'},
+    {"stats",2,NULL,'S'},
+    {"count",0,NULL,'C'},
+    {"list-offsets",0,NULL,'L'},
+    {"extract",1,NULL,'X'},
+    {"stats-report",0,NULL,'R'},
+    {"progress",1,NULL,'P'},
+    {"metrics",1,NULL,'M'},
+    {"serve",1,NULL,'D'},
+    {"workers",1,NULL,'N'},
+    {"cache",1,NULL,'K'},
+    {"sort-key",1,NULL,'k'},
     {NULL,0,NULL,0}
 };
 #endif
 
-void
-panic(char *msg,char *info,char *syserror)
-{
-    if(panic_info != NULL) fprintf(stderr,"%s: %s",program,panic_info);
-
-    if (info == NULL && syserror == NULL)
-    {
-        fprintf(stderr,"%s: %s\n",program,msg);
-    } else if(info != NULL && syserror == NULL)
-    {
-        fprintf(stderr,"%s: %s: %s\n",program,msg,info);
-    } else if(info != NULL && syserror != NULL)
-    {
-        fprintf(stderr,"%s: %s: %s; %s\n",program,msg,info,syserror);
-    } else if(info == NULL && syserror != NULL)
-    {
-        fprintf(stderr,"%s: %s; %s\n",program,msg,syserror);
-    }
-    exit(EXIT_FAILURE);
-}
-
-/* parse a long int, can start with n (dec), x (hex), 0 (oct) */
-off_t
-parse_long(char *long_int)
-{
-    long long int l;
-    char *scan = long_int;
-    char type='d';           // others are x and o
-
-
-    if(*scan == '0')
-    {
-        type = 'o';
-        scan++;
-        if(*scan == 'x' || *scan == 'X') {
-            type = 'x';
-            scan++;
-        }
-    }
-
-    while(*scan != 0)
-    {
-        switch(type)
-        {
-            case 'd':
-                if(!isdigit(*scan)) panic("Error in number",long_int,NULL);
-                break;
-            case 'o':
-                if(!isdigit(*scan) || *scan >= '8') panic("Error in number",long_int,NULL);
-                break;
-            case 'x':
-                if(!isxdigit(*scan)) panic("Error in number",long_int,NULL);
-                break;
-        }
-        scan++;
-    }
-
-    if (sscanf(long_int,"%lli",&l) != 1)
-    {
-        panic("Error in number",long_int,NULL);
-    }
-    return (off_t) l;
-}
-
-/* parse a string, string can contain \n, \xn, \0n and \\
-   escape codes. memory will be allocated */
-unsigned char *
-parse_string(char *string,off_t *length)
-{
-    char *p;
-    int j,k,i = 0;
-    int min_len;
-    unsigned char buf[INPUT_BUFFER_LOW+1];
-    char num[5];
-    unsigned char *ret;
-
-    p = string;
-
-    while(*p != 0)
-    {
-        if(*p == '\\')
-        {
-            p++;
-            if(strchr("\\;abtnvfr",*p) != NULL)
-            {
-                switch(*p)
-                {
-                    case 'a':
-                        buf[i] = '\a';
-                        break;
-                    case 'b':
-                        buf[i] = '\b';
-                        break;
-                    case 't':
-                        buf[i] = '\t';
-                        break;
-                    case 'n':
-                        buf[i] = '\n';
-                        break;
-                    case 'v':
-                        buf[i] = '\v';
-                        break;
-                    case 'f':
-                        buf[i] = '\f';
-                        break;
-                    case 'r':
-                        buf[i] = '\r';
-                        break;
-                    default:
-                        buf[i] = *p;
-                }
-                p++;
-            } else
-            {
-                j = 0;
-                switch(*p)
-                {
-                    case 'x':
-                    case 'X':
-                        num[j++] = '0';
-                        num[j++] = *p++;
-                        while(isxdigit(*p) && j < 4) num[j++] = *p++;
-                        min_len=3;
-                        break;
-                    case '0':
-                        while(isdigit(*p) && *p < '8' && j < 4) num[j++] = *p++;
-                        min_len=1;
-                        break;
-                    default:
-                        while(isdigit(*p) && j < 3) num[j++] = *p++;
-                        min_len=1;
-                        break;
-                }
-                num[j] = 0;
-                if (sscanf(num,"%i",&k) != 1 || j < min_len)
-                {
-                    panic("Syntax error in escape code",string,NULL);
-                }
-                if (k < 0 || k > 255)
-                {
-                    panic("Escape code not in range (0-255)",string,NULL);
-                }
-                buf[i] = (unsigned char) k;
-            }
-        } else
-        {
-            buf[i] = (unsigned char) *p++;
-        }
-        if(i > INPUT_BUFFER_LOW)
-        {
-            panic("string too long",string,NULL);
-        }
-        i++;
-    }
-    if(i)       
-    {
-        ret = (unsigned char *) xmalloc(i);
-        memcpy(ret,buf,i);
-    } else
-    {
-        ret = NULL;
-    }
-    *length = i;
-    return ret;
-}
-
-
-/* parse a block definition and save it to block */
-static void
-parse_block(char *bs)
-{
-    char slash_char;
-    char *p = bs;
-    int i = 0;
-    char *buf;
-
-    if(strlen(bs) > (2*4*INPUT_BUFFER_LOW))
-    {
-        panic("Block definition too long",NULL,NULL);
-    }
-
-    buf=xmalloc(2*4*INPUT_BUFFER_LOW);
-
-    if (*p == ':')
-    {
-        block.start.S.length = 0;
-        block.type |= BLOCK_START_S;
-    } else
-    {
-        if(*p == 'x' || *p == 'X' || isdigit(*p))
-        {
-            switch(*p)
-            {
-                case 'x':
-                case 'X':
-                    buf[i++] = '0';
-                    buf[i++] = *p++;
-                    while(isxdigit(*p)) buf[i++] = *p++;
-                    break;
-                case '0':
-                    while(isdigit(*p) && *p < '8') buf[i++] = *p++;
-                    break;
-                default:
-                    while(isdigit(*p)) buf[i++] = *p++;
-                    break;
-            }
-
-            buf[i] = 0;
-            block.start.N = parse_long(buf);
-            block.type |= BLOCK_START_M;
-        } else                                // string start
-        {
-            slash_char = *p;
-            p++;
-            while(*p != slash_char && *p != 0) buf[i++] = *p++;
-            if (*p == slash_char) p++;
-            buf[i] = 0;
-            block.start.S.string = parse_string(buf,&block.start.S.length);
-            block.type |= BLOCK_START_S;
-        }
-    } 
-
-    if (*p != ':')
-    {
-        panic("Error in block definition",bs,NULL);
-    }
-
-    p++;
-
-    if (*p == 0)
-    {
-        block.stop.S.length = 0;
-        block.type |= BLOCK_STOP_S;
-    } else
-    { 
-        i = 0;
-        if (*p == 'x' || *p == 'X' || isxdigit(*p))
-        {
-            switch(*p)
-            {
-                case 'x':
-                case 'X':
-                    buf[i++] = '0';
-                    buf[i++] = *p++;
-                    while(isxdigit(*p)) buf[i++] = *p++;
-                    break;
-                case '0':
-                    while(isdigit(*p) && *p < '8') buf[i++] = *p++;
-                    break;
-                default:
-                    while(isdigit(*p)) buf[i++] = *p++;
-                    break;
-            } 
-            buf[i] = 0;
-            block.stop.M = parse_long(buf);
-            if(block.stop.M == 0) panic("Block length must be greater than zero",NULL,NULL);
-            block.type |= BLOCK_STOP_M;
-        } else
-        {
-            if(*p == '$')
-            {
-                block.stop.S.length = 0;
-                p++;
-            } else
-            {
-                slash_char = *p;
-                p++;
-                while(*p != slash_char && *p != 0) buf[i++] = *p++;
-                if (*p == slash_char)
-                {
-                    p++;
-                } else
-                {
-                    panic("syntax error in block definition",bs,NULL);
-                }
-                buf[i] = 0;
-                block.stop.S.string = parse_string(buf,&block.stop.S.length);
-                block.type |= BLOCK_STOP_S;
-            }
-        }
-    } 
-    if (*p != 0)
-    {
-        panic("syntax error in block definition",bs,NULL);
-    }
-    free(buf);
-}
-
-/* parse one command, commands are in list pointed by commands */
-void
-parse_command(char *command_string)
-{
-    struct command_list *curr,*new,**start;
-    char *c,*p,*buf;
-    char *f;
-    char *token[10];
-    char slash_char;
-    int i,j;
-
-   
-    p = command_string;
-    while(isspace(*p)) p++;              // remove leading spaces
-    if (p[0] == 0) return;      // empty line
-    if (p[0] == '#') return;       // comment
-
-    c = xstrdup(p);
-
-    i = 0;
-    token[i] = strtok(c," \t\n");
-    i++;
-    while(token[i - 1] != NULL && i < 10) token[i++] = strtok(NULL," \t\n");
-    i--;
-
-    if(strchr(BLOCK_START_COMMANDS,token[0][0]) != NULL)
-    {
-        curr = cmds.block_start;
-        start = &cmds.block_start;
-    } else if(strchr(BYTE_COMMANDS,token[0][0]) != NULL)
-    {
-        curr = cmds.byte;
-        start = &cmds.byte;
-    } else if(strchr(BLOCK_END_COMMANDS,token[0][0]) != NULL)
-    {
-        curr = cmds.block_end;
-        start = &cmds.block_end;
-    } else
-    {
-        panic("Error in command",command_string,NULL);
-    }
-
-    if (curr != NULL)
-    {
-        while(curr->next != NULL)  curr = curr->next;
-    }
-    new = xmalloc(sizeof(struct command_list));
-    new->next = NULL;
-    if(curr == NULL)
-    {
-        *start = new;
-    } else
-    {
-        curr->next = new;
-    }
-    
-
-    new->letter = token[0][0];
-    switch(new->letter)
-    {
-        case 'D':
-            if(i < 1 || i > 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            if(i == 2) 
-            {
-                new->offset = parse_long(token[1]);
-                if(new->offset < 1) panic("n for D-command must be at least 1",NULL,NULL);
-            } else
-            {
-                new->offset = 0;
-            }
-            break;
-        case 'A':
-        case 'I':
-            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->s1 = parse_string(token[1],&new->s1_len);
-            break;
-        case 'w':
-        case '<':
-        case '>':
-            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->s1 = xstrdup(token[1]);
-            break;
-        case 'j':
-        case 'J':
-            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->count = parse_long(token[1]);
-            break;
-        case 'l':
-        case 'L':
-            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->count = parse_long(token[1]);
-            break;
-        case 'r':
-        case 'i':
-            if(i != 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->offset = parse_long(token[1]);
-            new->s1 = parse_string(token[2],&new->s1_len);
-            break;
-        case 'd':
-            if(i < 2 || i > 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->offset = parse_long(token[1]);
-
-            if(token[2][0] == '*' && !token[2][1])
-            {
-                new->count = 0;
-            } else
-            {
-                new->count = parse_long(token[2]);
-                if(new->count < 1) panic("Error in command",command_string,NULL);
-            }
-            break;
-        case 'c':
-            if(i != 3 || strlen(token[1]) != 3 || strlen(token[2]) != 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->s1 = xmalloc(strlen(token[1]) + strlen(token[2]) + 2);
-            strcpy(new->s1,token[1]);
-            strcat(new->s1,token[2]);
-            j = 0;
-            while(new->s1[j] != 0) {
-                new->s1[j] = toupper(new->s1[j]);
-                j++;
-            }
-            j = 0;
-            while(*convert_strings[j] != 0 && strcmp(convert_strings[j],new->s1) != 0) j++;
-            if(*convert_strings[j] == 0) panic("Unknown conversion",command_string,NULL);
-            break;
-        case 's':
-        case 'y':
-            if(strlen(command_string) < 4) panic("Error in command",command_string,NULL);
-
-            buf=xmalloc((4*INPUT_BUFFER_LOW) + 1);
-
-            slash_char = command_string[1];
-            p = command_string;
-            p += 2;
-            j = 0;
-            while(*p != 0 && *p != slash_char && j < 4*INPUT_BUFFER_LOW) buf[j++] = *p++;
-            if(*p != slash_char) panic("Error in command",command_string,NULL);
-            buf[j] = 0;
-            new->s1 = parse_string(buf,&new->s1_len);
-            if(new->s1_len > INPUT_BUFFER_LOW) panic("String in command too long",command_string,NULL);
-            if(new->s1_len == 0) panic("Error in command",command_string,NULL);
-
-            p++;
-
-            j = 0;
-            while(*p != 0 && *p != slash_char && j < 4*INPUT_BUFFER_LOW) buf[j++] = *p++;
-            buf[j] = 0;
-            if(*p != slash_char) panic("Error in command",command_string,NULL);
-            new->s2 = parse_string(buf,&new->s2_len);
-            if(new->s2_len > INPUT_BUFFER_LOW) panic("String in command too long",command_string,NULL);
-
-            if(new->letter == 'y' && new->s1_len != new->s2_len) panic("Strings in y-command must have equal length",command_string,NULL);
-            free(buf);
-            break;
-        case 'F':
-        case 'B':
-            if(i > 1 && (strlen(token[1]) != 1)) panic("Error in command",command_string,NULL);
-        case 'p':
-            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->s1 = parse_string(token[1],&new->s1_len);
-            j = 0;
-            while(new->s1[j] != 0) {
-                new->s1[j] = toupper(new->s1[j]);
-                j++;
-            }
-            if (new->letter == 'p') 
-            {
-                f = p_formats;
-            } else
-            {
-                f = FB_formats;
-            }
-            while(*f != 0 && strchr(new->s1,*f) == NULL) f++;
-            if (*f == 0) panic("Error in command",command_string,NULL);
-            break;
-        case 'N':
-            if(i != 1 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            break;
-        case '&':
-        case '|':
-        case '^':
-            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->s1 = parse_string(token[1],&new->s1_len);
-            if(new->s1_len != 1)  panic("Error in command",command_string,NULL);
-            break;
-        case '~':
-        case 'x':
-            if(i != 1 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            break;
-        case 'u':
-        case 'f':
-            if(i != 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
-            new->offset = parse_long(token[1]);
-            new->s1 = parse_string(token[2],&new->s1_len);
-            if(new->s1_len != 1)  panic("Error in command",command_string,NULL);
-            break;
-        default:
-            panic("Unknown command",command_string,NULL);
-            break;
-    }
-    free(c);
-}
-
-/* parse commands, commands are separated by ;. ; can be escaped as \;
-   and ;s inside " or ' are not separators
-   */
-void 
-parse_commands(char *command_string)
-{
-    char *c;
-    char *start;
-    int inside_d = 0;  // double
-    int inside_s = 0;  // single 
-
-    c = command_string;
-    start = c;
-
-    while(*start != 0)
-    {
-        switch(*c)
-        {
-            case '\\':
-                c++;
-                break;
-            case '"':
-                if(inside_d) 
-                {
-                    inside_d--;
-                } else
-                {
-                    inside_d++;
-                }
-                break;
-            case '\'':
-                if(inside_s) 
-                {
-                    inside_s--;
-                } else
-                {
-                    inside_s++;
-                }
-                break;
-            case ';':
-                if(!inside_d && !inside_s)
-                {
-                    *c = 0;
-                    parse_command(start);
-                    start = c + 1;
-                }
-                break;
-            case 0:
-                parse_command(start);
-                start = c;
-                break;
-        }
-        c++;
-    }
-}
-    
-
-
-/* parse one command, commands are in list 
-   read commands from file */
-void
-parse_command_file(char *file)
-{
-    FILE *fp;
-    char *line;
-    char *info;
-    size_t line_len = (8*1024);
-    int line_no = 0;
-
-    line = xmalloc(line_len);
-    info = xmalloc(strlen(file) + 100);
-
-    fp = fopen(file,"r");
-    if (fp == NULL) panic("Error in opening file",file,strerror(errno));
-
-#ifdef HAVE_GETLINE
-    while(getline(&line,&line_len,fp) != -1) 
-#else
-    while(fgets(line,line_len,fp) != NULL)
-#endif
-    {
-        line_no++;
-        sprintf(info,"Error in file '%s' in line %d\n",file,line_no);
-        panic_info=info;
-        parse_commands(line);
-    }
-
-    free(line);
-    free(info);
-    fclose(fp);
-    panic_info=NULL;
-}
-
 void
 help(FILE *stream)
 {
     fprintf(stream,"Usage: %s [OPTION]...\n\n",program);
 #ifdef HAVE_GETOPT_LONG
     fprintf(stream,"-b, --block=BLOCK\n");
-    fprintf(stream,"\t\tBlock definition.\n");
+    fprintf(stream,"\t\tBlock definition, can be given many times, -e, -f and -o apply to the latest.\n");
     fprintf(stream,"-e, --expression=COMMAND\n");
     fprintf(stream,"\t\tAdd command to the commands to be executed.\n");
     fprintf(stream,"-f, --file=script-file\n");
     fprintf(stream,"\t\tAdd commands from script-file to the commands to be executed.\n");
     fprintf(stream,"-o, --output=name\n");
     fprintf(stream,"\t\tWrite output to name instead of standard output.\n");
+    fprintf(stream,"-F, --files-from=list\n");
+    fprintf(stream,"\t\tRead names of input files from file list, one name in a line.\n");
     fprintf(stream,"-s, --suppress\n");
     fprintf(stream,"\t\tSuppress normal output, print only block contents.\n");
+    fprintf(stream,"-x, --hexdump\n");
+    fprintf(stream,"\t\tWrite output as hexdump with offsets, hex and ascii columns.\n");
+    fprintf(stream,"-S, --stats[=bytes]\n");
+    fprintf(stream,"\t\tWrite statistics of blocks instead of block contents, with =bytes also byte frequencies of every block.\n");
+    fprintf(stream,"-C, --count\n");
+    fprintf(stream,"\t\tWrite only the number of blocks.\n");
+    fprintf(stream,"-L, --list-offsets\n");
+    fprintf(stream,"\t\tWrite only the number, stream offset and length of every block.\n");
+    fprintf(stream,"-X, --extract=N\n");
+    fprintf(stream,"\t\tWrite block N from container file written by W command.\n");
+    fprintf(stream,"-k, --sort-key=OFFSET:LENGTH[:be|le]\n");
+    fprintf(stream,"\t\tWrite blocks sorted by unsigned integer of LENGTH bytes at OFFSET of the block.\n");
+    fprintf(stream,"-R, --stats-report\n");
+    fprintf(stream,"\t\tWrite counters and time spent in the phases of the run to stderr at exit.\n");
+    fprintf(stream,"-P, --progress=SECONDS\n");
+    fprintf(stream,"\t\tWrite progress of the run to stderr every SECONDS seconds.\n");
+    fprintf(stream,"-M, --metrics=FILE\n");
+    fprintf(stream,"\t\tKeep counters of the run in FILE in Prometheus text format.\n");
+    fprintf(stream,"-D, --serve=SOCKET\n");
+    fprintf(stream,"\t\tRun as daemon, run jobs given with UNIX socket SOCKET.\n");
+    fprintf(stream,"-N, --workers=N\n");
+    fprintf(stream,"\t\tNumber of worker threads of daemon, default is the number of processors.\n");
+    fprintf(stream,"-K, --cache=DIR\n");
+    fprintf(stream,"\t\tKeep output of blocks in directory DIR, blocks found there are not processed again.\n");
     fprintf(stream,"-?, --help\n");
     fprintf(stream,"\t\tDisplay this help and exit.\n");
     fprintf(stream,"-V, --version\n");
 #else
     fprintf(stream,"-b BLOCK\n");
-    fprintf(stream,"\t\tBlock definition.\n");
+    fprintf(stream,"\t\tBlock definition, can be given many times, -e, -f and -o apply to the latest.\n");
     fprintf(stream,"-e COMMAND\n");
     fprintf(stream,"\t\tAdd command to the commands to be executed.\n");
     fprintf(stream,"-f script-file\n");
     fprintf(stream,"\t\tAdd commands from script-file to the commands to be executed.\n");
     fprintf(stream,"-o name\n");
     fprintf(stream,"\t\tWrite output to name instead of standard output.\n");
+    fprintf(stream,"-F list\n");
+    fprintf(stream,"\t\tRead names of input files from file list, one name in a line.\n");
     fprintf(stream,"-s\n");
     fprintf(stream,"\t\tSuppress normal output, print only block contents.\n");
+    fprintf(stream,"-x\n");
+    fprintf(stream,"\t\tWrite output as hexdump with offsets, hex and ascii columns.\n");
+    fprintf(stream,"-S\n");
+    fprintf(stream,"\t\tWrite statistics of blocks instead of block contents.\n");
+    fprintf(stream,"-C\n");
+    fprintf(stream,"\t\tWrite only the number of blocks.\n");
+    fprintf(stream,"-L\n");
+    fprintf(stream,"\t\tWrite only the number, stream offset and length of every block.\n");
+    fprintf(stream,"-X N\n");
+    fprintf(stream,"\t\tWrite block N from container file written by W command.\n");
+    fprintf(stream,"-k OFFSET:LENGTH[:be|le]\n");
+    fprintf(stream,"\t\tWrite blocks sorted by unsigned integer of LENGTH bytes at OFFSET of the block.\n");
+    fprintf(stream,"-R\n");
+    fprintf(stream,"\t\tWrite counters and time spent in the phases of the run to stderr at exit.\n");
+    fprintf(stream,"-P SECONDS\n");
+    fprintf(stream,"\t\tWrite progress of the run to stderr every SECONDS seconds.\n");
+    fprintf(stream,"-M FILE\n");
+    fprintf(stream,"\t\tKeep counters of the run in FILE in Prometheus text format.\n");
+    fprintf(stream,"-D SOCKET\n");
+    fprintf(stream,"\t\tRun as daemon, run jobs given with UNIX socket SOCKET.\n");
+    fprintf(stream,"-N N\n");
+    fprintf(stream,"\t\tNumber of worker threads of daemon, default is the number of processors.\n");
+    fprintf(stream,"-K DIR\n");
+    fprintf(stream,"\t\tKeep output of blocks in directory DIR, blocks found there are not processed again.\n");
     fprintf(stream,"-?\n");
     fprintf(stream,"\t\tDisplay this help and exit.\n");
     fprintf(stream,"-V\n");
@@ -741,15 +183,83 @@ print_version()
 }
 
 
+/* block definitions, every -b option after the first starts a new definition
+   having its own context, commands and output */
+static struct bbe_ctx **defs = NULL;
+static int def_count = 0;
+
+static void
+new_definition()
+{
+    ctx = bbe_new();
+    if(ctx == NULL) panic("Out of memory",NULL,NULL);
+    defs = xrealloc(defs,(def_count + 1) * sizeof(struct bbe_ctx *));
+    defs[def_count++] = ctx;
+    serve_definition();
+}
+
+/* output of the reading context is the input of all definitions */
+static ssize_t
+push_definitions(void *arg,unsigned char *buf,size_t length)
+{
+    int i;
+
+    (void) arg;
+    for(i = 0;i < def_count;i++)
+    {
+        if(bbe_push(defs[i],buf,length) == -1) panic(bbe_error(defs[i]),NULL,NULL);
+    }
+    return (ssize_t) length;
+}
+
+/* several block definitions: the input is read once by a context of its own,
+   and every buffer full of input is pushed to the contexts of the definitions,
+   which run as coroutines (see bbe_push) and write to their own outputs */
+static void
+run_definitions()
+{
+    struct bbe_ctx *input = defs[0];
+    int i;
+
+    ctx = bbe_new();
+    if(ctx == NULL) panic("Out of memory",NULL,NULL);
+    ctx->in_files = input->in_files;
+    ctx->in_file_count = input->in_file_count;
+    ctx->in_file_size = input->in_file_size;
+    input->in_files = NULL;
+    input->in_file_count = 0;
+    input->in_file_size = 0;
+    for(i = 0;i < def_count;i++) defs[i]->file_ctx = ctx;      // N command prints the names of the input files
+
+    parse_block("0:$");
+    set_output_io("(block definitions)",push_definitions,NULL);
+    init_buffer();
+    init_progress();
+    init_commands(&ctx->cmds);
+    open_commands(&ctx->cmds);
+    execute_program(&ctx->cmds);
+    close_commands(&ctx->cmds);
+
+    for(i = 0;i < def_count;i++)
+    {
+        if(bbe_finish(defs[i]) == -1) panic(bbe_error(defs[i]),NULL,NULL);
+    }
+}
+
 int
 main (int argc, char **argv)
 {
     int opt;
+    int files_from = 0;
+    int only_block = 0,hexdump = 0;
+    int i,to_stdout;
+    char *serve_socket = NULL;
+    char *cache_dir = NULL;
+    int workers = 0;
+
+    new_definition();
+    sink_threads = 1;
 
-    block.type = 0;
-    cmds.block_start = NULL;
-    cmds.byte = NULL;
-    cmds.block_end = NULL;
 #ifdef HAVE_GETOPT_LONG
     while ((opt = getopt_long(argc,argv,short_opts,long_opts,NULL)) != -1)
 #else
@@ -759,20 +269,73 @@ main (int argc, char **argv)
         switch(opt)
         {
             case 'b':
-                if(block.type) panic("Only one -b option allowed",NULL,NULL);
+                if(ctx->block.type) new_definition();
                 parse_block(optarg);
+                serve_block(optarg);
                 break;
             case 'e':
+                serve_commands(optarg);
                 parse_commands(optarg);
                 break;
             case 'f':
                 parse_command_file(optarg);
+                serve_command_file(optarg);
                 break;
             case 'o':
                 set_output_file(optarg);
                 break;
+            case 'F':
+                ctx = defs[0];                          // input files are in the first context
+                set_input_files_from(optarg);
+                ctx = defs[def_count - 1];
+                files_from = 1;
+                break;
             case 's':
-                output_only_block = 1;
+                only_block = 1;
+                break;
+            case 'x':
+                hexdump = 1;
+                break;
+            case 'S':
+                stats_mode = STATS_SUMMARY;
+                if(optarg != NULL)
+                {
+                    if(strcmp(optarg,"bytes") != 0) panic("Unknown statistics",optarg,NULL);
+                    stats_mode = STATS_BYTES;
+                }
+                break;
+            case 'C':
+                scan_mode = SCAN_COUNT;
+                break;
+            case 'L':
+                scan_mode = SCAN_LIST;
+                break;
+            case 'X':
+                extract_block = parse_long(optarg);
+                if(extract_block < 1) panic("Block number must be at least one",optarg,NULL);
+                break;
+            case 'k':
+                parse_sort_key(optarg);
+                break;
+            case 'R':
+                init_report();
+                break;
+            case 'P':
+                progress_interval = (int) parse_long(optarg);
+                if(progress_interval < 1) panic("Progress interval must be at least one second",optarg,NULL);
+                break;
+            case 'M':
+                metrics_file = xstrdup(optarg);
+                break;
+            case 'D':
+                serve_socket = optarg;
+                break;
+            case 'N':
+                workers = (int) parse_long(optarg);
+                if(workers < 1) panic("Number of workers must be at least one",optarg,NULL);
+                break;
+            case 'K':
+                cache_dir = optarg;
                 break;
             case '?':
                 help(stdout);
@@ -788,20 +351,79 @@ main (int argc, char **argv)
                 break;
         }
     }
-    if(!block.type) parse_block("0:$");
-    if(out_stream.file == NULL) set_output_file(NULL);
+    if(serve_socket != NULL)
+    {
+        if(optind < argc || files_from) panic("Input files are given by the jobs of daemon",NULL,NULL);
+        if(extract_block || stats_mode || scan_mode || sort_mode || stats_report || progress_interval || metrics_file != NULL || cache_dir != NULL)
+            panic("Options -S, -C, -L, -X, -k, -R, -P, -M and -K cannot be used with --serve",NULL,NULL);
+        for(i = 0;i < def_count;i++)
+        {
+            if(defs[i]->out_stream.file != NULL) panic("Output files are given by the jobs of daemon",NULL,NULL);
+        }
+        serve(serve_socket,workers,(only_block ? BBE_SUPPRESS : 0) | (hexdump ? BBE_HEXDUMP : 0));
+    }
+
+    to_stdout = 0;
+    for(i = 0;i < def_count;i++)
+    {
+        ctx = defs[i];
+        if(!ctx->block.type) parse_block("0:$");
+        if(ctx->out_stream.file == NULL)
+        {
+            if(to_stdout++) panic("Only one block definition can write to standard output, use -o",NULL,NULL);
+            set_output_file(NULL);
+        }
+        ctx->output_only_block = only_block;
+        ctx->output_hexdump = hexdump;
+        if(cache_dir != NULL) ctx->cache_dir = xstrdup(cache_dir);
+    }
+    ctx = defs[0];
 
     if(optind < argc)
     {
         while(optind < argc) set_input_file(argv[optind++]);
-    } else
+    } else if(!files_from)
     {
         set_input_file("-");
     }
 
+    if(def_count > 1)
+    {
+        if(extract_block || stats_mode || scan_mode || sort_mode) panic("Only one block definition allowed with -S, -C, -L, -X and -k",NULL,NULL);
+        run_definitions();
+        exit(EXIT_SUCCESS);
+    }
+
+    if(extract_block)
+    {
+        execute_extract(extract_block);
+        exit(EXIT_SUCCESS);
+    }
     init_buffer();
-    init_commands(&cmds);
-    execute_program(&cmds);
-    close_commands(&cmds); 
+    init_progress();
+    if(stats_mode)
+    {
+        ctx->output_only_block = 1;
+        execute_stats();
+        exit(EXIT_SUCCESS);
+    }
+    if(scan_mode)
+    {
+        ctx->output_only_block = 1;
+        execute_scan();
+        exit(EXIT_SUCCESS);
+    }
+    if(sort_mode)
+    {
+        if(ctx->cmds.block_start != NULL || ctx->cmds.byte != NULL || ctx->cmds.block_end != NULL)
+            panic("Commands cannot be used with -k",NULL,NULL);
+        ctx->output_only_block = 1;
+        execute_sort();
+        exit(EXIT_SUCCESS);
+    }
+    init_commands(&ctx->cmds);
+    open_commands(&ctx->cmds);
+    execute_program(&ctx->cmds);
+    close_commands(&ctx->cmds);
     exit(EXIT_SUCCESS);
 }
@@ -46,7 +46,15 @@
 #include <unistd.h>
 #endif 
 
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
 #include <stdio.h>
+#include <signal.h>
+#include <setjmp.h>
+
+#include "libbbe.h"
 
 #ifndef HAVE_OFF_T
 #define long int off_t
@@ -59,7 +67,9 @@
 #define EXIT_FAILURE 1
 #define EXIT_SUCCESS 0
 
-/* Input buffer size */
+/* Input buffer size, buffer is refilled when read position passes INPUT_BUFFER_SAFE,
+   so at least INPUT_BUFFER_LOW bytes after read position are always in buffer. This
+   margin limits the length of search strings, also when the buffer is a ring */
 #define INPUT_BUFFER_LOW (16*1024)
 #define INPUT_BUFFER_SIZE (16*INPUT_BUFFER_LOW)
 #define INPUT_BUFFER_SAFE (INPUT_BUFFER_SIZE - INPUT_BUFFER_LOW)
@@ -69,6 +79,55 @@
 #define OUTPUT_BUFFER_SIZE (16*OUTPUT_BUFFER_LOW)
 #define OUTPUT_BUFFER_SAFE (OUTPUT_BUFFER_SIZE - OUTPUT_BUFFER_LOW)
 
+/* write_buffer writes at least this long data directly to output stream */
+#define DIRECT_WRITE_SIZE (OUTPUT_BUFFER_SIZE / 4)
+
+/* extra room needed in the output of span functions, in addition to ratio * length */
+#define SPAN_SLACK 32
+
+/* conversions of c command, index to convert_strings */
+#define CONVERT_BCD_ASC 0
+#define CONVERT_ASC_BCD 1
+#define CONVERT_BIN_HEX 2
+#define CONVERT_HEX_BIN 3
+#define CONVERT_BIN_B64 4
+#define CONVERT_B64_BIN 5
+#define CONVERT_BCD_EBC 6
+#define CONVERT_EBC_BCD 7
+#define CONVERT_ZON_ASC 8
+#define CONVERT_ASC_ZON 9
+#define CONVERT_ASC_EBC 10
+#define CONVERT_EBC_ASC 11
+
+/* digests of H and V commands, index to digest_strings */
+#define DIGEST_CRC32C 0
+#define DIGEST_XXH64  1
+#define DIGEST_SHA256 2
+
+/* modes of --stats */
+#define STATS_SUMMARY 1
+#define STATS_BYTES   2
+
+/* modes of --count and --list-offsets */
+#define SCAN_COUNT 1
+#define SCAN_LIST  2
+
+/* phases of --stats-report */
+#define PHASE_OTHER   0
+#define PHASE_READ    1
+#define PHASE_FIND    2
+#define PHASE_MARK    3
+#define PHASE_EXECUTE 4
+#define PHASE_FLUSH   5
+#define PHASE_WRITE   6
+#define PHASE_W       7
+#define PHASES        8
+
+/* --stats-report counters, nothing is done if report is not asked */
+#define REPORT_ADD(counter,n) do { if(stats_report) report.counter += (off_t) (n); } while(0)
+#define PHASE_BEGIN(p) int saved_phase = stats_report ? report_phase(p) : PHASE_OTHER
+#define PHASE_END() do { if(stats_report) report_phase(saved_phase); } while(0)
+
 /* block types */
 #define BLOCK_START_M 1
 #define BLOCK_START_S 2
@@ -102,15 +161,22 @@ struct block {
 
 struct command_list {
     char letter;            // command letter (D,A,s,..)
-    off_t offset;           // n for D,r,i and d commands
-    off_t count;              // count for d command
-    unsigned char *s1;      // string for A,I,r,i,s,w and y commands
+    off_t offset;           // n for D,r,i and d commands, digest format for H and V, mapped file for < and >
+    off_t count;              // count for d command, conversion for c command, algorithm for H and V
+    unsigned char *s1;      // string for A,I,r,i,s,w,y and k commands, file for P
     off_t s1_len;
-    unsigned char *s2;      // replace for s and dest for y 
+    unsigned char *s2;      // replace for s, dest for y and file contents for < and >
     off_t s2_len;
     int rpos;               // replace position for s,r and y
     off_t fpos;             // found pos for s-command
-    FILE *fd;               // stream for w command
+    struct w_sink *sink;    // output sink for w command
+    struct w_container *container;  // container for W command
+    struct block_digest *digest;    // digest state for H and V commands
+    struct sub_block *sub;          // sub-block of { command
+    struct block_set *set;          // blocks seen by U command
+    struct field *field;            // integer field of n command
+    struct patch_table *patches;    // patch table of P command
+    struct block_filter *filter;    // deferred predicate of k and K commands
     struct command_list *next;
 };
 
@@ -120,17 +186,63 @@ struct commands {
     struct command_list *block_end;
 };
 
+/* operations of n command */
+#define FIELD_SET 0
+#define FIELD_ADD 1
+#define FIELD_SUB 2
+#define FIELD_PRINT 3
+#define FIELD_EQ 4              // this and the following are comparisons
+#define FIELD_NE 5
+#define FIELD_LT 6
+#define FIELD_LE 7
+#define FIELD_GT 8
+#define FIELD_GE 9
+
+/* integer field of n command, load and store are selected by type */
+struct field {
+    int type;                   // field type, width and byte order
+    int width;                  // bytes
+    int op;
+    uint64_t value;
+    char format;                // D, O or H for p operation
+    uint64_t (*load)(unsigned char *p);
+    void (*store)(unsigned char *p,uint64_t v);
+};
+
+/* default memory limit of U command */
+#define SET_MEMORY_LIMIT (64 * 1024 * 1024)
+
+/* max nesting of sub-blocks */
+#define SUB_BLOCK_DEPTH 16
+
+/* sub-block of { command, offsets are stream offsets */
+struct sub_block {
+    struct block block;         // sub-block definition
+    struct commands cmds;       // commands of sub-block
+    int inside;                 // current byte is in sub-block
+    int deleted;                // D command for current sub-block
+    int skipped;                // J or L command for current sub-block
+    int inserting;              // commands of sub-block are inserting bytes
+    off_t parent;               // start of the enclosing block
+    off_t start;                // first byte of current sub-block
+    off_t end;                  // last byte of current sub-block, -1 if not yet known
+    off_t pos;                  // last byte handled
+    off_t number;               // number of current sub-block, first = 1
+};
+
 /* in/out files */
 struct io_file {
     char *file;
     int fd;
     off_t start_offset;
-    struct io_file *next;
+    bbe_io_fn io;           // used instead of fd if not NULL
+    void *io_arg;
 };
 
 /* input buffer */
 struct input_buffer {
-    unsigned char *buffer;       // buffer to be malloced
+    unsigned char *buffer;       // buffer to be malloced, start of the buffer in ring
+    unsigned char *ring;         // mirrored mapping of the buffer, NULL if buffer is malloced
     unsigned char *read_pos;     // current read position
     unsigned char *low_pos;      // low water mark
     unsigned char *block_end;    // end of current block (if in buffer)
@@ -146,14 +258,130 @@ struct output_buffer {
     unsigned char *end;
     unsigned char *write_pos;    // current write psotion;
     unsigned char *low_pos;      // low water mark
+    unsigned char *digest_pos;   // bytes before this are added to block digests
     off_t block_offset;          // block offset (start = 0) number of bytes written at position write_pos
 };
+
+/* output collected to memory, see libbbe.c */
+struct memory_output {
+    unsigned char *data;
+    size_t length;
+    size_t size;
+    size_t pulled;          // bytes already taken by bbe_pull
+};
+
+/* hexdump width and state of -x output */
+#define HEXDUMP_WIDTH 16
+
+/* State of the editor, everything what one run of bbe needs. Functions work on
+   the context of the calling thread, ctx, which is set by the library functions
+   in libbbe.c. Different contexts can be used in different threads at the same time */
+struct bbe_ctx {
+    struct block block;                 // block definition
+    struct commands cmds;               // commands to be executed
+    char *panic_info;                   // extra info for panic
+    int output_only_block;              // -s
+    int output_hexdump;                 // -x
+    int hold_output;                    // whole block must be kept in output buffer
+    int block_digests;                  // there are H or V commands
+    int commands_ready;                 // init_commands is done
+
+    /* input and output */
+    struct io_file out_stream;
+    int out_opened;                     // out_stream.fd is opened by set_output_file
+    struct memory_output memory;        // output if no output file or function is given
+    struct io_file *in_files;           // input files, opened when they are needed
+    int in_file_count;
+    int in_file_size;
+    int in_file;                        // file being read
+    struct bbe_ctx *file_ctx;           // context reading the files of pushed input, for file names
+    struct input_buffer in_buffer;
+    struct output_buffer out_buffer;
+
+    /* state of execute.c */
+    int delete_this_byte;               // current byte should be deleted
+    int delete_this_block;              // current block should be deleted
+    int skip_this_block;                // current block should be skipped
+    int drop_this_block;                // k or K command dropped the block, nothing is written
+    int filters_pending;                // k and K commands waiting for the end of the block
+    unsigned char *filter_pos;          // first byte of the block not tested by them
+    int filter_hold;                    // hold_output before the block
+    int inserting;                      // i or s commands are inserting bytes
+    int w_commands_block_num;           // there are w commands having %B or W commands
+    struct command_list *current_byte_commands;
+    int span_program;                   // byte commands are executed for spans
+    struct span_stage *span_stages;
+    int span_stage_count;
+    off_t span_chunk;                   // max input of one round of span program
+    off_t span_pos;                     // stream offset of the input of the round
+    struct byte_segment *byte_segments; // byte commands indexed by block offset
+    int byte_segment_count;
+    int byte_segment;                   // segment of the current byte
+    unsigned char *span_buffer[2];      // output of span stages
+
+    /* state of format.c */
+    unsigned char hexdump_line[HEXDUMP_WIDTH];  // incomplete hexdump line
+    int hexdump_line_len;
+    off_t hexdump_offset;
+    unsigned char *hexdump_out;
+    char number_string[128];            // result of off_t_to_string
+
+    /* state of digest.c */
+    struct block_digest **digests;
+    int digest_count;
+
+    /* state of cache.c */
+    char *cache_dir;                    // -K directory, NULL if blocks are not cached
+    char *cache_path;                   // directory of the commands, NULL if commands cannot be cached
+    unsigned char cache_script[16];     // key of block definition and commands
+    off_t cache_numbers;                // block numbers above this are same in key, 0 no number, -1 every number
+    int cache_offset;                   // stream offset and file name are in key (F and N commands)
+    int cache_capture;                  // output of current block is collected to cache_data
+    unsigned char cache_key[16];        // key of current block
+    unsigned char *cache_data;
+    size_t cache_length;
+    size_t cache_size;
+
+    /* errors */
+    jmp_buf *error_jump;                // panic jumps here if not NULL, otherwise exits
+    char error[512];                    // message of the last error
+    char *script;                       // contents of command file being parsed
+    char *parse_temp[2];                // temporary buffers of parser
+    int parse_error;                    // commands or block definition have errors
+    struct commands *sub_commands[SUB_BLOCK_DEPTH];    // commands of open { commands
+    int sub_depth;
+
+    /* bbe_push and bbe_finish */
+    struct push_state *push;
+};
+
+/* counters of --stats-report */
+struct run_report {
+    off_t bytes_read;
+    off_t read_calls;           // read system calls
+    off_t refills;              // calls of read_input_stream
+    off_t bytes_moved;          // bytes moved to the beginning of input buffer
+    off_t bytes_written;
+    off_t write_calls;          // write and writev system calls
+    off_t w_bytes;              // bytes written by w and W commands
+    off_t w_files;              // files written by w commands
+    off_t cache_hits;           // blocks written from -K cache
+    off_t cache_misses;         // blocks executed and stored to cache
+    double time[PHASES];        // seconds spent in phases
+};
     
 
 
+/* panic exits or jumps back to the library function, it never returns */
+#ifdef __GNUC__
+#define BBE_NORETURN __attribute__((noreturn))
+#else
+#define BBE_NORETURN
+#endif
+
 /* function prototypes */
 extern void 
-panic(char *msg,char *info,char *syserror);
+panic(char *msg,char *info,char *syserror) BBE_NORETURN;
 
 extern void *
 xmalloc (size_t size);
@@ -164,9 +392,15 @@ set_output_file(char *file);
 extern void
 set_input_file(char *file);
 
+extern void
+set_input_files_from(char *list);
+
 extern void
 init_buffer();
 
+extern void
+free_input_buffer();
+
 extern inline unsigned char  
 read_byte();
 
@@ -224,10 +458,320 @@ block_end_pos();
 extern char *
 xstrdup(char *str);
 
+extern void *
+xrealloc(void *ptr,size_t size);
+
+extern void
+write_output_fd(unsigned char *buffer, ssize_t length);
+
+extern void
+write_output_stream(unsigned char *buffer, ssize_t length);
+
+extern off_t
+block_span();
+
+extern int
+skip_span(off_t count);
+
+extern unsigned char *
+reserve_buffer(off_t length);
+
+extern void
+commit_buffer(off_t length);
+
+extern void
+init_format_tables();
+
+extern char *
+byte_to_string(unsigned char byte,char format);
+
+extern char *
+off_t_to_string(off_t number,char format);
+
+extern unsigned char *
+make_p_table(unsigned char *formats,off_t format_count,off_t *stride);
+
+extern off_t
+p_format_span(struct command_list *c,unsigned char *in,off_t length,unsigned char *out);
+
+extern off_t
+hex_p_span(unsigned char *in,off_t length,unsigned char *out);
+
+extern void
+hex_encode(unsigned char *in,off_t length,unsigned char *out);
+
+extern void
+write_hexdump(unsigned char *buffer,off_t length);
+
+extern void
+flush_hexdump();
+
+extern void
+init_codec_tables();
+
+extern off_t
+convert_span(struct command_list *c,unsigned char *in,off_t length,unsigned char *out,int last);
+
+extern off_t
+convert_ratio(struct command_list *c);
+
+extern unsigned char *
+convert_map(struct command_list *c);
+
+extern void
+make_room(off_t length);
+
+extern void
+discard_buffer();
+
+extern void
+update_block_digests();
+
+extern void
+init_digest(struct command_list *c);
+
+extern void
+reset_digests();
+
+extern void
+update_digests(unsigned char *buf,off_t length);
+
+extern void
+write_digest(struct command_list *c);
+
+extern int
+verify_digest(struct command_list *c);
+
+extern void
+execute_stats();
+
+extern void
+execute_scan();
+
+extern void
+parse_sort_key(char *key);
+
+extern void
+execute_sort();
+
+extern int
+regular_input_file(off_t *start);
+
+extern struct w_sink *
+sink_create(char *file);
+
+extern void
+sink_write(struct w_sink *s,unsigned char *buf,size_t length);
+
+extern void
+sink_next_file(struct w_sink *s,char *file);
+
+extern void
+sink_close(struct w_sink *s);
+
+extern void
+sink_shutdown();
+
+extern struct w_container *
+container_create(char *file);
+
+extern void
+container_block(struct w_container *w,off_t block_number);
+
+extern void
+container_write(struct w_container *w,unsigned char *buf,size_t length);
+
+extern void
+container_close(struct w_container *w);
+
+extern void
+execute_extract(off_t block_number);
+
+extern void
+init_report();
+
+extern void
+start_counters();
+
+extern double
+monotonic_time();
+
+extern char *
+phase_name(int p);
+
+extern off_t
+input_size();
+
+extern void
+init_progress();
+
+extern void
+show_progress();
+
+extern int
+report_phase(int p);
+
+extern void
+set_output_io(char *name,bbe_io_fn io,void *arg);
+
+extern void
+set_input_io(char *name,bbe_io_fn io,void *arg);
+
+extern void
+clear_input_files();
+
+extern void
+clear_output_stream();
+
+extern void
+open_commands(struct commands *c);
+
+extern void
+discard_commands(struct commands *c);
+
+extern void
+free_commands(struct commands *c);
+
+extern void
+init_digest_tables();
+
+extern void
+free_digests();
+
+extern uint64_t
+hash64(unsigned char *p,off_t length,uint64_t seed);
+
+extern void
+hash_key(unsigned char *p,off_t length,unsigned char *key);
+
+extern struct block_set *
+set_create(off_t window,size_t limit,int verify);
+
+extern void
+set_clear(struct block_set *s);
+
+extern void
+set_free(struct block_set *s);
+
+extern int
+seen_block(struct block_set *s);
+
+extern struct field *
+parse_field(char **token,int count,char *command_string);
+
+extern void
+execute_field(struct command_list *c);
+
+extern unsigned char *
+available_end();
+
+extern int
+block_matches(struct command_list *c);
+
+extern struct block_filter *
+filter_create(struct command_list *c);
+
+extern void
+filter_free(struct block_filter *f);
+
+extern void
+defer_block_match(struct command_list *c);
+
+extern void
+filter_input();
+
+extern int
+deferred_block_matches();
+
+extern void
+reset_filters();
+
+extern void
+load_patches(struct command_list *c);
+
+extern void
+free_patches(struct patch_table *t);
+
+extern void
+patch_byte(struct patch_table *t);
+
+extern off_t
+patch_span(struct patch_table *t,unsigned char *in,off_t length,unsigned char *out,off_t pos);
+
+extern void
+hash_patches(struct patch_table *t,unsigned char *key);
+
+extern void
+open_cache(struct commands *commands);
+
+extern int
+cached_block();
+
+extern void
+capture_output(unsigned char *buf,off_t length);
+
+extern void
+store_block();
+
+extern void
+free_cache();
+
+extern void
+sink_discard(struct w_sink *s);
+
+extern void
+container_discard(struct w_container *w);
+
+extern off_t
+parse_long(char *long_int);
+
+extern unsigned char *
+parse_string(char *string,off_t *length);
+
+extern void
+parse_block(char *bs);
+
+extern void
+parse_commands(char *command_string);
+
+extern void
+parse_command_file(char *file);
+
+extern void
+parse_failed();
+
+extern void
+serve_definition();
+
+extern void
+serve_block(char *block);
+
+extern void
+serve_commands(char *commands);
+
+extern void
+serve_command_file(char *file);
+
+extern void
+serve(char *path,int workers,int options);
+
+/* context of the calling thread */
+#ifdef __GNUC__
+#define BBE_THREAD __thread
+#else
+#define BBE_THREAD
+#endif
+
 /* global variables */
-extern struct block block;
-extern struct command *commands;
-extern struct io_file out_stream;
-extern struct input_buffer in_buffer;
-extern struct output_buffer out_buffer;
-extern int output_only_block;
+extern BBE_THREAD struct bbe_ctx *ctx;
+extern int sink_threads;
+extern int stats_mode;
+extern int scan_mode;
+extern int sort_mode;
+extern off_t extract_block;
+extern int stats_report;
+extern struct run_report report;
+extern char *program;
+extern int progress_interval;
+extern char *metrics_file;
+extern volatile sig_atomic_t progress_requested;
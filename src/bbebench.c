@@ -0,0 +1,454 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* bbebench - throughput benchmark for bbe, run with "make bench".
+   Test data is generated with a fixed seed so that every run uses the same input,
+   then bbe is run for a matrix of block definitions and scripts. Results are
+   written to standard output as JSON: MB/s of input and blocks/s for every case,
+   best of the repeated runs */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 32
+
+/* one benchmark case */
+struct bench_case {
+    char *name;
+    char *input;                // data set
+    char *block;                // block definition
+    char *commands[4];          // -e commands, NULL terminated
+};
+
+/* data sets */
+#define DATA_RECORDS "records"
+#define DATA_BINARY "binary"
+#define DATA_ADVERSARIAL "adversarial"
+
+#define A31B "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab"
+
+static struct bench_case cases[] = {
+    /* block types of parse_block */
+    {"block N:M",DATA_RECORDS,"4096:16777216",{NULL}},
+    {"block :M",DATA_BINARY,":4096",{NULL}},
+    {"block /s/:M",DATA_RECORDS,"%<rec>%:64",{NULL}},
+    {"block /s/:/t/",DATA_RECORDS,"%<rec>%:%</rec>%",{NULL}},
+    {"block /s/:",DATA_RECORDS,"%<rec>%:",{NULL}},
+    {"block :/t/",DATA_RECORDS,":%</rec>%",{NULL}},
+
+    /* strings having long prefix of partial matches */
+    {"adversarial /s/:M",DATA_ADVERSARIAL,"/" A31B "/:64",{NULL}},
+    {"adversarial :/t/",DATA_ADVERSARIAL,":/" A31B "/",{NULL}},
+    {"adversarial /s/:/t/",DATA_ADVERSARIAL,"/" A31B "/:/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaac/",{NULL}},
+
+    /* block commands */
+    {"command D",DATA_RECORDS,"%<rec>%:%</rec>%",{"J 1","D 2",NULL}},
+    {"command I",DATA_RECORDS,"%<rec>%:%</rec>%",{"I >>",NULL}},
+    {"command J",DATA_RECORDS,"%<rec>%:%</rec>%",{"J 10","s/a/b/",NULL}},
+    {"command L",DATA_RECORDS,"%<rec>%:%</rec>%",{"L 10","s/a/b/",NULL}},
+    {"command N",DATA_RECORDS,"%<rec>%:%</rec>%",{"N",NULL}},
+    {"command F",DATA_RECORDS,"%<rec>%:%</rec>%",{"F H",NULL}},
+    {"command B",DATA_RECORDS,"%<rec>%:%</rec>%",{"B D",NULL}},
+    {"command >",DATA_RECORDS,"%<rec>%:%</rec>%",{"> bench.ins",NULL}},
+    {"command A",DATA_RECORDS,"%<rec>%:%</rec>%",{"A \\n",NULL}},
+    {"command <",DATA_RECORDS,"%<rec>%:%</rec>%",{"< bench.ins",NULL}},
+    {"command H CRC32C",DATA_RECORDS,"%<rec>%:%</rec>%",{"H CRC32C",NULL}},
+    {"command H XXH64",DATA_RECORDS,"%<rec>%:%</rec>%",{"H XXH64",NULL}},
+    {"command H SHA256",DATA_RECORDS,"%<rec>%:%</rec>%",{"H SHA256",NULL}},
+    {"command V",DATA_RECORDS,"%<rec>%:%</rec>%",{"V CRC32C R F bad",NULL}},
+
+    /* byte commands */
+    {"command c ASC EBC",DATA_RECORDS,"%<rec>%:%</rec>%",{"c ASC EBC",NULL}},
+    {"command c BIN HEX",DATA_BINARY,":4096",{"c BIN HEX",NULL}},
+    {"command c BIN B64",DATA_BINARY,":4096",{"c BIN B64",NULL}},
+    {"command d",DATA_RECORDS,"%<rec>%:%</rec>%",{"d 5 3",NULL}},
+    {"command i",DATA_RECORDS,"%<rec>%:%</rec>%",{"i 5 XX",NULL}},
+    {"command r",DATA_RECORDS,"%<rec>%:%</rec>%",{"r 5 YY",NULL}},
+    {"command s",DATA_RECORDS,"%<rec>%:%</rec>%",{"s/fox/cat/",NULL}},
+    {"command y",DATA_RECORDS,"%<rec>%:%</rec>%",{"y/abc/xyz/",NULL}},
+    {"command w",DATA_RECORDS,"%<rec>%:%</rec>%",{"w bench.w",NULL}},
+    {"command W",DATA_RECORDS,"%<rec>%:%</rec>%",{"W bench.W",NULL}},
+    {"command j",DATA_RECORDS,"%<rec>%:%</rec>%",{"j 5","s/a/b/",NULL}},
+    {"command l",DATA_RECORDS,"%<rec>%:%</rec>%",{"l 100","s/a/b/",NULL}},
+    {"command p",DATA_BINARY,":4096",{"p H",NULL}},
+    {"command &",DATA_BINARY,":4096",{"& \\xdf",NULL}},
+    {"command |",DATA_BINARY,":4096",{"| \\x20",NULL}},
+    {"command ^",DATA_BINARY,":4096",{"^ \\x01",NULL}},
+    {"command ~",DATA_BINARY,":4096",{"~",NULL}},
+    {"command x",DATA_BINARY,":4096",{"x",NULL}},
+    {"command u",DATA_RECORDS,"%<rec>%:%</rec>%",{"u 5 Z",NULL}},
+    {"command f",DATA_RECORDS,"%<rec>%:%</rec>%",{"f 5 Z",NULL}},
+    {NULL,NULL,NULL,{NULL}}
+};
+
+static char *program = "bbebench";
+static char *bbe;
+static char *data_dir;
+static off_t data_size = 64 * 1024 * 1024;
+static int repeats = 3;
+
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+static void
+panic(char *msg,char *info,char *syserror)
+{
+    fprintf(stderr,"%s: %s",program,msg);
+    if(info != NULL) fprintf(stderr,": %s",info);
+    if(syserror != NULL) fprintf(stderr,"; %s",syserror);
+    fprintf(stderr,"\n");
+    exit(EXIT_FAILURE);
+}
+
+/* xorshift64*, same sequence on every platform */
+static unsigned long long
+next_random()
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545f4914f6cdd1dULL;
+}
+
+static char *
+data_file(char *name)
+{
+    static char file[4096];
+
+    sprintf(file,"%.4000s/%s",data_dir,name);
+    return file;
+}
+
+/* text records "<rec>...</rec>\n" with 20 to 2000 bytes of payload */
+static void
+write_records(FILE *fp)
+{
+    static char alphabet[] = "abcdefghijklmnopqrstuvwxyz    0123456789";
+    static char *words[] = {"fox","dog","The quick brown ","lazy ","\n"};
+    off_t written = 0;
+    int length,i;
+    char *w;
+
+    while(written < data_size)
+    {
+        fputs("<rec>",fp);
+        length = 20 + (int) (next_random() % 1981);
+        for(i = 0;i < length;i++)
+        {
+            if(next_random() % 64 == 0)
+            {
+                w = words[next_random() % 5];
+                fputs(w,fp);
+                i += (int) strlen(w) - 1;
+            } else
+            {
+                putc(alphabet[next_random() % (sizeof(alphabet) - 1)],fp);
+            }
+        }
+        fputs("</rec>\n",fp);
+        written += length + 12;
+    }
+}
+
+static void
+write_binary(FILE *fp)
+{
+    unsigned long long r;
+    off_t i;
+    int j;
+
+    for(i = 0;i < data_size;i += 8)
+    {
+        r = next_random();
+        for(j = 0;j < 8;j++)
+        {
+            putc((int) (r & 0xff),fp);
+            r >>= 8;
+        }
+    }
+}
+
+/* runs of a having a b at the end, so that every position of the run is
+   a partial match of "aaa...ab" */
+static void
+write_adversarial(FILE *fp)
+{
+    off_t written = 0;
+    int length,i;
+
+    while(written < data_size)
+    {
+        length = 1000 + (int) (next_random() % 3000);
+        for(i = 0;i < length;i++) putc('a',fp);
+        putc('b',fp);
+        written += length + 1;
+    }
+}
+
+static void
+generate(char *name,void (*writer)(FILE *))
+{
+    FILE *fp;
+    char *file = data_file(name);
+
+    fp = fopen(file,"w");
+    if(fp == NULL) panic("Cannot open file for writing",file,strerror(errno));
+    writer(fp);
+    if(fclose(fp) != 0) panic("Error in closing file",file,strerror(errno));
+}
+
+static double
+now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+}
+
+/* run bbe in data directory, output goes to out_fd, returns exit status */
+static int
+run_bbe(char **argv,int out_fd)
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if(pid == -1) panic("Cannot fork",NULL,strerror(errno));
+    if(pid == 0)
+    {
+        if(chdir(data_dir) == -1) _exit(127);
+        dup2(out_fd,STDOUT_FILENO);
+        execv(bbe,argv);
+        _exit(127);
+    }
+    if(waitpid(pid,&status,0) == -1) panic("Error waiting bbe",NULL,strerror(errno));
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* argument list for case c, extra option before input file */
+static void
+make_args(struct bench_case *c,char **argv,char *option)
+{
+    int n = 0,i;
+
+    argv[n++] = bbe;
+    argv[n++] = "-b";
+    argv[n++] = c->block;
+    for(i = 0;c->commands[i] != NULL;i++)
+    {
+        argv[n++] = "-e";
+        argv[n++] = c->commands[i];
+    }
+    if(option != NULL) argv[n++] = option;
+    argv[n++] = c->input;
+    argv[n] = NULL;
+}
+
+/* number of blocks with bbe -C */
+static long long
+count_blocks(struct bench_case *c)
+{
+    char *argv[MAX_ARGS];
+    char buf[64];
+    int fd,status;
+    ssize_t r;
+    FILE *tmp;
+
+    argv[0] = bbe;                      // commands do not change the blocks
+    argv[1] = "-b";
+    argv[2] = c->block;
+    argv[3] = "-C";
+    argv[4] = c->input;
+    argv[5] = NULL;
+
+    tmp = tmpfile();
+    if(tmp == NULL) panic("Cannot create temporary file",NULL,strerror(errno));
+    fd = fileno(tmp);
+    status = run_bbe(argv,fd);
+    if(status != 0) panic("bbe failed",c->name,NULL);
+    lseek(fd,0,SEEK_SET);
+    r = read(fd,buf,sizeof(buf) - 1);
+    fclose(tmp);
+    if(r <= 0) return 0;
+    buf[r] = 0;
+    return atoll(buf);
+}
+
+/* write string as JSON string */
+static void
+json_string(char *s)
+{
+    putchar('"');
+    for(;*s;s++)
+    {
+        if(*s == '"' || *s == '\\')
+        {
+            printf("\\%c",*s);
+        } else if((unsigned char) *s < 0x20)
+        {
+            printf("\\u%04x",(unsigned char) *s);
+        } else
+        {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+static void
+run_case(struct bench_case *c,int first)
+{
+    char *argv[MAX_ARGS];
+    double start,t,best = -1;
+    long long blocks;
+    struct stat st;
+    int null_fd,i,status = 0;
+
+    if(stat(data_file(c->input),&st) == -1) panic("Cannot stat",c->input,strerror(errno));
+    blocks = count_blocks(c);
+
+    null_fd = open("/dev/null",O_WRONLY);
+    if(null_fd == -1) panic("Cannot open /dev/null",NULL,strerror(errno));
+    make_args(c,argv,NULL);
+    for(i = 0;i < repeats;i++)
+    {
+        start = now();
+        status = run_bbe(argv,null_fd);
+        t = now() - start;
+        if(status != 0) break;
+        if(best < 0 || t < best) best = t;
+    }
+    close(null_fd);
+    if(best <= 0) best = 1e-6;
+
+    printf("%s    {\"name\": ",first ? "" : ",\n");
+    json_string(c->name);
+    printf(", \"input\": ");
+    json_string(c->input);
+    printf(", \"block\": ");
+    json_string(c->block);
+    printf(", \"commands\": [");
+    for(i = 0;c->commands[i] != NULL;i++)
+    {
+        if(i) printf(", ");
+        json_string(c->commands[i]);
+    }
+    printf("], \"status\": %d, \"bytes\": %lld, \"blocks\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"blocks_per_s\": %.0f}",
+            status,(long long) st.st_size,blocks,best,(double) st.st_size / best / (1024.0 * 1024.0),(double) blocks / best);
+    fflush(stdout);
+}
+
+static void
+usage()
+{
+    fprintf(stderr,"Usage: %s [-s size-in-MB] [-r repeats] [-d data-directory] [-m name-prefix] bbe\n",program);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc,char **argv)
+{
+    struct bench_case *c;
+    int opt,first = 1;
+    char *match = NULL;
+    char *file;
+    FILE *fp;
+
+    data_dir = "bench-data";
+    while((opt = getopt(argc,argv,"s:r:d:m:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                data_size = (off_t) atol(optarg) * 1024 * 1024;
+                if(data_size <= 0) usage();
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                if(repeats < 1) usage();
+                break;
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 'm':
+                match = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if(optind != argc - 1) usage();
+    bbe = argv[optind];
+    if(bbe[0] != '/')           // bbe is run in data directory
+    {
+        bbe = malloc(4096 + strlen(argv[optind]));
+        if(bbe == NULL || getcwd(bbe,4096) == NULL) panic("Cannot get current directory",NULL,strerror(errno));
+        strcat(bbe,"/");
+        strcat(bbe,argv[optind]);
+    }
+
+    if(mkdir(data_dir,0777) == -1 && errno != EEXIST) panic("Cannot create directory",data_dir,strerror(errno));
+    fprintf(stderr,"%s: generating %lld MB of test data to %s\n",program,(long long) (data_size / (1024 * 1024)),data_dir);
+    generate(DATA_RECORDS,write_records);
+    generate(DATA_BINARY,write_binary);
+    generate(DATA_ADVERSARIAL,write_adversarial);
+    file = data_file("bench.ins");
+    fp = fopen(file,"w");
+    if(fp == NULL) panic("Cannot open file for writing",file,strerror(errno));
+    fputs("-- inserted --\n",fp);
+    fclose(fp);
+
+    printf("{\n  \"bbe\": ");
+    json_string(argv[optind]);
+    printf(",\n  \"size\": %lld,\n  \"repeats\": %d,\n  \"results\": [\n",(long long) data_size,repeats);
+    for(c = cases;c->name != NULL;c++)
+    {
+        if(match != NULL && strncmp(c->name,match,strlen(match)) != 0) continue;
+        fprintf(stderr,"%s: %s\n",program,c->name);
+        run_case(c,first);
+        first = 0;
+    }
+    printf("\n  ]\n}\n");
+
+    unlink(data_file(DATA_RECORDS));
+    unlink(data_file(DATA_BINARY));
+    unlink(data_file(DATA_ADVERSARIAL));
+    unlink(data_file("bench.ins"));
+    unlink(data_file("bench.w"));
+    unlink(data_file("bench.W"));
+    unlink(data_file("bench.W.idx"));
+    rmdir(data_dir);
+    return EXIT_SUCCESS;
+}
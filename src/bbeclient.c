@@ -0,0 +1,139 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* bbeclient - sends one request to bbe --serve and writes the reply to standard
+   output, used by "make check". Arguments after the socket are the fields of the
+   request. Files of -i and -o are opened and passed with the request in the order they
+   are given */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define REQUEST_SIZE 8192
+
+static char *program = "bbeclient";
+
+static void
+panic(char *msg,char *info,char *syserror)
+{
+    fprintf(stderr,"%s: %s",program,msg);
+    if(info != NULL) fprintf(stderr,": %s",info);
+    if(syserror != NULL) fprintf(stderr,"; %s",syserror);
+    fprintf(stderr,"\n");
+    exit(EXIT_FAILURE);
+}
+
+static void
+usage()
+{
+    fprintf(stderr,"Usage: %s [-i input-file] [-o output-file] socket field...\n",program);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc,char **argv)
+{
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    char request[REQUEST_SIZE],reply[REQUEST_SIZE];
+    int fds[2];
+    int opt,fd_count = 0,sock,i;
+    ssize_t r;
+
+    while((opt = getopt(argc,argv,"i:o:")) != -1)
+    {
+        if(fd_count == 2) usage();
+        switch(opt)
+        {
+            case 'i':
+                fds[fd_count] = open(optarg,O_RDONLY);
+                if(fds[fd_count++] == -1) panic("Cannot open file for reading",optarg,strerror(errno));
+                break;
+            case 'o':
+                fds[fd_count] = open(optarg,O_WRONLY | O_CREAT | O_TRUNC,0666);
+                if(fds[fd_count++] == -1) panic("Cannot open file for writing",optarg,strerror(errno));
+                break;
+            default:
+                usage();
+        }
+    }
+    if(optind > argc - 2) usage();
+    if(strlen(argv[optind]) >= sizeof(addr.sun_path)) panic("Socket name too long",argv[optind],NULL);
+
+    request[0] = 0;
+    for(i = optind + 1;i < argc;i++)
+    {
+        if(strlen(request) + strlen(argv[i]) + 2 > sizeof(request)) panic("Request too long",NULL,NULL);
+        strcat(request,argv[i]);
+        strcat(request,"\n");
+    }
+
+    sock = socket(AF_UNIX,SOCK_SEQPACKET,0);
+    if(sock == -1) panic("Cannot create socket",argv[optind],strerror(errno));
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,argv[optind]);
+    if(connect(sock,(struct sockaddr *) &addr,sizeof(addr)) == -1) panic("Cannot connect",argv[optind],strerror(errno));
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = request;
+    iov.iov_len = strlen(request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(fd_count)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg),fds,fd_count * sizeof(int));
+    }
+    if(sendmsg(sock,&msg,0) == -1) panic("Cannot send request",argv[optind],strerror(errno));
+
+    do r = recv(sock,reply,sizeof(reply) - 1,0); while(r == -1 && errno == EINTR);
+    if(r == -1) panic("Cannot receive reply",argv[optind],strerror(errno));
+    if(r == 0) panic("No reply",argv[optind],NULL);
+    reply[r] = 0;
+    fputs(reply,stdout);
+    close(sock);
+    return strncmp(reply,"OK",2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -27,166 +27,433 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/uio.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
-/* output file */
-struct io_file out_stream;
-
-/* list of input files, points to current file */
-struct io_file *in_stream = NULL;
-struct io_file *in_stream_start = NULL;
-
-/* input buffer */
-struct input_buffer in_buffer;
-
-/* output buffer */
-struct output_buffer out_buffer;
+/* amount of the next file to be read ahead when current file is opened */
+#define READ_AHEAD_SIZE (4 * INPUT_BUFFER_SIZE)
 
 /* open the output file */
 void 
 set_output_file(char *file)
 {
-    if (out_stream.file != NULL) panic("Only one output file can be defined",NULL,NULL);
+    if (ctx->out_stream.file != NULL) panic("Only one output file can be defined",NULL,NULL);
 
+    ctx->out_stream.io = NULL;
     if(file == NULL)
     {
-        out_stream.fd = STDOUT_FILENO;
-        out_stream.file = "(stdout)";
+        ctx->out_stream.fd = STDOUT_FILENO;
+        ctx->out_stream.file = "(stdout)";
     } else
     {
-        out_stream.fd = open(file,O_WRONLY | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-        if(out_stream.fd == -1) panic("Cannot open for writing",file,strerror(errno));
-        out_stream.file = xstrdup(file);
+        ctx->out_stream.fd = open(file,O_WRONLY | O_CREAT | O_TRUNC,S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+        if(ctx->out_stream.fd == -1) panic("Cannot open for writing",file,strerror(errno));
+        ctx->out_stream.file = xstrdup(file);
+        ctx->out_opened = 1;
     }
 }
 
-/* write to output stream from arbitrary buffer */
+/* output is written with function io instead of a file */
 void
-write_output_stream(unsigned char *buffer, ssize_t length)
+set_output_io(char *name,bbe_io_fn io,void *arg)
 {
-    if(write(out_stream.fd,buffer,length) == -1) panic("Error writing to",out_stream.file,strerror(errno));
-}
+    if (ctx->out_stream.file != NULL) panic("Only one output file can be defined",NULL,NULL);
 
+    ctx->out_stream.fd = -1;
+    ctx->out_stream.file = name;
+    ctx->out_stream.io = io;
+    ctx->out_stream.io_arg = arg;
+}
 
-/* open a input file and put it in input file list */
+/* write to output file from arbitrary buffer */
 void
-set_input_file(char *file)
+write_output_fd(unsigned char *buffer, ssize_t length)
 {
-    struct io_file *new,*curr;
+    ssize_t written;
+    PHASE_BEGIN(PHASE_WRITE);
 
-    new = xmalloc(sizeof(struct io_file));
-    new->next = NULL;
+    while(length > 0)
+    {
+        if(ctx->out_stream.io != NULL)
+        {
+            written = ctx->out_stream.io(ctx->out_stream.io_arg,buffer,(size_t) length);
+        } else
+        {
+            written = write(ctx->out_stream.fd,buffer,length);
+        }
+        if(written == -1) panic("Error writing to",ctx->out_stream.file,strerror(errno));
+        REPORT_ADD(write_calls,1);
+        REPORT_ADD(bytes_written,written);
+        buffer += written;
+        length -= written;
+    }
+    PHASE_END();
+}
 
-    if(in_stream ==  NULL)
+/* write to output stream from arbitrary buffer */
+void
+write_output_stream(unsigned char *buffer, ssize_t length)
+{
+    if(ctx->cache_capture) capture_output(buffer,(off_t) length);
+    if(ctx->output_hexdump)
     {
-        in_stream = new;
-        in_stream_start = in_stream;
+        write_hexdump(buffer,(off_t) length);
     } else
     {
-        curr = in_stream;
-        while(curr->next != NULL) 
-        {
-            curr = curr->next;
-        }
-        curr->next = new;
+        write_output_fd(buffer,length);
     }
+}
+
+
+/* put a input file to input file list, file is opened when it is needed */
+static void
+add_input_file(char *file)
+{
+    struct io_file *new;
+
+    if(ctx->in_file_count == ctx->in_file_size)
+    {
+        ctx->in_file_size = ctx->in_file_size ? 2 * ctx->in_file_size : 64;
+        ctx->in_files = xrealloc(ctx->in_files,ctx->in_file_size * sizeof(struct io_file));
+    }
+    new = &ctx->in_files[ctx->in_file_count++];
 
     new->start_offset = (off_t) 0;
+    new->io = NULL;
     if(file[0] == '-' && file[1] == 0)
     {
         new->fd = STDIN_FILENO;
-        new->file = "(stdin)";
+        new->file = xstrdup("(stdin)");
     } else
     {
-        new->fd = open(file,O_RDONLY);
-        if(new->fd == -1) panic("Cannot open file for reading",file,strerror(errno));
+        new->fd = -1;
         new->file = xstrdup(file);
     }
 }
 
-/* return the name of current input file */
+/* input file given by user, file must be readable already now, so that
+   missing files are found before anything is written */
+void
+set_input_file(char *file)
+{
+    if((file[0] != '-' || file[1] != 0) && access(file,R_OK) == -1) panic("Cannot open file for reading",file,strerror(errno));
+    add_input_file(file);
+}
+
+/* input is read with function io instead of a file */
+void
+set_input_io(char *name,bbe_io_fn io,void *arg)
+{
+    add_input_file(name);
+    ctx->in_files[ctx->in_file_count - 1].fd = -1;
+    ctx->in_files[ctx->in_file_count - 1].io = io;
+    ctx->in_files[ctx->in_file_count - 1].io_arg = arg;
+}
+
+/* forget input files after run, files which are still open are closed */
+void
+clear_input_files()
+{
+    struct io_file *f;
+    int i;
+
+    for(i = 0;i < ctx->in_file_count;i++)
+    {
+        f = &ctx->in_files[i];
+        if(i >= ctx->in_file && f->io == NULL && f->fd != -1 && f->fd != STDIN_FILENO) close(f->fd);
+        free(f->file);
+    }
+    ctx->in_file_count = 0;
+    ctx->in_file = 0;
+}
+
+/* read input file names from file, one name in a line */
+void
+set_input_files_from(char *list)
+{
+    FILE *fp;
+    char *line;
+    size_t line_len = 4096;
+    size_t len;
+
+    line = xmalloc(line_len);
+    if(list[0] == '-' && list[1] == 0)
+    {
+        fp = stdin;
+    } else
+    {
+        fp = fopen(list,"r");
+        if(fp == NULL) panic("Error in opening file",list,strerror(errno));
+    }
+
+#ifdef HAVE_GETLINE
+    while(getline(&line,&line_len,fp) != -1)
+#else
+    while(fgets(line,line_len,fp) != NULL)
+#endif
+    {
+        len = strlen(line);
+        if(len && line[len - 1] == '\n') line[--len] = 0;
+        if(len && line[len - 1] == '\r') line[--len] = 0;
+        if(len) set_input_file(line);
+    }
+
+    if(ferror(fp)) panic("Error reading file",list,strerror(errno));
+    if(fp != stdin) fclose(fp);
+    free(line);
+}
+
+static void
+open_file(struct io_file *f)
+{
+    if(f->fd != -1 || f->io != NULL) return;
+    f->fd = open(f->file,O_RDONLY);
+    if(f->fd == -1) panic("Cannot open file for reading",f->file,strerror(errno));
+}
+
+/* open file n and the file after it, beginning of the next file is read ahead
+   so that it is in the page cache when it is needed */
+static void
+open_input_file(int n)
+{
+    if(n >= ctx->in_file_count) return;
+    open_file(&ctx->in_files[n]);
+    if(n + 1 < ctx->in_file_count && ctx->in_files[n + 1].fd == -1 && ctx->in_files[n + 1].io == NULL)
+    {
+        open_file(&ctx->in_files[n + 1]);
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(ctx->in_files[n + 1].fd,0,READ_AHEAD_SIZE,POSIX_FADV_WILLNEED);
+#endif
+    }
+}
+
+/* total size of input files, -1 if some input is not a regular file */
+off_t
+input_size()
+{
+    struct stat st;
+    off_t total = 0;
+    int i;
+
+    for(i = 0;i < ctx->in_file_count;i++)
+    {
+        if(ctx->in_files[i].io != NULL) return (off_t) -1;
+        if(ctx->in_files[i].fd == -1)
+        {
+            if(stat(ctx->in_files[i].file,&st) == -1) return (off_t) -1;
+        } else
+        {
+            if(fstat(ctx->in_files[i].fd,&st) == -1) return (off_t) -1;
+        }
+        if(!S_ISREG(st.st_mode)) return (off_t) -1;
+        total += st.st_size;
+    }
+    return total;
+}
+
+/* returns the file descriptor of input if input is one file, otherwise -1.
+   Current position of the file is returned in start. Must be called before reading */
+int
+regular_input_file(off_t *start)
+{
+    if(ctx->in_file_count != 1 || ctx->in_files[0].io != NULL) return -1;
+    open_input_file(0);
+    *start = lseek(ctx->in_files[0].fd,0,SEEK_CUR);
+    if(*start == (off_t) -1) return -1;
+    return ctx->in_files[0].fd;
+}
+
+/* return the name of current input file, the last file
+   reached by reading, starting at or before current offset. Input pushed
+   from a context reading files unchanged has the names of its files */
 char *
 get_current_file(void)
 {
-    struct io_file *f = in_stream_start;
-    struct io_file *prev;
-    off_t current_offset = in_buffer.stream_offset + (off_t) (in_buffer.read_pos-in_buffer.buffer);
+    off_t current_offset = ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos-ctx->in_buffer.buffer);
+    struct bbe_ctx *f = ctx->file_ctx != NULL ? ctx->file_ctx : ctx;
+    int low,high,mid;
 
-    if(f == NULL) return "";
+    if(!f->in_file_count) return "";
 
-    while(f != NULL)
+    low = 0;
+    high = f->in_file < f->in_file_count ? f->in_file : f->in_file_count - 1;
+    while(low < high)
     {
-        prev = f;
-        f = f->next;
-        if(f != NULL && (f->start_offset == (off_t) 0 || f->start_offset > current_offset)) 
+        mid = low + (high - low + 1) / 2;
+        if(f->in_files[mid].start_offset <= current_offset)
         {
-            f = NULL;
+            low = mid;
+        } else
+        {
+            high = mid - 1;
         }
     }
-    return prev->file;
+    return f->in_files[low].file;
 }
 
 
 
-/* initialize in and out buffers */
+/* input buffer as a ring: memory file mapped twice back to back, so that
+   INPUT_BUFFER_SIZE bytes starting anywhere in the first mapping are contiguous.
+   Buffer is refilled by moving the start of the buffer to the read position
+   instead of moving the unread data to the beginning of the buffer.
+   Returns NULL if ring cannot be made or BBE_NO_RING is set (for testing),
+   buffer is then malloced */
+static unsigned char *
+ring_create()
+{
+#ifdef HAVE_MEMFD_CREATE
+    unsigned char *ring;
+    int fd;
+
+    if(getenv("BBE_NO_RING") != NULL) return NULL;
+    fd = memfd_create("bbe input",MFD_CLOEXEC);
+    if(fd == -1) return NULL;
+    ring = MAP_FAILED;
+    if(ftruncate(fd,INPUT_BUFFER_SIZE) == 0) ring = mmap(NULL,2 * INPUT_BUFFER_SIZE,PROT_NONE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if(ring != MAP_FAILED)
+    {
+        if(mmap(ring,INPUT_BUFFER_SIZE,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_FIXED,fd,0) == MAP_FAILED ||
+           mmap(ring + INPUT_BUFFER_SIZE,INPUT_BUFFER_SIZE,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_FIXED,fd,0) == MAP_FAILED)
+        {
+            munmap(ring,2 * INPUT_BUFFER_SIZE);
+            ring = MAP_FAILED;
+        }
+    }
+    close(fd);
+    return ring == MAP_FAILED ? NULL : ring;
+#else
+    return NULL;
+#endif
+}
+
+/* release the input buffer */
 void
-init_buffer()
+free_input_buffer()
 {
-    in_buffer.buffer = xmalloc(INPUT_BUFFER_SIZE);
-    in_buffer.read_pos = NULL;
-    in_buffer.stream_end = NULL;
-    in_buffer.low_pos = in_buffer.buffer + INPUT_BUFFER_SAFE;
-    in_buffer.block_num = 0;
+#ifdef HAVE_MEMFD_CREATE
+    if(ctx->in_buffer.ring != NULL)
+    {
+        munmap(ctx->in_buffer.ring,2 * INPUT_BUFFER_SIZE);
+    } else
+#endif
+    {
+        free(ctx->in_buffer.buffer);
+    }
+    ctx->in_buffer.ring = NULL;
+    ctx->in_buffer.buffer = NULL;
+}
 
-    out_buffer.buffer = xmalloc(OUTPUT_BUFFER_SIZE);
-    out_buffer.end = out_buffer.buffer + OUTPUT_BUFFER_SIZE;
-    out_buffer.write_pos = out_buffer.buffer;
-    out_buffer.low_pos = out_buffer.buffer + OUTPUT_BUFFER_SAFE;
+/* initialize in and out buffers for a new run, buffers are allocated in the first run */
+void
+init_buffer()
+{
+    if(ctx->in_buffer.buffer == NULL)
+    {
+        ctx->in_buffer.ring = ring_create();
+        ctx->in_buffer.buffer = ctx->in_buffer.ring != NULL ? ctx->in_buffer.ring : xmalloc(INPUT_BUFFER_SIZE);
+    }
+    if(ctx->in_buffer.ring != NULL) ctx->in_buffer.buffer = ctx->in_buffer.ring;
+    ctx->in_buffer.read_pos = NULL;
+    ctx->in_buffer.block_end = NULL;
+    ctx->in_buffer.stream_end = NULL;
+    ctx->in_buffer.low_pos = ctx->in_buffer.buffer + INPUT_BUFFER_SAFE;
+    ctx->in_buffer.stream_offset = 0;
+    ctx->in_buffer.block_offset = 0;
+    ctx->in_buffer.block_num = 0;
+    ctx->in_file = 0;
+
+    if(ctx->out_buffer.buffer == NULL)
+    {
+        ctx->out_buffer.buffer = xmalloc(OUTPUT_BUFFER_SIZE);
+        ctx->out_buffer.end = ctx->out_buffer.buffer + OUTPUT_BUFFER_SIZE;
+    }
+    ctx->out_buffer.write_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.low_pos = ctx->out_buffer.buffer + OUTPUT_BUFFER_SAFE;
+    ctx->out_buffer.digest_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.block_offset = 0;
 }
 
 ssize_t
 read_input_stream()
 {
-    ssize_t read_count,last_read,to_be_read,to_be_saved;
+    ssize_t read_count,last_read,to_be_read,to_be_saved,shift;
     unsigned char *buffer_write_pos;
+    struct io_file *f;
+    PHASE_BEGIN(PHASE_READ);
 
-    if(in_buffer.stream_end != NULL) return (ssize_t) 0;  // can't read more
+    if(ctx->in_buffer.stream_end != NULL)        // can't read more
+    {
+        PHASE_END();
+        return (ssize_t) 0;
+    }
+    REPORT_ADD(refills,1);
+    if(progress_requested) show_progress();
 
-    if(in_buffer.read_pos == NULL)        // first read, so just fill buffer
+    if(ctx->in_buffer.read_pos == NULL)        // first read, so just fill buffer
     {
         to_be_read = INPUT_BUFFER_SIZE;
         to_be_saved = 0;
-        buffer_write_pos = in_buffer.buffer;
-        in_buffer.stream_offset = (off_t) 0;
+        buffer_write_pos = ctx->in_buffer.buffer;
+        ctx->in_buffer.stream_offset = (off_t) 0;
     } else                                            //we have allready read something
     {
-        to_be_read = in_buffer.read_pos - in_buffer.buffer;
+        to_be_read = ctx->in_buffer.read_pos - ctx->in_buffer.buffer;
         to_be_saved = (ssize_t) INPUT_BUFFER_SIZE - to_be_read;
-        if (to_be_saved > INPUT_BUFFER_SIZE / 2) panic("buffer error: reading to half full buffer",NULL,NULL);
-        memcpy(in_buffer.buffer,in_buffer.read_pos,to_be_saved);    // move "low water" part to beginning of buffer
-        buffer_write_pos = in_buffer.buffer + to_be_saved;
-        in_buffer.stream_offset += (off_t) to_be_read;
-        if(in_buffer.block_end != NULL) in_buffer.block_end -= to_be_read;
+        if(ctx->in_buffer.ring != NULL)
+        {
+            /* new data is read over the bytes before read_pos */
+            shift = 0;
+            if(ctx->in_buffer.read_pos >= ctx->in_buffer.ring + INPUT_BUFFER_SIZE) shift = INPUT_BUFFER_SIZE;
+            ctx->in_buffer.buffer = ctx->in_buffer.read_pos - shift;
+            ctx->in_buffer.low_pos = ctx->in_buffer.buffer + INPUT_BUFFER_SAFE;
+            if(ctx->in_buffer.block_end != NULL) ctx->in_buffer.block_end -= shift;
+        } else
+        {
+            if (to_be_saved > INPUT_BUFFER_SIZE / 2) panic("buffer error: reading to half full buffer",NULL,NULL);
+            memcpy(ctx->in_buffer.buffer,ctx->in_buffer.read_pos,to_be_saved);    // move "low water" part to beginning of buffer
+            REPORT_ADD(bytes_moved,to_be_saved);
+            if(ctx->in_buffer.block_end != NULL) ctx->in_buffer.block_end -= to_be_read;
+        }
+        buffer_write_pos = ctx->in_buffer.buffer + to_be_saved;
+        ctx->in_buffer.stream_offset += (off_t) to_be_read;
     }
 
-    in_buffer.read_pos = in_buffer.buffer;
+    ctx->in_buffer.read_pos = ctx->in_buffer.buffer;
 
     read_count = 0;
-    do
+    if(ctx->in_file < ctx->in_file_count) open_input_file(ctx->in_file);
+    while(ctx->in_file < ctx->in_file_count && read_count < to_be_read)
     {
-         last_read = read(in_stream->fd,buffer_write_pos + read_count,(size_t) (to_be_read - read_count));
-         if (last_read == -1) panic("Error reading file",in_stream->file,strerror(errno));
+         f = &ctx->in_files[ctx->in_file];
+         if(f->io != NULL)
+         {
+             last_read = f->io(f->io_arg,buffer_write_pos + read_count,(size_t) (to_be_read - read_count));
+         } else
+         {
+             last_read = read(f->fd,buffer_write_pos + read_count,(size_t) (to_be_read - read_count));
+         }
+         if (last_read == -1) panic("Error reading file",f->file,strerror(errno));
+         REPORT_ADD(read_calls,1);
+         REPORT_ADD(bytes_read,last_read);
          if (last_read == 0) 
          { 
-             if (close(in_stream->fd) == -1) panic("Error in closing file",in_stream->file,strerror(errno));
-             in_stream = in_stream->next;
-             if (in_stream != NULL) 
-                 in_stream->start_offset = in_buffer.stream_offset + (off_t) read_count + (off_t) to_be_saved;
+             if (f->io == NULL && close(f->fd) == -1) panic("Error in closing file",f->file,strerror(errno));
+             ctx->in_file++;
+             if (ctx->in_file < ctx->in_file_count) 
+             {
+                 ctx->in_files[ctx->in_file].start_offset = ctx->in_buffer.stream_offset + (off_t) read_count + (off_t) to_be_saved;
+                 open_input_file(ctx->in_file);
+             }
          }
          read_count += last_read;
-    } while (in_stream != NULL && read_count < to_be_read);
+    }
 
-    if (read_count < to_be_read) in_buffer.stream_end = buffer_write_pos + read_count - 1;
+    if (read_count < to_be_read) ctx->in_buffer.stream_end = buffer_write_pos + read_count - 1;
 
+    PHASE_END();
     return read_count;
 }
 
@@ -194,21 +461,21 @@ read_input_stream()
 inline unsigned char  
 read_byte()
 {
-    return *in_buffer.read_pos;
+    return *ctx->in_buffer.read_pos;
 }
 
 /* returns pointer to the read position */
 inline unsigned char *
 read_pos()
 {
-    return in_buffer.read_pos;
+    return ctx->in_buffer.read_pos;
 }
 
 /* return the block end pointer */
 inline unsigned char *
 block_end_pos()
 {
-    return in_buffer.block_end;
+    return ctx->in_buffer.block_end;
 }
 
 /* advances the read pointer, if buffer has reached low water, get more from stream to buffer */
@@ -217,61 +484,88 @@ block_end_pos()
 inline int 
 get_next_byte()
 {
-    if(in_buffer.read_pos >= in_buffer.low_pos) 
+    if(ctx->in_buffer.read_pos >= ctx->in_buffer.low_pos) 
     {
+        if(ctx->filters_pending) filter_input();
         read_input_stream(); 
-        if(in_buffer.block_end == NULL) mark_block_end();
+        if(ctx->filters_pending) ctx->filter_pos = ctx->in_buffer.read_pos;
+        if(ctx->in_buffer.block_end == NULL) mark_block_end();
     }
 
-    if(in_buffer.stream_end != NULL)
+    if(ctx->in_buffer.stream_end != NULL)
     {
-        if(in_buffer.read_pos >= in_buffer.stream_end)
+        if(ctx->in_buffer.read_pos >= ctx->in_buffer.stream_end)
         {
             return 0;
         }
     } 
 
-    in_buffer.read_pos++;
-    in_buffer.block_offset++;
+    ctx->in_buffer.read_pos++;
+    ctx->in_buffer.block_offset++;
     return 1;
 }
 
+/* returns the number of bytes of the current block, starting from read_pos, which can be
+   read without refilling the buffer. start of the span is read_pos */
+off_t
+block_span()
+{
+    if(ctx->in_buffer.block_end != NULL) return (off_t) (ctx->in_buffer.block_end - ctx->in_buffer.read_pos) + 1;
+    if(ctx->in_buffer.stream_end != NULL) return (off_t) (ctx->in_buffer.stream_end - ctx->in_buffer.read_pos) + 1;
+    if(ctx->in_buffer.read_pos >= ctx->in_buffer.low_pos) return (off_t) 1;
+    return (off_t) (ctx->in_buffer.low_pos - ctx->in_buffer.read_pos) + 1;
+}
+
+/* advance the read pointer over count bytes returned by block_span, read_pos will point to
+   the byte after the span or to the last byte of the block.
+   returns true if the span was the end of the block */
+int
+skip_span(off_t count)
+{
+    ctx->in_buffer.read_pos += count - 1;
+    ctx->in_buffer.block_offset += count - 1;
+    if(last_byte()) return 1;
+    get_next_byte();
+    return 0;
+}
+
 /* check if the eof current block is in buffer and mark it in_buffer.block_end */
 void
 mark_block_end()
 {
     unsigned char *safe_search,*scan;
     int i;
+    PHASE_BEGIN(PHASE_MARK);
 
-    if(in_buffer.stream_end != NULL)
+    if(ctx->in_buffer.stream_end != NULL)
     {
-        safe_search = in_buffer.stream_end;
+        safe_search = ctx->in_buffer.stream_end;
     } else
     {
-        safe_search = in_buffer.buffer + INPUT_BUFFER_SIZE;
+        safe_search = ctx->in_buffer.buffer + INPUT_BUFFER_SIZE - 1;     // last byte in buffer
     }
     
-    in_buffer.block_end = NULL;
+    ctx->in_buffer.block_end = NULL;
 
-    if(block.type & BLOCK_STOP_M)
+    if(ctx->block.type & BLOCK_STOP_M)
     {
-        in_buffer.block_end = in_buffer.read_pos + (block.stop.M - in_buffer.block_offset - 1);
-        if(in_buffer.block_end > safe_search) in_buffer.block_end = NULL;
+        ctx->in_buffer.block_end = ctx->in_buffer.read_pos + (ctx->block.stop.M - ctx->in_buffer.block_offset - 1);
+        if(ctx->in_buffer.block_end > safe_search) ctx->in_buffer.block_end = NULL;
     }
 
 
-    if(block.type & BLOCK_STOP_S)
+    if(ctx->block.type & BLOCK_STOP_S)
     {
-        scan = in_buffer.read_pos;
-        if(block.stop.S.length)
+        scan = ctx->in_buffer.read_pos;
+        if(ctx->block.stop.S.length)
         {
-            if(block.type & BLOCK_START_S && in_buffer.block_offset < block.start.S.length) 
-                scan += block.start.S.length - in_buffer.block_offset;
+            if(ctx->block.type & BLOCK_START_S && ctx->in_buffer.block_offset < ctx->block.start.S.length) 
+                scan += ctx->block.start.S.length - ctx->in_buffer.block_offset;
             i = 0;
-            while(scan <= safe_search - block.stop.S.length + 1 && i < block.stop.S.length) 
+            while(scan <= safe_search - ctx->block.stop.S.length + 1 && i < ctx->block.stop.S.length) 
             {
                 i = 0;
-                while(*scan == block.stop.S.string[i] && i < block.stop.S.length)
+                while(*scan == ctx->block.stop.S.string[i] && i < ctx->block.stop.S.length)
                 {
                     scan++;
                     i++;
@@ -285,26 +579,26 @@ mark_block_end()
                 }
             } 
 
-            if (i == block.stop.S.length)
+            if (i == ctx->block.stop.S.length)
             {
                 scan += i - 2;
-                in_buffer.block_end = scan;
+                ctx->in_buffer.block_end = scan;
             }
         } else
         {
-            if(block.type & BLOCK_START_S)
+            if(ctx->block.type & BLOCK_START_S)
             {
-                if(block.start.S.length)
+                if(ctx->block.start.S.length)
                 {
-                    if(in_buffer.block_offset < block.start.S.length)          // to skip block start
-                        scan += block.start.S.length - in_buffer.block_offset;
+                    if(ctx->in_buffer.block_offset < ctx->block.start.S.length)          // to skip block start
+                        scan += ctx->block.start.S.length - ctx->in_buffer.block_offset;
 
                     i = 0;
 
-                    while(scan <= safe_search - block.start.S.length + 1 && i < block.start.S.length) 
+                    while(scan <= safe_search - ctx->block.start.S.length + 1 && i < ctx->block.start.S.length) 
                     {
                         i = 0;
-                        while(*scan == block.start.S.string[i] && i < block.start.S.length)
+                        while(*scan == ctx->block.start.S.string[i] && i < ctx->block.start.S.length)
                         {
                             scan++;
                             i++;
@@ -318,9 +612,9 @@ mark_block_end()
                         }
                     }
 
-                    if (i == block.start.S.length)
+                    if (i == ctx->block.start.S.length)
                     {
-                        in_buffer.block_end = scan - 2;
+                        ctx->in_buffer.block_end = scan - 2;
                     }
                 } else
                 {
@@ -330,22 +624,23 @@ mark_block_end()
         }
     }
 
-    if(in_buffer.block_end ==  NULL && in_buffer.stream_end != NULL) 
-        in_buffer.block_end = in_buffer.stream_end;
+    if(ctx->in_buffer.block_end ==  NULL && ctx->in_buffer.stream_end != NULL) 
+        ctx->in_buffer.block_end = ctx->in_buffer.stream_end;
+    PHASE_END();
 }
 
 /* returns true if current byte is last in block */
 inline int
 last_byte()
 {
-    return in_buffer.block_end == in_buffer.read_pos;
+    return ctx->in_buffer.block_end == ctx->in_buffer.read_pos;
 }
 
 /* returns true if end of stream has been reached */
 inline int
 end_of_stream()
 {
-    if(in_buffer.stream_end != NULL && in_buffer.stream_end == in_buffer.read_pos) 
+    if(ctx->in_buffer.stream_end != NULL && ctx->in_buffer.stream_end == ctx->in_buffer.read_pos) 
     {
         return 1;
     } else
@@ -362,97 +657,107 @@ find_block()
     unsigned char *safe_search,*scan_start;
     register int i;
     int found;
+    PHASE_BEGIN(PHASE_FIND);
 
     found = 0;
 
-    if(end_of_stream() && last_byte()) return 0;
+    if(end_of_stream() && last_byte())
+    {
+        PHASE_END();
+        return 0;
+    }
 
-    if(in_buffer.read_pos == NULL)  // first read
+    if(ctx->in_buffer.read_pos == NULL)  // first read
     {
-        if(!read_input_stream()) return 0;  // zero size input
+        if(!read_input_stream())    // zero size input
+        {
+            PHASE_END();
+            return 0;
+        }
     }
     
-    in_buffer.block_offset = 0;
+    ctx->in_buffer.block_offset = 0;
 
 
     do
     {
-        if(in_buffer.read_pos >= in_buffer.low_pos) read_input_stream();
+        if(ctx->in_buffer.read_pos >= ctx->in_buffer.low_pos) read_input_stream();
 
-        if(last_byte()) in_buffer.read_pos++;
-        in_buffer.block_end = NULL;
+        if(last_byte()) ctx->in_buffer.read_pos++;
+        ctx->in_buffer.block_end = NULL;
 
-        scan_start = in_buffer.read_pos;
+        scan_start = ctx->in_buffer.read_pos;
 
-        if(in_buffer.stream_end != NULL)
+        if(ctx->in_buffer.stream_end != NULL)
         {
-            safe_search = in_buffer.stream_end;
+            safe_search = ctx->in_buffer.stream_end;
         } else
         {
-            safe_search = in_buffer.low_pos;
+            safe_search = ctx->in_buffer.low_pos;
         }
 
-        if (in_buffer.read_pos <= safe_search)
+        if (ctx->in_buffer.read_pos <= safe_search)
         {
-            if(block.type & BLOCK_START_M)
+            if(ctx->block.type & BLOCK_START_M)
             {
-                if(block.start.N >= in_buffer.stream_offset + (off_t) (in_buffer.read_pos-in_buffer.buffer) && 
-                   block.start.N <= in_buffer.stream_offset + (off_t) (safe_search-in_buffer.buffer))
+                if(ctx->block.start.N >= ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos-ctx->in_buffer.buffer) && 
+                   ctx->block.start.N <= ctx->in_buffer.stream_offset + (off_t) (safe_search-ctx->in_buffer.buffer))
                 {
-                    in_buffer.read_pos = in_buffer.buffer + (block.start.N-in_buffer.stream_offset);
+                    ctx->in_buffer.read_pos = ctx->in_buffer.buffer + (ctx->block.start.N-ctx->in_buffer.stream_offset);
                     found = 1;
                 } else
                 {
-                    in_buffer.read_pos = safe_search;
+                    ctx->in_buffer.read_pos = safe_search;
                 }
             }
 
-            if(block.type & BLOCK_START_S)
+            if(ctx->block.type & BLOCK_START_S)
             {
-                if(block.start.S.length > 0)
+                if(ctx->block.start.S.length > 0)
                 {
                     i = 0;
-                    if(in_buffer.stream_end == NULL) safe_search += block.start.S.length - 1;
-                    while(in_buffer.read_pos <= safe_search - block.start.S.length + 1 && i < block.start.S.length)
+                    if(ctx->in_buffer.stream_end == NULL) safe_search += ctx->block.start.S.length - 1;
+                    while(ctx->in_buffer.read_pos <= safe_search - ctx->block.start.S.length + 1 && i < ctx->block.start.S.length)
                     {
                         i = 0;
-                        while(*in_buffer.read_pos == block.start.S.string[i] && i < block.start.S.length)
+                        while(*ctx->in_buffer.read_pos == ctx->block.start.S.string[i] && i < ctx->block.start.S.length)
                         {
-                            in_buffer.read_pos++;
+                            ctx->in_buffer.read_pos++;
                             i++;
                         }
                         if(i) 
                         {
-                            in_buffer.read_pos -= i - 1;
+                            ctx->in_buffer.read_pos -= i - 1;
                         } else
                         {
-                            in_buffer.read_pos++;
+                            ctx->in_buffer.read_pos++;
                         }
                     }
 
-                    if(i == block.start.S.length)
+                    if(i == ctx->block.start.S.length)
                     {
-                        in_buffer.read_pos--;
+                        ctx->in_buffer.read_pos--;
                         found = 1;
-                    } else if(scan_start == in_buffer.read_pos)
+                    } else if(scan_start == ctx->in_buffer.read_pos)
                     {
-                        in_buffer.read_pos++;
+                        ctx->in_buffer.read_pos++;
                     }
 
-                    if(in_buffer.read_pos > in_buffer.stream_end && in_buffer.stream_end !=  NULL) in_buffer.read_pos--;
+                    if(ctx->in_buffer.read_pos > ctx->in_buffer.stream_end && ctx->in_buffer.stream_end !=  NULL) ctx->in_buffer.read_pos--;
 
                 } else
                 {
                     found = 1;
                 }
             }
-            if(in_buffer.read_pos > scan_start && !output_only_block) 
-                write_output_stream(scan_start,in_buffer.read_pos - scan_start);
+            if(ctx->in_buffer.read_pos > scan_start && !ctx->output_only_block) 
+                write_output_stream(scan_start,ctx->in_buffer.read_pos - scan_start);
             if(found) mark_block_end();
         }
     } while (!found && !end_of_stream());
-    if(end_of_stream() && !found && !output_only_block) write_output_stream(in_buffer.read_pos,1);
-    if(found) in_buffer.block_num++;
+    if(end_of_stream() && !found && !ctx->output_only_block) write_output_stream(ctx->in_buffer.read_pos,1);
+    if(found) ctx->in_buffer.block_num++;
+    PHASE_END();
     return found;
 }
 
@@ -460,37 +765,95 @@ find_block()
 void
 write_string(char *string)
 {
-    register char *f;
+    write_buffer(string,(off_t) strlen(string));
+}
 
-    f = string;
+/* write length bytes bypassing the output buffer, unwritten bytes of the
+   buffer are written with the same writev */
+static void
+write_direct(unsigned char *buf,off_t length)
+{
+    struct iovec iov[2];
+    ssize_t pending,written;
 
-    while(*f != 0) f++;
+    update_block_digests();
+    if(ctx->block_digests) update_digests(buf,length);
 
-    write_buffer(string,(off_t) (f - string));
+    pending = ctx->out_buffer.write_pos - ctx->out_buffer.buffer;
+    if(ctx->output_hexdump || ctx->out_stream.io != NULL || ctx->cache_capture)
+    {
+        write_output_stream(ctx->out_buffer.buffer,pending);
+        write_output_stream(buf,(ssize_t) length);
+    } else
+    {
+        iov[0].iov_base = ctx->out_buffer.buffer;
+        iov[0].iov_len = pending;
+        iov[1].iov_base = buf;
+        iov[1].iov_len = length;
+        written = writev(ctx->out_stream.fd,iov,2);
+        if(written == -1) panic("Error writing to",ctx->out_stream.file,strerror(errno));
+        REPORT_ADD(write_calls,1);
+        REPORT_ADD(bytes_written,written);
+        if(written < pending)
+        {
+            write_output_fd(ctx->out_buffer.buffer + written,pending - written);
+            written = pending;
+        }
+        write_output_fd(buf + (written - pending),(ssize_t) length - (written - pending));
+    }
+    write_w_command(ctx->out_buffer.buffer,pending);
+    write_w_command(buf,length);
+
+    ctx->out_buffer.write_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.digest_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.block_offset += length;
 }
 
-/* write_buffer at the current write position */
+/* write_buffer at the current write position, large writes bypass the buffer */
 void
 write_buffer(unsigned char *buf,off_t length)
 {
 
     if(!length) return;
 
-    if(out_buffer.write_pos + length >= out_buffer.end)
+    if(length >= DIRECT_WRITE_SIZE && !ctx->hold_output)
     {
-        if(out_buffer.write_pos == out_buffer.buffer) panic("Out buffer too small, should not happen!",NULL,NULL);
-        flush_buffer();
+        write_direct(buf,length);
+        return;
     }
-    memcpy(out_buffer.write_pos,buf,length);
-    out_buffer.write_pos += length;
-    out_buffer.block_offset += length;
+
+    if(ctx->out_buffer.write_pos + length >= ctx->out_buffer.end)
+    {
+        if(ctx->out_buffer.write_pos == ctx->out_buffer.buffer && !ctx->hold_output) panic("Out buffer too small, should not happen!",NULL,NULL);
+        make_room(length);
+    }
+    memcpy(ctx->out_buffer.write_pos,buf,length);
+    ctx->out_buffer.write_pos += length;
+    ctx->out_buffer.block_offset += length;
+}
+
+/* returns pointer to the write position where at least length bytes can be written,
+   length must be less than half of the buffer size. Bytes are written to buffer by commit_buffer */
+unsigned char *
+reserve_buffer(off_t length)
+{
+    if(ctx->out_buffer.write_pos + length >= ctx->out_buffer.end) make_room(length);
+    return ctx->out_buffer.write_pos;
+}
+
+/* mark length bytes after write position written */
+void
+commit_buffer(off_t length)
+{
+    ctx->out_buffer.write_pos += length;
+    ctx->out_buffer.block_offset += length;
 }
 
 /* put_byte, put one byte att current write position */
 inline void
 put_byte(unsigned char byte)
 {
-    *out_buffer.write_pos = byte;
+    *ctx->out_buffer.write_pos = byte;
 }
 
 /* next_byte, advance the write pointer by one */
@@ -498,27 +861,95 @@ put_byte(unsigned char byte)
 inline void
 write_next_byte()
 {
-    out_buffer.write_pos++;
-    out_buffer.block_offset++;
-    if(out_buffer.write_pos >= out_buffer.end)
+    ctx->out_buffer.write_pos++;
+    ctx->out_buffer.block_offset++;
+    if(ctx->out_buffer.write_pos >= ctx->out_buffer.end)
+    {
+        make_room((off_t) 1);
+    }
+}
+
+/* make room for length bytes after the write position. Buffer is flushed, or if
+   the whole block must be kept in buffer (V command dropping blocks) buffer is enlarged */
+void
+make_room(off_t length)
+{
+    off_t used,digested,size;
+
+    if(!ctx->hold_output)
     {
         flush_buffer();
+        return;
     }
+
+    used = ctx->out_buffer.write_pos - ctx->out_buffer.buffer;
+    digested = ctx->out_buffer.digest_pos - ctx->out_buffer.buffer;
+    size = ctx->out_buffer.end - ctx->out_buffer.buffer;
+    while(used + length >= size) size *= 2;
+
+    ctx->out_buffer.buffer = xrealloc(ctx->out_buffer.buffer,size);
+    ctx->out_buffer.end = ctx->out_buffer.buffer + size;
+    ctx->out_buffer.write_pos = ctx->out_buffer.buffer + used;
+    ctx->out_buffer.digest_pos = ctx->out_buffer.buffer + digested;
+    ctx->out_buffer.low_pos = ctx->out_buffer.end - OUTPUT_BUFFER_LOW;
+}
+
+/* drop the unwritten bytes of current block */
+void
+discard_buffer()
+{
+    ctx->out_buffer.write_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.digest_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.block_offset = 0;
+}
+
+/* add bytes written after last update to the digests of H and V commands */
+void
+update_block_digests()
+{
+    if(!ctx->block_digests) return;
+    update_digests(ctx->out_buffer.digest_pos,ctx->out_buffer.write_pos - ctx->out_buffer.digest_pos);
+    ctx->out_buffer.digest_pos = ctx->out_buffer.write_pos;
 }
 
 /* write unwritten data from buffer to disk */
 void
 flush_buffer()
 {
-    write_output_stream(out_buffer.buffer,out_buffer.write_pos - out_buffer.buffer);
-    write_w_command(out_buffer.buffer,out_buffer.write_pos - out_buffer.buffer);
-    out_buffer.write_pos = out_buffer.buffer;
+    PHASE_BEGIN(PHASE_FLUSH);
+
+    update_block_digests();
+    write_output_stream(ctx->out_buffer.buffer,ctx->out_buffer.write_pos - ctx->out_buffer.buffer);
+    write_w_command(ctx->out_buffer.buffer,ctx->out_buffer.write_pos - ctx->out_buffer.buffer);
+    ctx->out_buffer.write_pos = ctx->out_buffer.buffer;
+    ctx->out_buffer.digest_pos = ctx->out_buffer.buffer;
+    PHASE_END();
 }
 
 /* close_output_stream */
 void
 close_output_stream()
 {
-    if(close(out_stream.fd) == -1) panic("Error closing output stream",out_stream.file,strerror(errno));
+    int r = 0;
+
+    if(ctx->output_hexdump) flush_hexdump();
+    if(ctx->out_stream.io == NULL) r = close(ctx->out_stream.fd);
+    ctx->out_stream.fd = -1;
+    if(r == -1) panic("Error closing output stream",ctx->out_stream.file,strerror(errno));
+    clear_output_stream();
+}
+
+/* forget output file after run, file is closed if it is still open */
+void
+clear_output_stream()
+{
+    if(ctx->out_stream.io == NULL && ctx->out_stream.fd != -1 && ctx->out_stream.fd != STDOUT_FILENO) close(ctx->out_stream.fd);
+    if(ctx->out_opened) free(ctx->out_stream.file);
+    ctx->out_stream.file = NULL;
+    ctx->out_stream.fd = -1;
+    ctx->out_stream.io = NULL;
+    ctx->out_opened = 0;
+    ctx->hexdump_line_len = 0;
+    ctx->hexdump_offset = 0;
 }
 
@@ -0,0 +1,353 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* -K, --cache: output of every block is stored in a directory, the file name is
+   the key of the block. Key is a hash of the block definition, the commands and the
+   contents of the block, so when the same block is found again with the same
+   commands, the stored output is written and commands are not executed for it.
+
+   Output which depends on something else than the contents of the block is handled
+   by adding it to the key: block number for B, D n, J and L commands (for D, J and L
+   numbers above the largest n are the same) and stream offset and file name for F, N
+   and P commands. Blocks are not cached if the commands have w, W or U commands, or if
+   the whole block is not in the input buffer when it is found */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define CACHE_DIR_MODE (S_IRWXU | S_IRWXG | S_IRWXO)
+
+/* block number as such is in key */
+#define CACHE_EVERY_NUMBER ((off_t) -1)
+
+static void
+hash_block_definition(struct block *b,unsigned char *key);
+
+/* add command list to key, files of < and > commands are already read to s2 */
+static void
+hash_command_list(struct command_list *c,unsigned char *key)
+{
+    off_t fields[5];
+
+    while(c != NULL)
+    {
+        fields[0] = (off_t) c->letter;
+        fields[1] = c->offset;
+        fields[2] = c->count;
+        fields[3] = c->s1 == NULL ? (off_t) 0 : c->s1_len;
+        fields[4] = c->s2 == NULL ? (off_t) 0 : c->s2_len;
+        hash_key((unsigned char *) fields,(off_t) sizeof(fields),key);
+        if(fields[3]) hash_key(c->s1,fields[3],key);
+        if(fields[4]) hash_key(c->s2,fields[4],key);
+        if(c->patches != NULL) hash_patches(c->patches,key);
+        if(c->field != NULL)
+        {
+            fields[0] = (off_t) c->field->type;
+            fields[1] = (off_t) c->field->op;
+            fields[2] = (off_t) c->field->value;
+            fields[3] = (off_t) c->field->format;
+            hash_key((unsigned char *) fields,(off_t) (4 * sizeof(off_t)),key);
+        }
+        if(c->sub != NULL)
+        {
+            hash_block_definition(&c->sub->block,key);
+            hash_command_list(c->sub->cmds.block_start,key);
+            hash_command_list(c->sub->cmds.byte,key);
+            hash_command_list(c->sub->cmds.block_end,key);
+        }
+        c = c->next;
+    }
+    hash_key((unsigned char *) "",(off_t) 1,key);
+}
+
+static void
+hash_block_definition(struct block *b,unsigned char *key)
+{
+    off_t fields[3];
+
+    fields[0] = (off_t) b->type;
+    fields[1] = b->type & BLOCK_START_M ? b->start.N : b->start.S.length;
+    fields[2] = b->type & BLOCK_STOP_M ? b->stop.M : b->stop.S.length;
+    hash_key((unsigned char *) fields,(off_t) sizeof(fields),key);
+    if(b->type & BLOCK_START_S && b->start.S.length) hash_key(b->start.S.string,b->start.S.length,key);
+    if(b->type & BLOCK_STOP_S && b->stop.S.length) hash_key(b->stop.S.string,b->stop.S.length,key);
+}
+
+/* find the commands whose output depends on the block number or stream offset.
+   In sub-blocks B, D, J and L are for the sub-block numbers, which depend only
+   on the contents of the block */
+static int
+check_commands(struct command_list *c,int sub)
+{
+    for(;c != NULL;c = c->next)
+    {
+        switch(c->letter)
+        {
+            case 'w':
+            case 'W':
+            case 'U':
+                return 0;
+            case 'F':
+            case 'N':
+            case 'P':
+                ctx->cache_offset = 1;
+                break;
+            case 'B':
+                if(!sub) ctx->cache_numbers = CACHE_EVERY_NUMBER;
+                break;
+            case 'D':
+                if(!sub && ctx->cache_numbers != CACHE_EVERY_NUMBER && c->offset > ctx->cache_numbers) ctx->cache_numbers = c->offset;
+                break;
+            case 'J':
+            case 'L':
+                if(!sub && ctx->cache_numbers != CACHE_EVERY_NUMBER && c->count > ctx->cache_numbers) ctx->cache_numbers = c->count;
+                break;
+            case '{':
+                if(!check_commands(c->sub->cmds.block_start,1) ||
+                   !check_commands(c->sub->cmds.byte,1) ||
+                   !check_commands(c->sub->cmds.block_end,1)) return 0;
+                break;
+        }
+    }
+    return 1;
+}
+
+static void
+key_to_hex(unsigned char *key,char *hex)
+{
+    static char digits[] = "0123456789abcdef";
+    int i;
+
+    for(i = 0;i < 16;i++)
+    {
+        hex[2 * i] = digits[key[i] >> 4];
+        hex[2 * i + 1] = digits[key[i] & 0x0f];
+    }
+    hex[32] = 0;
+}
+
+static void
+make_directory(char *dir)
+{
+    if(mkdir(dir,CACHE_DIR_MODE) == -1 && errno != EEXIST) panic("Cannot create cache directory",dir,strerror(errno));
+}
+
+/* make key of the commands and the directory for their blocks, called at start of every run
+   after open_commands */
+void
+open_cache(struct commands *commands)
+{
+    char hex[33];
+
+    free(ctx->cache_path);
+    ctx->cache_path = NULL;
+    ctx->cache_capture = 0;
+    ctx->cache_numbers = 0;
+    ctx->cache_offset = 0;
+
+    if(!check_commands(commands->block_start,0) ||
+       !check_commands(commands->byte,0) ||
+       !check_commands(commands->block_end,0)) return;
+
+    memset(ctx->cache_script,0,sizeof(ctx->cache_script));
+#ifdef VERSION
+    hash_key((unsigned char *) VERSION,(off_t) strlen(VERSION),ctx->cache_script);
+#endif
+    hash_block_definition(&ctx->block,ctx->cache_script);
+    hash_command_list(commands->block_start,ctx->cache_script);
+    hash_command_list(commands->byte,ctx->cache_script);
+    hash_command_list(commands->block_end,ctx->cache_script);
+
+    make_directory(ctx->cache_dir);
+    key_to_hex(ctx->cache_script,hex);
+    ctx->cache_path = xmalloc(strlen(ctx->cache_dir) + 2 + 32 + 1);
+    sprintf(ctx->cache_path,"%s/%s",ctx->cache_dir,hex);
+    make_directory(ctx->cache_path);
+}
+
+/* file name of the current block */
+static char *
+block_file(char *hex)
+{
+    char *file;
+
+    key_to_hex(ctx->cache_key,hex);
+    file = xmalloc(strlen(ctx->cache_path) + 2 + 32 + 1);
+    sprintf(file,"%s/%s",ctx->cache_path,hex);
+    return file;
+}
+
+/* read the stored output of the current block to cache_data, returns false if
+   there is no output stored */
+static int
+read_block_file(char *file)
+{
+    struct stat st;
+    ssize_t r;
+    int fd;
+
+    fd = open(file,O_RDONLY);
+    if(fd == -1) return 0;
+    if(fstat(fd,&st) == -1) panic("Cannot stat file",file,strerror(errno));
+
+    if((size_t) st.st_size > ctx->cache_size)
+    {
+        ctx->cache_size = (size_t) st.st_size;
+        ctx->cache_data = xrealloc(ctx->cache_data,ctx->cache_size);
+    }
+    ctx->cache_length = 0;
+    while(ctx->cache_length < (size_t) st.st_size)
+    {
+        r = read(fd,ctx->cache_data + ctx->cache_length,(size_t) st.st_size - ctx->cache_length);
+        if(r == -1)
+        {
+            if(errno == EINTR) continue;
+            panic("Error reading file",file,strerror(errno));
+        }
+        if(!r) break;
+        ctx->cache_length += (size_t) r;
+    }
+    close(fd);
+    return ctx->cache_length == (size_t) st.st_size;
+}
+
+/* called after find_block. If the output of the block is in cache, it is written and
+   read position is moved to the last byte of the block. Otherwise output of the block is
+   collected for store_block. Returns true if block was written from cache */
+int
+cached_block()
+{
+    off_t context[2];
+    unsigned char *start;
+    char hex[33],*file,*name;
+    int found;
+
+    if(ctx->in_buffer.block_end == NULL) return 0;       // not all in buffer
+
+    start = ctx->in_buffer.read_pos;
+    memcpy(ctx->cache_key,ctx->cache_script,sizeof(ctx->cache_key));
+
+    context[0] = ctx->in_buffer.block_num;
+    if(!ctx->cache_numbers) context[0] = 0;
+    if(ctx->cache_numbers > 0 && context[0] > ctx->cache_numbers) context[0] = ctx->cache_numbers + 1;
+    context[1] = ctx->cache_offset ? ctx->in_buffer.stream_offset + (off_t) (start - ctx->in_buffer.buffer) : (off_t) 0;
+    hash_key((unsigned char *) context,(off_t) sizeof(context),ctx->cache_key);
+    if(ctx->cache_offset)
+    {
+        name = get_current_file();
+        hash_key((unsigned char *) name,(off_t) strlen(name) + 1,ctx->cache_key);
+    }
+    hash_key(start,(off_t) (ctx->in_buffer.block_end - start) + 1,ctx->cache_key);
+
+    file = block_file(hex);
+    found = read_block_file(file);
+    free(file);
+
+    if(!found)
+    {
+        REPORT_ADD(cache_misses,1);
+        ctx->cache_length = 0;
+        ctx->cache_capture = 1;
+        return 0;
+    }
+
+    REPORT_ADD(cache_hits,1);
+    if(ctx->cache_length) write_output_stream(ctx->cache_data,(ssize_t) ctx->cache_length);
+    ctx->in_buffer.block_offset += ctx->in_buffer.block_end - start;
+    ctx->in_buffer.read_pos = ctx->in_buffer.block_end;
+    return 1;
+}
+
+/* collect output of the block to be stored */
+void
+capture_output(unsigned char *buf,off_t length)
+{
+    if(ctx->cache_length + (size_t) length > ctx->cache_size)
+    {
+        if(!ctx->cache_size) ctx->cache_size = OUTPUT_BUFFER_SIZE;
+        while(ctx->cache_length + (size_t) length > ctx->cache_size) ctx->cache_size *= 2;
+        ctx->cache_data = xrealloc(ctx->cache_data,ctx->cache_size);
+    }
+    memcpy(ctx->cache_data + ctx->cache_length,buf,(size_t) length);
+    ctx->cache_length += (size_t) length;
+}
+
+/* store the output of the block, called after the block is flushed. File is written with
+   temporary name and renamed, so that other runs never see partial files */
+void
+store_block()
+{
+    char hex[33],*file,*temp;
+    unsigned char *p;
+    size_t left;
+    ssize_t w;
+    int fd;
+
+    ctx->cache_capture = 0;
+
+    file = block_file(hex);
+    temp = xmalloc(strlen(ctx->cache_path) + 16);
+    sprintf(temp,"%s/.tmpXXXXXX",ctx->cache_path);
+    fd = mkstemp(temp);
+    if(fd == -1) panic("Cannot open file for writing",temp,strerror(errno));
+
+    p = ctx->cache_data;
+    left = ctx->cache_length;
+    while(left)
+    {
+        w = write(fd,p,left);
+        if(w == -1)
+        {
+            if(errno == EINTR) continue;
+            unlink(temp);
+            panic("Cannot write to file",temp,strerror(errno));
+        }
+        p += w;
+        left -= (size_t) w;
+    }
+    if(close(fd) == -1 || rename(temp,file) == -1)
+    {
+        unlink(temp);
+        panic("Cannot write to cache",file,strerror(errno));
+    }
+    free(temp);
+    free(file);
+}
+
+void
+free_cache()
+{
+    free(ctx->cache_dir);
+    free(ctx->cache_path);
+    free(ctx->cache_data);
+    ctx->cache_dir = NULL;
+    ctx->cache_path = NULL;
+    ctx->cache_data = NULL;
+    ctx->cache_size = 0;
+    ctx->cache_capture = 0;
+}
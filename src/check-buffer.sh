@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-buffer.sh - run with "make check". Output must be the same when input is
+# a file or a pipe, and when the input buffer is a ring or a malloced buffer whose
+# unread data is moved at refill (BBE_NO_RING). Blocks are longer than the buffer
+# and a long search string crosses refill positions at different offsets.
+# usage: check-buffer.sh bbe
+
+BBE=$1
+TMP=${TMPDIR:-/tmp}/check-buffer.$$
+failed=0
+
+trap 'rm -f $TMP.*' 0
+
+# 12000 byte key, random filler between keys, BEGIN and END markers every now and then
+awk -v keyfile=$TMP.key 'BEGIN {
+    srand(5)
+    for(i = 0;i < 12000;i++) key = key substr("abcdefghij",int(rand() * 10) + 1,1)
+    printf "%s",key > keyfile
+    total = 0
+    while(total < 3000000)
+    {
+        n = int(rand() * 70000) + 1
+        filler = ""
+        for(i = 0;i < n;i++) filler = filler substr("klmnopqrs\n",int(rand() * 10) + 1,1)
+        if(rand() < 0.3) filler = filler "BEGIN"
+        if(rand() < 0.3) filler = filler "END"
+        printf "%s%s",filler,key
+        total += length(filler) + 12000
+    }
+}' > $TMP.in
+KEY=`cat $TMP.key`
+
+check()
+{
+    $BBE "$@" $TMP.in > $TMP.ref 2>&1
+    for ring in yes no
+    do
+        for input in file pipe
+        do
+            if test $ring = no
+            then
+                BBE_NO_RING=1
+                export BBE_NO_RING
+            else
+                unset BBE_NO_RING
+            fi
+            if test $input = file
+            then
+                $BBE "$@" $TMP.in > $TMP.out 2>&1
+            else
+                cat $TMP.in | $BBE "$@" > $TMP.out 2>&1
+            fi
+            unset BBE_NO_RING
+            if ! cmp -s $TMP.ref $TMP.out
+            then
+                echo "FAIL: ring $ring, $input: $* " | cut -c1-100
+                failed=1
+            fi
+        done
+    done
+}
+
+echo "s/$KEY/<key>/" > $TMP.script
+
+check -b ':65536' -f $TMP.script
+check -b ':300000' -e 'y/klm/KLM/'
+check -b '/BEGIN/:/END/' -f $TMP.script
+check -b '/BEGIN/:/END/' -s -e 'y/abc/ABC/'
+check -b '/BEGIN/:' -e 'j 100000' -e 'y/k/K/'
+check -b ":/$KEY/" -e 'p D' -s
+check -b "/$KEY/:/END/" -s
+check -b "/$KEY/:" -e 'D 1' -f $TMP.script
+
+# replacing really happens
+if ! $BBE -f $TMP.script $TMP.in | grep -q '<key>'
+then
+    echo "FAIL: key is not replaced"
+    failed=1
+fi
+
+exit $failed
@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-cache.sh - run with "make check". Output of a run with -K must be the same
+# as without it, also when the output is taken from the cache. After the first run
+# every stored block is marked, so a second run with same block definition and
+# commands must give the marked output (blocks are really taken from the cache) and
+# runs with something changed must give the output without the marks.
+# usage: check-cache.sh bbe
+
+BBE=$1
+TMP=${TMPDIR:-/tmp}/check-cache.$$
+failed=0
+
+trap 'rm -rf $TMP.*' 0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+# records, some of them having same contents
+awk 'BEGIN {
+    srand(3)
+    for(i = 0;i < 500;i++)
+    {
+        printf "<r>"
+        n = int(rand() * 40)
+        for(j = 0;j < n;j++) printf "%s",substr("abcdef",int(rand() * 6) + 1,1)
+        printf "<e>\n"
+    }
+}' > $TMP.in
+printf '<r>first<e>\n' | cat - $TMP.in > $TMP.shifted
+printf 'before\n' > $TMP.file
+
+BLOCK='/<r>/:/<e>/'
+
+$BBE -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.in > $TMP.ref
+test -s $TMP.ref || fail "run without -K gives no output"
+$BBE -K $TMP.cache -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.in > $TMP.out
+cmp -s $TMP.out $TMP.ref || fail "first run with -K"
+
+# second run takes every block from cache
+$BBE -R -K $TMP.cache -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.in > $TMP.out 2> $TMP.report
+cmp -s $TMP.out $TMP.ref || fail "second run with -K"
+grep -q '^cache_misses 0$' $TMP.report || fail "second run has cache misses"
+grep -q '^cache_hits 0$' $TMP.report && fail "second run has no cache hits"
+
+# mark every stored output
+for f in $TMP.cache/*/*
+do
+    printf 'CACHED' >> $f
+done
+
+$BBE -K $TMP.cache -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.in > $TMP.out
+grep -q CACHED $TMP.out || fail "output is not taken from cache"
+
+# changed commands, block definition, contents of file, block numbers and input
+check()
+{
+    name=$1
+    shift
+    $BBE "$@" > $TMP.ref
+    test -s $TMP.ref || fail "$name gives no output"
+    $BBE -K $TMP.cache "$@" > $TMP.out
+    if grep -q CACHED $TMP.out || ! cmp -s $TMP.out $TMP.ref
+    then
+        fail "$name"
+    fi
+}
+
+check "changed command" -b "$BLOCK" -e 'y/abc/ABD/' -e "> $TMP.file" -e 'D 5' $TMP.in
+check "added command" -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' -e 'A x' $TMP.in
+check "changed block" -b '/<r>/:/e>/' -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.in
+check "changed D" -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 6' $TMP.in
+
+# blocks after the fifth are the same for D 5, but blocks 1 to 6 are not
+$BBE -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.shifted > $TMP.ref
+$BBE -K $TMP.cache -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.shifted | sed 's/CACHED//g' > $TMP.out
+cmp -s $TMP.out $TMP.ref || fail "changed block numbers with D 5"
+
+# block number is printed, every block changes
+$BBE -K $TMP.cache -b "$BLOCK" -e 'B D' $TMP.in > /dev/null
+for f in $TMP.cache/*/*
+do
+    printf 'CACHED' >> $f
+done
+check "changed block numbers with B" -b "$BLOCK" -e 'B D' $TMP.shifted
+printf 'after\n' > $TMP.file
+check "changed file of > command" -b "$BLOCK" -e 'y/abc/ABC/' -e "> $TMP.file" -e 'D 5' $TMP.in
+
+exit $failed
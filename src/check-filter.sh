@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-filter.sh - run with "make check". Blocks kept by k and K commands are
+# compared with the records selected by awk. Records are up to eight times
+# longer than the input buffer and the strings searched are placed across
+# the positions where the buffer is refilled.
+# usage: check-filter.sh bbe
+
+BBE=$1
+TMP=${TMPDIR:-/tmp}/check-filter.$$
+failed=0
+
+trap 'rm -f $TMP.*' 0
+
+# one record in a line, ERROR is written in half of the records
+awk 'BEGIN {
+    srand(9)
+    split("10 100 5000 262100 300000 524288 1100000 2000000",lengths," ")
+    split("0 16380 245758 262142 262150 524286 1048574",positions," ")
+    for(i = 0;i < 1000;i++) chunk = chunk substr("abcdefgh",int(rand() * 8) + 1,1)
+    for(r = 0;r < 40;r++)
+    {
+        n = lengths[int(rand() * 8) + 1]
+        body = chunk
+        while(length(body) < n) body = body body
+        body = substr(body,1,n)
+        if(rand() < 0.5)
+        {
+            pos = positions[int(rand() * 7) + 1]
+            if(pos > n - 5) pos = n - 5
+            if(pos < 0) pos = 0
+            body = substr(body,1,pos) "ERROR" substr(body,pos + 6)
+        }
+        print "<rec>" body "</rec>"
+    }
+}' > $TMP.in
+
+# $1 = awk program for the expected output, rest are commands
+check()
+{
+    expected=$1
+    shift
+    awk "$expected" $TMP.in > $TMP.ref
+    $BBE -b '%<rec>%:%</rec>%' "$@" $TMP.in > $TMP.file 2>&1
+    cat $TMP.in | $BBE -b '%<rec>%:%</rec>%' "$@" > $TMP.pipe 2>&1
+    if ! cmp -s $TMP.file $TMP.ref || ! cmp -s $TMP.pipe $TMP.ref
+    then
+        echo "FAIL: $*"
+        failed=1
+    fi
+}
+
+check '{ print (/ERROR/ ? $0 : "") }' -e 'k /ERROR/'
+check '{ print (/ERROR/ ? "" : $0) }' -e 'K /ERROR/'
+check '{ print (length($0) >= 1000000 ? $0 : "") }' -e 'k l 1000000'
+check '{ print (length($0) >= 1000000 ? "" : $0) }' -e 'K l 1000000'
+check '{ print (length($0) >= 100 && length($0) <= 600000 ? $0 : "") }' -e 'k l 100:600000'
+check '{ print (/ERROR/ && length($0) < 1000000 ? $0 : "") }' -e 'k /ERROR/' -e 'K l 1000000'
+check '{ print (/ERROR/ ? "" : $0) }' -e 'K /ERROR/' -e 'k l 11'
+check '{ if(/ERROR/) gsub(/a/,"X"); else $0 = ""; print }' -e 'k /ERROR/' -e 'y/a/X/'
+check '{ print (/ERROR/ ? ">" $0 "<" : "") }' -e 'I >' -e 'k /ERROR/' -e 'A <'
+check '{ print (/ERROR/ ? $0 : "") }' -e 'k /RROR/' -e 'k /ER/'
+
+exit $failed
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-scan.sh - run with "make check". Block locations written by -L and -C for
+# a regular file, which are searched by threads in segments, must be the same as
+# for the same bytes from a pipe, which are read through the input buffer. Input
+# is larger than the segments (4 MB) and has many overlapping strings.
+# usage: check-scan.sh bbe
+
+BBE=$1
+TMP=${TMPDIR:-/tmp}/check-scan.$$
+failed=0
+
+trap 'rm -f $TMP.*' 0
+
+# random letters, chunk length is a prime so the segment borders hit different
+# places of the chunk
+awk 'BEGIN {
+    srand(11)
+    for(i = 0;i < 65521;i++) printf "%s",substr("aaabcdefg",int(rand() * 9) + 1,1)
+}' > $TMP.chunk
+cat $TMP.chunk $TMP.chunk $TMP.chunk $TMP.chunk > $TMP.4
+cat $TMP.4 $TMP.4 $TMP.4 $TMP.4 > $TMP.16
+cat $TMP.16 $TMP.16 $TMP.16 $TMP.16 > $TMP.64
+cat $TMP.64 $TMP.64 $TMP.16 $TMP.4 > $TMP.in       # 150 chunks, 9.4 MB
+
+check()
+{
+    for option in -L -C
+    do
+        $BBE $option -b "$1" $TMP.in > $TMP.file 2>&1
+        cat $TMP.in | $BBE $option -b "$1" > $TMP.pipe 2>&1
+        if ! cmp -s $TMP.file $TMP.pipe
+        then
+            echo "FAIL: $option -b '$1'"
+            failed=1
+        fi
+    done
+}
+
+check '/aa/:/aa/'
+check '/aa/:'
+check '/ab/:'
+check ':/ba/'
+check ':/aaa/'
+check '100:/aab/'
+check '4194000:/gfe/'
+check '/aab/:/aab/'
+check '/ab/:/ba/'
+check '/aa/:20'
+check '/gfedc/:/aaaa/'
+
+exit $failed
@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-serve.sh - run with "make check". bbe --serve is started with one worker,
+# so every job is run with the same compiled script. Jobs which are rejected after
+# input or output is given must not leave them to the next job, and the daemon must
+# keep serving when it cannot accept connections.
+# usage: check-serve.sh bbe bbeclient
+
+BBE=$1
+CLIENT=$2
+TMP=${TMPDIR:-/tmp}/check-serve.$$
+SOCK=$TMP.sock
+failed=0
+pid=
+
+trap 'test -n "$pid" && kill $pid 2> /dev/null; rm -f $TMP.*' 0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+# wait until socket $1 exists
+wait_socket()
+{
+    n=0
+    while test ! -S $1
+    do
+        n=`expr $n + 1`
+        if test $n -gt 10
+        then
+            fail "socket $1 is not created"
+            exit 1
+        fi
+        sleep 1
+    done
+}
+
+printf 'abc one\n' > $TMP.in1
+printf 'abc two\n' > $TMP.in2
+printf 'ABC one\n' > $TMP.ref1
+printf 'ABC two\n' > $TMP.ref2
+
+$BBE -D $SOCK -N 1 -e 'y/abc/ABC/' &
+pid=$!
+wait_socket $SOCK
+
+$CLIENT -i $TMP.in1 -o $TMP.out $SOCK RUN 0 - - > /dev/null || fail "first job"
+cmp -s $TMP.out $TMP.ref1 || fail "output of first job"
+
+# rejected jobs having input or output already given
+$CLIENT $SOCK RUN 0 $TMP.in1 - > /dev/null && fail "job without output descriptor is not rejected"
+$CLIENT -i $TMP.in1 $SOCK RUN 0 - $TMP.nodir/out > /dev/null && fail "job with bad output file is not rejected"
+$CLIENT -o $TMP.out $SOCK RUN 0 $TMP.in1 - - > /dev/null && fail "job with extra field is not rejected"
+$CLIENT -i $TMP.in1 -o $TMP.out $SOCK RUN 9 - - > /dev/null && fail "job with unknown script is not rejected"
+
+# daemon still answers, with nothing left from the rejected jobs
+$CLIENT -i $TMP.in2 -o $TMP.out $SOCK RUN 0 - - > /dev/null || fail "job after rejected jobs"
+cmp -s $TMP.out $TMP.ref2 || fail "output of job after rejected jobs"
+$CLIENT $SOCK RUN 0 $TMP.in2 $TMP.out > /dev/null || fail "job with file names"
+cmp -s $TMP.out $TMP.ref2 || fail "output of job with file names"
+n=`$CLIENT $SOCK COMPILE '' 'y/t/T/' | sed 's/^OK //'`
+$CLIENT -i $TMP.in2 -o $TMP.out $SOCK RUN "$n" - - > /dev/null || fail "job of compiled script"
+printf 'abc Two\n' | cmp -s - $TMP.out || fail "output of compiled script"
+
+kill $pid
+wait $pid 2> /dev/null
+pid=
+test -S $SOCK && fail "socket is not removed"
+
+# no descriptors for accepted connections, worker must wait and try again. Limit
+# of descriptors allows only the ones open now and the listening socket
+if test -d /proc/self/fd
+then
+    (
+        open=`ls /proc/self/fd | wc -l`             # ls has one descriptor more
+        ulimit -n $open
+        exec $BBE -D $SOCK -N 1 -e 'y/abc/ABC/'
+    ) 2> $TMP.err &
+    pid=$!
+    wait_socket $SOCK
+    $CLIENT -i $TMP.in1 -o $TMP.out $SOCK RUN 0 - - > /dev/null 2>&1 &
+    client=$!
+    sleep 2
+    kill -0 $pid 2> /dev/null || fail "daemon exits when accept fails"
+    grep -q 'Cannot accept connection' $TMP.err || fail "accept does not fail"
+    kill $pid $client 2> /dev/null
+    wait $pid $client 2> /dev/null
+    pid=
+fi
+
+exit $failed
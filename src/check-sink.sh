@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-sink.sh - run with "make check". A w file without %B is created or truncated
+# when the commands are opened and removed at the end if nothing was written to it.
+# Files having %B are created only for blocks which write something to them.
+# usage: check-sink.sh bbe
+
+BBE=$1
+TMP=${TMPDIR:-/tmp}/check-sink.$$
+failed=0
+
+trap 'rm -rf $TMP $TMP.*' 0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+mkdir $TMP || exit 1
+printf '<b>1 keep<e>\n<b>2<e>\n<b>3 keep<e>\n<b>4<e>\n' > $TMP.in
+printf '<b>1 keep<e><b>3 keep<e>' > $TMP.ref
+
+# matching blocks, old contents of file are truncated
+printf 'old contents which are longer than the new ones\n' > $TMP/w
+$BBE -b '/<b>/:/<e>/' -e 'k /keep/' -e "w $TMP/w" $TMP.in > /dev/null || fail "w with matching blocks"
+cmp -s $TMP/w $TMP.ref || fail "contents of w file"
+
+# no matching blocks, file is removed also if it existed
+printf 'old\n' > $TMP/w
+$BBE -b '/<x>/:/<e>/' -e "w $TMP/w" $TMP.in > /dev/null || fail "w without matching blocks"
+test -f $TMP/w && fail "w file is left without matching blocks"
+$BBE -b '/<b>/:/<e>/' -e 'k /none/' -e "w $TMP/w" $TMP.in > /dev/null || fail "w without kept blocks"
+test -f $TMP/w && fail "w file is left without kept blocks"
+
+# file which cannot be opened is an error before anything is written
+$BBE -b '/<b>/:/<e>/' -e "w $TMP/nodir/w" $TMP.in > $TMP.out 2> /dev/null && fail "w file without directory is not an error"
+test -s $TMP.out && fail "output is written before w file is opened"
+
+# per block files only for the blocks having data
+rm -f $TMP/*
+$BBE -b '/<b>/:/<e>/' -e 'k /keep/' -e "w $TMP/b%B" $TMP.in > /dev/null || fail "w with %B"
+ls $TMP | grep '^b' > $TMP.files
+printf 'b1\nb3\n' | cmp -s - $TMP.files || fail "files of w with %B: `cat $TMP.files`"
+printf '<b>1 keep<e>' | cmp -s - $TMP/b1 || fail "contents of w file of block 1"
+rm -f $TMP/b*
+$BBE -b '/<x>/:/<e>/' -e "w $TMP/b%B" $TMP.in > /dev/null || fail "w with %B without matching blocks"
+test -z "`ls $TMP`" || fail "files of w with %B without matching blocks: `ls $TMP`"
+
+exit $failed
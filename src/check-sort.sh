@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-sort.sh - run with "make check". Blocks sorted with -k are compared with
+# a stable sort made by sort(1), both when all blocks fit in memory and when
+# BBE_SORT_MEMORY is so small that runs are written to temporary files and merged.
+# usage: check-sort.sh bbe
+
+BBE=$1
+TMP=${TMPDIR:-/tmp}/check-sort.$$
+failed=0
+
+trap 'rm -f $TMP.*' 0
+
+# lines having a four digit key with many duplicates, line number tells the input order
+awk 'BEGIN {
+    srand(7)
+    for(i = 0;i < 20000;i++)
+    {
+        printf "%04d ",int(rand() * 500)
+        n = int(rand() * 60)
+        for(j = 0;j < n;j++) printf "x"
+        printf " %d\n",i
+    }
+}' > $TMP.in
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+# key is four ascii digits, big endian order is the order of the digits
+LC_ALL=C sort -s -k1.1,1.4 $TMP.in > $TMP.ref
+LC_ALL=C sort $TMP.in > $TMP.all
+
+$BBE -b ':/\n/' -k 0:4 $TMP.in > $TMP.mem
+cmp -s $TMP.mem $TMP.ref || fail "-k 0:4 in memory"
+
+for memory in 65536 4096 1
+do
+    BBE_SORT_MEMORY=$memory $BBE -b ':/\n/' -k 0:4 $TMP.in > $TMP.merge
+    cmp -s $TMP.merge $TMP.ref || fail "-k 0:4 BBE_SORT_MEMORY=$memory"
+done
+
+BBE_SORT_MEMORY=65536 $BBE -b ':/\n/' -k 0:4 < $TMP.in > $TMP.merge
+cmp -s $TMP.merge $TMP.ref || fail "-k 0:4 BBE_SORT_MEMORY=65536 from standard input"
+
+# runs are really written: temporary files cannot be created
+if TMPDIR=/nonexistent BBE_SORT_MEMORY=65536 $BBE -b ':/\n/' -k 0:4 $TMP.in > /dev/null 2>&1
+then
+    fail "BBE_SORT_MEMORY=65536 does not write runs"
+fi
+
+# little endian keys and keys going beyond the end of short blocks
+for key in 2:3:le 5:8 60:2:le
+do
+    $BBE -b ':/\n/' -k $key $TMP.in > $TMP.mem
+    BBE_SORT_MEMORY=65536 $BBE -b ':/\n/' -k $key $TMP.in > $TMP.merge
+    cmp -s $TMP.mem $TMP.merge || fail "-k $key merged differs from in memory"
+    cmp -s $TMP.mem $TMP.in && fail "-k $key does not sort"
+    LC_ALL=C sort $TMP.mem | cmp -s - $TMP.all || fail "-k $key loses or changes blocks"
+done
+
+exit $failed
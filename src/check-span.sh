@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+#    bbe - Binary block editor
+#
+#    Copyright (C) 2005 Timo Savinen
+#    This file is part of bbe.
+#
+#    bbe is free software; you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 2 of the License, or
+#    (at your option) any later version.
+#
+#    bbe is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with bbe; if not, write to the Free Software
+#    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+
+# $Id$
+
+# check-span.sh - run with "make check". Scripts which can be executed for spans
+# are run twice: as they are and with an r command which is never active, which
+# makes bbe execute the commands byte by byte. Outputs must be the same.
+# usage: check-span.sh bbe srcdir
+
+BBE=$1
+SRCDIR=$2
+TMP=${TMPDIR:-/tmp}/check-span.$$
+failed=0
+
+trap 'rm -f $TMP.*' 0
+
+# input longer than two input buffers, so spans cross buffer refills
+cat $SRCDIR/*.c $SRCDIR/*.c > $TMP.in
+printf 'hello\n' > $TMP.hello
+
+check()
+{
+    block=$1
+    shift
+    for input in $TMP.hello $TMP.in
+    do
+        $BBE -b "$block" "$@" $input > $TMP.span 2>&1
+        $BBE -b "$block" -e 'r 999999999 Z' "$@" $input > $TMP.byte 2>&1
+        if ! cmp -s $TMP.span $TMP.byte
+        then
+            echo "FAIL: -b '$block' $* $(basename $input)"
+            failed=1
+        fi
+    done
+}
+
+check ':1024' -e 'y/abc/xyz/'
+check ':262144' -e 'y/abc/xyz/' -s
+check '1:262144' -e 'y/abc/xyz/'
+check ':1024' -e '^ 1' -e 'x' -e '~'
+check ':1024' -e 'p D'
+check ':1024' -e 'p D' -e 'p A'
+check ':1024' -e 'p H' -e '^ 1'
+check ':1024' -e 'p D' -e 'y/ /_/'
+check ':1024' -e 'p H' -e 'p H'
+check ':1024' -e 'p D' -e 'w /dev/null'
+check ':1024' -e 'y/h/H/' -e 'p O'
+check ':1024' -e 'c BIN HEX'
+check ':1024' -e 'c BIN HEX' -e 'y/6/X/'
+check ':1024' -e 'c BIN B64' -e 'p H'
+check ':1024' -e 'c BIN HEX' -e 'c HEX BIN'
+check ':1024' -e 'c ASC EBC' -e 'p D'
+
+exit $failed
@@ -0,0 +1,700 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* conversions of c command for spans of bytes: hex and base64 encoding and decoding.
+   All conversions keep their state between spans in rpos and fpos of the command,
+   so a block can be converted in several spans, or byte by byte */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define HAVE_SSSE3_DISPATCH
+#endif
+
+/* after failed vector test, this many bytes are converted by scalar code before trying again */
+#define SCALAR_RUN 16
+
+/* EBCDIC (code page 037) */
+static unsigned char ascii_to_ebcdic[256] = {
+    0x00,0x01,0x02,0x03,0x37,0x2d,0x2e,0x2f,0x16,0x05,0x25,0x0b,0x0c,0x0d,0x0e,0x0f,
+    0x10,0x11,0x12,0x13,0x3c,0x3d,0x32,0x26,0x18,0x19,0x3f,0x27,0x1c,0x1d,0x1e,0x1f,
+    0x40,0x5a,0x7f,0x7b,0x5b,0x6c,0x50,0x7d,0x4d,0x5d,0x5c,0x4e,0x6b,0x60,0x4b,0x61,
+    0xf0,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0x7a,0x5e,0x4c,0x7e,0x6e,0x6f,
+    0x7c,0xc1,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xd1,0xd2,0xd3,0xd4,0xd5,0xd6,
+    0xd7,0xd8,0xd9,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xba,0xe0,0xbb,0xb0,0x6d,
+    0x79,0x81,0x82,0x83,0x84,0x85,0x86,0x87,0x88,0x89,0x91,0x92,0x93,0x94,0x95,0x96,
+    0x97,0x98,0x99,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xc0,0x4f,0xd0,0xa1,0x07,
+    0x20,0x21,0x22,0x23,0x24,0x15,0x06,0x17,0x28,0x29,0x2a,0x2b,0x2c,0x09,0x0a,0x1b,
+    0x30,0x31,0x1a,0x33,0x34,0x35,0x36,0x08,0x38,0x39,0x3a,0x3b,0x04,0x14,0x3e,0xff,
+    0x41,0xaa,0x4a,0xb1,0x9f,0xb2,0x6a,0xb5,0xbd,0xb4,0x9a,0x8a,0x5f,0xca,0xaf,0xbc,
+    0x90,0x8f,0xea,0xfa,0xbe,0xa0,0xb6,0xb3,0x9d,0xda,0x9b,0x8b,0xb7,0xb8,0xb9,0xab,
+    0x64,0x65,0x62,0x66,0x63,0x67,0x9e,0x68,0x74,0x71,0x72,0x73,0x78,0x75,0x76,0x77,
+    0xac,0x69,0xed,0xee,0xeb,0xef,0xec,0xbf,0x80,0xfd,0xfe,0xfb,0xfc,0xad,0xae,0x59,
+    0x44,0x45,0x42,0x46,0x43,0x47,0x9c,0x48,0x54,0x51,0x52,0x53,0x58,0x55,0x56,0x57,
+    0x8c,0x49,0xcd,0xce,0xcb,0xcf,0xcc,0xe1,0x70,0xdd,0xde,0xdb,0xdc,0x8d,0x8e,0xdf
+};
+static unsigned char ebcdic_to_ascii[256] = {
+    0x00,0x01,0x02,0x03,0x9c,0x09,0x86,0x7f,0x97,0x8d,0x8e,0x0b,0x0c,0x0d,0x0e,0x0f,
+    0x10,0x11,0x12,0x13,0x9d,0x85,0x08,0x87,0x18,0x19,0x92,0x8f,0x1c,0x1d,0x1e,0x1f,
+    0x80,0x81,0x82,0x83,0x84,0x0a,0x17,0x1b,0x88,0x89,0x8a,0x8b,0x8c,0x05,0x06,0x07,
+    0x90,0x91,0x16,0x93,0x94,0x95,0x96,0x04,0x98,0x99,0x9a,0x9b,0x14,0x15,0x9e,0x1a,
+    0x20,0xa0,0xe2,0xe4,0xe0,0xe1,0xe3,0xe5,0xe7,0xf1,0xa2,0x2e,0x3c,0x28,0x2b,0x7c,
+    0x26,0xe9,0xea,0xeb,0xe8,0xed,0xee,0xef,0xec,0xdf,0x21,0x24,0x2a,0x29,0x3b,0xac,
+    0x2d,0x2f,0xc2,0xc4,0xc0,0xc1,0xc3,0xc5,0xc7,0xd1,0xa6,0x2c,0x25,0x5f,0x3e,0x3f,
+    0xf8,0xc9,0xca,0xcb,0xc8,0xcd,0xce,0xcf,0xcc,0x60,0x3a,0x23,0x40,0x27,0x3d,0x22,
+    0xd8,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0xab,0xbb,0xf0,0xfd,0xfe,0xb1,
+    0xb0,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,0x70,0x71,0x72,0xaa,0xba,0xe6,0xb8,0xc6,0xa4,
+    0xb5,0x7e,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0xa1,0xbf,0xd0,0xdd,0xde,0xae,
+    0x5e,0xa3,0xa5,0xb7,0xa9,0xa7,0xb6,0xbc,0xbd,0xbe,0x5b,0x5d,0xaf,0xa8,0xb4,0xd7,
+    0x7b,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0xad,0xf4,0xf6,0xf2,0xf3,0xf5,
+    0x7d,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,0x50,0x51,0x52,0xb9,0xfb,0xfc,0xf9,0xfa,0xff,
+    0x5c,0xf7,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0xb2,0xd4,0xd6,0xd2,0xd3,0xd5,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0xb3,0xdb,0xdc,0xd9,0xda,0x9f
+};
+static char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* values of hex digits and base64 characters, -1 if not valid, -2 for white space which is skipped */
+#define SKIP_CHAR -2
+static signed char hex_value[256];
+static signed char b64_value[256];
+
+static int codec_tables_done = 0;
+
+#ifdef HAVE_SSSE3_DISPATCH
+static int have_ssse3 = 0;
+#endif
+
+void
+init_codec_tables()
+{
+    int i;
+
+    if(codec_tables_done) return;
+
+    for(i = 0;i < 256;i++)
+    {
+        hex_value[i] = -1;
+        b64_value[i] = -1;
+    }
+    for(i = 0;i < 10;i++) hex_value['0' + i] = i;
+    for(i = 0;i < 6;i++)
+    {
+        hex_value['a' + i] = 10 + i;
+        hex_value['A' + i] = 10 + i;
+    }
+    for(i = 0;i < 64;i++) b64_value[(unsigned char) b64_chars[i]] = i;
+    for(i = 0;i < 256;i++)
+    {
+        if(i == ' ' || i == '\t' || i == '\n' || i == '\r' || i == '\v' || i == '\f')
+        {
+            hex_value[i] = SKIP_CHAR;
+            b64_value[i] = SKIP_CHAR;
+        }
+    }
+
+#ifdef HAVE_SSSE3_DISPATCH
+    __builtin_cpu_init();
+    have_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+    codec_tables_done = 1;
+}
+
+/* decode hex digits, pairs of digits are converted to bytes, white space is removed and
+   other bytes are passed as they are. *pending tells if there is a digit waiting for its pair,
+   the digit is in *pending_char */
+static off_t
+hex_decode_span(unsigned char *in,off_t length,unsigned char *out,int *pending,off_t *pending_char,int last)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    unsigned char *scalar_until = in;
+    int v;
+
+    while(in < end)
+    {
+#ifdef __SSE2__
+        if(!*pending && in >= scalar_until && end - in >= 16)
+        {
+            __m128i s = _mm_loadu_si128((__m128i *) in);
+            __m128i lower = _mm_or_si128(s,_mm_set1_epi8(0x20));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(s,_mm_set1_epi8('0' - 1)),_mm_cmpgt_epi8(_mm_set1_epi8('9' + 1),s));
+            __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower,_mm_set1_epi8('a' - 1)),_mm_cmpgt_epi8(_mm_set1_epi8('f' + 1),lower));
+
+            if(_mm_movemask_epi8(_mm_or_si128(digit,alpha)) == 0xffff)
+            {
+                __m128i val = _mm_or_si128(_mm_and_si128(digit,_mm_sub_epi8(s,_mm_set1_epi8('0'))),
+                                           _mm_and_si128(alpha,_mm_sub_epi8(lower,_mm_set1_epi8('a' - 10))));
+                __m128i w = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(val,_mm_set1_epi16(0x00ff)),4),_mm_srli_epi16(val,8));
+
+                _mm_storel_epi64((__m128i *) o,_mm_packus_epi16(w,w));
+                o += 8;
+                in += 16;
+                continue;
+            }
+            scalar_until = in + SCALAR_RUN;
+        }
+#endif
+        v = hex_value[*in];
+        if(v >= 0)
+        {
+            if(*pending)
+            {
+                *o++ = (unsigned char) ((hex_value[*pending_char] << 4) | v);
+                *pending = 0;
+            } else
+            {
+                *pending = 1;
+                *pending_char = *in;
+            }
+        } else if(v != SKIP_CHAR)
+        {
+            if(*pending)
+            {
+                *o++ = (unsigned char) *pending_char;
+                *pending = 0;
+            }
+            *o++ = *in;
+        }
+        in++;
+    }
+
+    if(last && *pending)
+    {
+        *o++ = (unsigned char) *pending_char;
+        *pending = 0;
+    }
+    return o - out;
+}
+
+/* four base64 characters of three bytes in acc */
+static inline unsigned char *
+b64_put_group(unsigned char *o,unsigned long acc)
+{
+    o[0] = b64_chars[(acc >> 18) & 0x3f];
+    o[1] = b64_chars[(acc >> 12) & 0x3f];
+    o[2] = b64_chars[(acc >> 6) & 0x3f];
+    o[3] = b64_chars[acc & 0x3f];
+    return o + 4;
+}
+
+#ifdef HAVE_SSSE3_DISPATCH
+/* encode 12 bytes to 16 base64 characters, 16 bytes are read from in */
+__attribute__((target("ssse3")))
+static off_t
+base64_encode_ssse3(unsigned char *in,off_t length,unsigned char *out)
+{
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26,'0' - 52,'0' - 52,'0' - 52,'0' - 52,'0' - 52,
+                                            '0' - 52,'0' - 52,'0' - 52,'0' - 52,'0' - 52,'+' - 62,
+                                            '/' - 63,'A',0,0);
+    __m128i s,t0,t1,t2,t3,idx,r;
+    off_t done = 0;
+
+    while(length - done >= 16)
+    {
+        s = _mm_loadu_si128((__m128i *) (in + done));
+        s = _mm_shuffle_epi8(s,_mm_set_epi8(10,11,9,10,7,8,6,7,4,5,3,4,1,2,0,1));
+        t0 = _mm_and_si128(s,_mm_set1_epi32(0x0fc0fc00));
+        t1 = _mm_mulhi_epu16(t0,_mm_set1_epi32(0x04000040));
+        t2 = _mm_and_si128(s,_mm_set1_epi32(0x003f03f0));
+        t3 = _mm_mullo_epi16(t2,_mm_set1_epi32(0x01000010));
+        idx = _mm_or_si128(t1,t3);
+
+        r = _mm_subs_epu8(idx,_mm_set1_epi8(51));
+        r = _mm_or_si128(r,_mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26),idx),_mm_set1_epi8(13)));
+        r = _mm_add_epi8(_mm_shuffle_epi8(shift_lut,r),idx);
+        _mm_storeu_si128((__m128i *) (out + (done / 3) * 4),r);
+        done += 12;
+    }
+    return done;
+}
+
+/* decode 16 base64 characters to 12 bytes, stops at first group having other than base64 characters.
+   16 bytes are written to out */
+__attribute__((target("ssse3")))
+static off_t
+base64_decode_ssse3(unsigned char *in,off_t length,unsigned char *out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x11,0x13,0x1a,0x1b,0x1b,0x1b,0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10,0x10,0x01,0x02,0x04,0x08,0x04,0x08,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0,16,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    __m128i s,hi_nibbles,lo_nibbles,hi,lo,roll;
+    off_t done = 0;
+
+    while(length - done >= 16)
+    {
+        s = _mm_loadu_si128((__m128i *) (in + done));
+        hi_nibbles = _mm_and_si128(_mm_srli_epi32(s,4),mask_2f);
+        lo_nibbles = _mm_and_si128(s,mask_2f);
+        hi = _mm_shuffle_epi8(lut_hi,hi_nibbles);
+        lo = _mm_shuffle_epi8(lut_lo,lo_nibbles);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo,hi),_mm_setzero_si128())) != 0xffff) break;
+
+        roll = _mm_shuffle_epi8(lut_roll,_mm_add_epi8(_mm_cmpeq_epi8(s,mask_2f),hi_nibbles));
+        s = _mm_add_epi8(s,roll);
+        s = _mm_maddubs_epi16(s,_mm_set1_epi32(0x01400140));
+        s = _mm_madd_epi16(s,_mm_set1_epi32(0x00011000));
+        s = _mm_shuffle_epi8(s,_mm_setr_epi8(2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1));
+        _mm_storeu_si128((__m128i *) (out + (done / 4) * 3),s);
+        done += 16;
+    }
+    return done;
+}
+#endif
+
+/* encode to base64 without line breaks, *count bytes (0-2) of unfinished group are in *acc.
+   last group is padded with = at the end of the block */
+static off_t
+base64_encode_span(unsigned char *in,off_t length,unsigned char *out,int *count,off_t *acc,int last)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    off_t done;
+
+    while(*count && in < end)
+    {
+        *acc = (*acc << 8) | *in++;
+        if(++*count == 3)
+        {
+            o = b64_put_group(o,(unsigned long) *acc);
+            *count = 0;
+        }
+    }
+
+#ifdef HAVE_SSSE3_DISPATCH
+    if(have_ssse3 && !*count)
+    {
+        done = base64_encode_ssse3(in,end - in,o);
+        in += done;
+        o += (done / 3) * 4;
+    }
+#endif
+
+    while(end - in >= 3)
+    {
+        o = b64_put_group(o,((unsigned long) in[0] << 16) | ((unsigned long) in[1] << 8) | in[2]);
+        in += 3;
+    }
+
+    while(in < end)
+    {
+        *acc = *count ? (*acc << 8) | *in : *in;
+        (*count)++;
+        in++;
+    }
+
+    if(last && *count)
+    {
+        done = *acc << (8 * (3 - *count));
+        b64_put_group(o,(unsigned long) done);
+        if(*count == 1) o[2] = '=';
+        o[3] = '=';
+        o += 4;
+        *count = 0;
+    }
+    return o - out;
+}
+
+/* write the bytes of unfinished base64 group, single character can not be decoded and it is
+   written as it is */
+static inline unsigned char *
+b64_put_partial(unsigned char *o,int count,off_t acc)
+{
+    switch(count)
+    {
+        case 1:
+            *o++ = b64_chars[acc & 0x3f];
+            break;
+        case 2:
+            *o++ = (unsigned char) (acc >> 4);
+            break;
+        case 3:
+            *o++ = (unsigned char) (acc >> 10);
+            *o++ = (unsigned char) (acc >> 2);
+            break;
+    }
+    return o;
+}
+
+/* decode base64, groups of four characters are converted to three bytes. White space is removed,
+   padding (=) ends the group and it is removed, other characters end the group and are passed as they are */
+static off_t
+base64_decode_span(unsigned char *in,off_t length,unsigned char *out,int *count,off_t *acc,int last)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    unsigned char *scalar_until = in;
+    int v;
+#ifdef HAVE_SSSE3_DISPATCH
+    off_t done;
+#endif
+
+    while(in < end)
+    {
+#ifdef HAVE_SSSE3_DISPATCH
+        if(have_ssse3 && !*count && in >= scalar_until && end - in >= 16)
+        {
+            done = base64_decode_ssse3(in,end - in,o);
+            in += done;
+            o += (done / 4) * 3;
+            scalar_until = in + SCALAR_RUN;
+            if(in >= end) break;
+        }
+#endif
+        v = b64_value[*in];
+        if(v >= 0)
+        {
+            *acc = *count ? (*acc << 6) | v : v;
+            if(++*count == 4)
+            {
+                *o++ = (unsigned char) (*acc >> 16);
+                *o++ = (unsigned char) (*acc >> 8);
+                *o++ = (unsigned char) *acc;
+                *count = 0;
+            }
+        } else if(v != SKIP_CHAR)
+        {
+            o = b64_put_partial(o,*count,*acc);
+            *count = 0;
+            if(*in != '=') *o++ = *in;
+        }
+        in++;
+    }
+
+    if(last && *count)
+    {
+        o = b64_put_partial(o,*count,*acc);
+        *count = 0;
+    }
+    return o - out;
+}
+
+/* unpack BCD, bytes having two decimal digits (low nibble can also be F) are written as two characters,
+   digits as digit_base + digit and F nibble as f_char. Other bytes are passed as they are */
+static off_t
+bcd_unpack_span(unsigned char *in,off_t length,unsigned char *out,unsigned char digit_base,unsigned char f_char)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    unsigned char *scalar_until = in;
+    unsigned char hi,lo;
+
+    while(in < end)
+    {
+#ifdef __SSE2__
+        if(in >= scalar_until && end - in >= 16)
+        {
+            __m128i s = _mm_loadu_si128((__m128i *) in);
+            __m128i nine = _mm_set1_epi8(9);
+            __m128i base = _mm_set1_epi8((char) digit_base);
+            __m128i h = _mm_and_si128(_mm_srli_epi16(s,4),_mm_set1_epi8(0x0f));
+            __m128i l = _mm_and_si128(s,_mm_set1_epi8(0x0f));
+
+            if(!_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi8(h,nine),_mm_cmpgt_epi8(l,nine))))
+            {
+                h = _mm_add_epi8(h,base);
+                l = _mm_add_epi8(l,base);
+                _mm_storeu_si128((__m128i *) o,_mm_unpacklo_epi8(h,l));
+                _mm_storeu_si128((__m128i *) (o + 16),_mm_unpackhi_epi8(h,l));
+                o += 32;
+                in += 16;
+                continue;
+            }
+            scalar_until = in + SCALAR_RUN;
+        }
+#endif
+        hi = (*in >> 4) & 0x0f;
+        lo = *in & 0x0f;
+        if(hi <= 9 && (lo <= 9 || lo == 0x0f))
+        {
+            *o++ = digit_base + hi;
+            *o++ = lo == 0x0f ? f_char : digit_base + lo;
+        } else
+        {
+            *o++ = *in;
+        }
+        in++;
+    }
+    return o - out;
+}
+
+/* pack digit characters (digit_base + digit) to BCD, two digits in one byte. Digit followed by
+   other character is packed with F nibble, if the character is one of f_chars it is removed.
+   *pending tells if there is a digit waiting for its pair, value of the digit is in *pending_digit */
+static off_t
+bcd_pack_span(unsigned char *in,off_t length,unsigned char *out,int *pending,off_t *pending_digit,int last,
+              unsigned char digit_base,unsigned char *f_chars)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    unsigned char *scalar_until = in;
+    unsigned char d;
+
+    while(in < end)
+    {
+#ifdef __SSE2__
+        if(!*pending && in >= scalar_until && end - in >= 16)
+        {
+            __m128i s = _mm_sub_epi8(_mm_loadu_si128((__m128i *) in),_mm_set1_epi8((char) digit_base));
+
+            /* digits are 0-9 after subtraction, unsigned compare by saturated subtraction */
+            if(!_mm_movemask_epi8(_mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(s,_mm_set1_epi8(9)),_mm_setzero_si128()),_mm_set1_epi8(-1))))
+            {
+                __m128i w = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(s,_mm_set1_epi16(0x00ff)),4),_mm_srli_epi16(s,8));
+
+                _mm_storel_epi64((__m128i *) o,_mm_packus_epi16(w,w));
+                o += 8;
+                in += 16;
+                continue;
+            }
+            scalar_until = in + SCALAR_RUN;
+        }
+#endif
+        d = *in - digit_base;
+        if(d <= 9)
+        {
+            if(*pending)
+            {
+                *o++ = (unsigned char) ((*pending_digit << 4) | d);
+                *pending = 0;
+            } else
+            {
+                *pending = 1;
+                *pending_digit = d;
+            }
+        } else
+        {
+            if(*pending)
+            {
+                *o++ = (unsigned char) ((*pending_digit << 4) | 0x0f);
+                *pending = 0;
+                if(*in == f_chars[0] || *in == f_chars[1])
+                {
+                    in++;
+                    continue;
+                }
+            }
+            *o++ = *in;
+        }
+        in++;
+    }
+
+    if(last && *pending)
+    {
+        *o++ = (unsigned char) ((*pending_digit << 4) | 0x0f);
+        *pending = 0;
+    }
+    return o - out;
+}
+
+/* zoned decimal to ascii digits, zone F is unsigned digit, zone C is digit followed by + and
+   zone D is digit followed by -. Other bytes are passed as they are */
+static off_t
+zoned_to_ascii_span(unsigned char *in,off_t length,unsigned char *out)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    unsigned char *scalar_until = in;
+    unsigned char d;
+
+    while(in < end)
+    {
+#ifdef __SSE2__
+        if(in >= scalar_until && end - in >= 16)
+        {
+            __m128i s = _mm_loadu_si128((__m128i *) in);
+            __m128i l = _mm_and_si128(s,_mm_set1_epi8(0x0f));
+            __m128i bad = _mm_or_si128(_mm_xor_si128(_mm_cmpeq_epi8(_mm_and_si128(s,_mm_set1_epi8((char) 0xf0)),_mm_set1_epi8((char) 0xf0)),_mm_set1_epi8(-1)),
+                                       _mm_cmpgt_epi8(l,_mm_set1_epi8(9)));
+
+            if(!_mm_movemask_epi8(bad))
+            {
+                _mm_storeu_si128((__m128i *) o,_mm_add_epi8(l,_mm_set1_epi8('0')));
+                o += 16;
+                in += 16;
+                continue;
+            }
+            scalar_until = in + SCALAR_RUN;
+        }
+#endif
+        d = *in & 0x0f;
+        switch(d <= 9 ? *in & 0xf0 : 0)
+        {
+            case 0xf0:
+                *o++ = '0' + d;
+                break;
+            case 0xc0:
+                *o++ = '0' + d;
+                *o++ = '+';
+                break;
+            case 0xd0:
+                *o++ = '0' + d;
+                *o++ = '-';
+                break;
+            default:
+                *o++ = *in;
+                break;
+        }
+        in++;
+    }
+    return o - out;
+}
+
+/* ascii digits to zoned decimal, digit followed by + or - gets zone C or D and the sign is removed,
+   other digits get zone F. *pending tells if there is a digit waiting for possible sign */
+static off_t
+ascii_to_zoned_span(unsigned char *in,off_t length,unsigned char *out,int *pending,off_t *pending_digit,int last)
+{
+    unsigned char *o = out;
+    unsigned char *end = in + length;
+    unsigned char *scalar_until = in;
+    unsigned char d;
+
+    while(in < end)
+    {
+#ifdef __SSE2__
+        if(!*pending && in >= scalar_until && end - in > 16 && in[16] != '+' && in[16] != '-')
+        {
+            __m128i s = _mm_sub_epi8(_mm_loadu_si128((__m128i *) in),_mm_set1_epi8('0'));
+
+            if(!_mm_movemask_epi8(_mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(s,_mm_set1_epi8(9)),_mm_setzero_si128()),_mm_set1_epi8(-1))))
+            {
+                _mm_storeu_si128((__m128i *) o,_mm_or_si128(s,_mm_set1_epi8((char) 0xf0)));
+                o += 16;
+                in += 16;
+                continue;
+            }
+            scalar_until = in + SCALAR_RUN;
+        }
+#endif
+        d = *in - '0';
+        if(*pending)
+        {
+            *pending = 0;
+            if(*in == '+' || *in == '-')
+            {
+                *o++ = (unsigned char) ((*in == '+' ? 0xc0 : 0xd0) | *pending_digit);
+                in++;
+                continue;
+            }
+            *o++ = (unsigned char) (0xf0 | *pending_digit);
+        }
+        if(d <= 9)
+        {
+            *pending = 1;
+            *pending_digit = d;
+        } else
+        {
+            *o++ = *in;
+        }
+        in++;
+    }
+
+    if(last && *pending)
+    {
+        *o++ = (unsigned char) (0xf0 | *pending_digit);
+        *pending = 0;
+    }
+    return o - out;
+}
+
+/* translation table of conversion, NULL if conversion is not a translation of single bytes */
+unsigned char *
+convert_map(struct command_list *c)
+{
+    switch(c->count)
+    {
+        case CONVERT_ASC_EBC:
+            return ascii_to_ebcdic;
+        case CONVERT_EBC_ASC:
+            return ebcdic_to_ascii;
+    }
+    return NULL;
+}
+
+/* execute c command conversion for span, returns the number of bytes written to out.
+   last is true if span is the end of the block. out must have room for
+   convert_ratio(c) * length + SPAN_SLACK bytes */
+off_t
+convert_span(struct command_list *c,unsigned char *in,off_t length,unsigned char *out,int last)
+{
+    static unsigned char ascii_f[] = "Ff";
+    static unsigned char ebcdic_f[] = "\xc6\x86";
+    unsigned char *map;
+    off_t i;
+
+    switch(c->count)
+    {
+        case CONVERT_BCD_ASC:
+            return bcd_unpack_span(in,length,out,'0','F');
+        case CONVERT_ASC_BCD:
+            return bcd_pack_span(in,length,out,&c->rpos,&c->fpos,last,'0',ascii_f);
+        case CONVERT_BIN_HEX:
+            hex_encode(in,length,out);
+            return 2 * length;
+        case CONVERT_HEX_BIN:
+            return hex_decode_span(in,length,out,&c->rpos,&c->fpos,last);
+        case CONVERT_BIN_B64:
+            return base64_encode_span(in,length,out,&c->rpos,&c->fpos,last);
+        case CONVERT_B64_BIN:
+            return base64_decode_span(in,length,out,&c->rpos,&c->fpos,last);
+        case CONVERT_BCD_EBC:
+            return bcd_unpack_span(in,length,out,0xf0,ebcdic_f[0]);
+        case CONVERT_EBC_BCD:
+            return bcd_pack_span(in,length,out,&c->rpos,&c->fpos,last,0xf0,ebcdic_f);
+        case CONVERT_ZON_ASC:
+            return zoned_to_ascii_span(in,length,out);
+        case CONVERT_ASC_ZON:
+            return ascii_to_zoned_span(in,length,out,&c->rpos,&c->fpos,last);
+        case CONVERT_ASC_EBC:
+        case CONVERT_EBC_ASC:
+            map = convert_map(c);
+            for(i = 0;i < length;i++) out[i] = map[in[i]];
+            return length;
+    }
+    return 0;
+}
+
+/* maximum number of bytes written by convert_span for one byte, in addition to SPAN_SLACK */
+off_t
+convert_ratio(struct command_list *c)
+{
+    switch(c->count)
+    {
+        case CONVERT_BCD_ASC:
+        case CONVERT_BCD_EBC:
+        case CONVERT_ZON_ASC:
+        case CONVERT_BIN_HEX:
+        case CONVERT_BIN_B64:
+            return 2;
+    }
+    return 1;
+}
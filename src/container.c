@@ -0,0 +1,216 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* W command writes blocks one after another to a container file. For every
+   block an index record is written to file container.idx, record of block n
+   is at offset (n - 1) * INDEX_RECORD_SIZE and contains the offset and length
+   of the block in the container as 64 bit little endian numbers.
+   --extract reads one block from container using the index */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define INDEX_RECORD_SIZE 16
+
+/* extracted blocks are read with one pread if they fit to this */
+#define EXTRACT_BUFFER_SIZE (8 * 1024 * 1024)
+
+/* block to be extracted, 0 = normal mode */
+off_t extract_block = 0;
+
+struct w_container {
+    struct w_sink *data;
+    struct w_sink *index;
+    off_t size;             // bytes written to container
+    off_t block_start;      // container offset of current block
+    off_t block_num;        // current block, 0 before first block
+};
+
+static void
+put_le64(unsigned char *p,off_t n)
+{
+    int i;
+
+    for(i = 0;i < 8;i++)
+    {
+        p[i] = (unsigned char) (n & 0xff);
+        n >>= 8;
+    }
+}
+
+static off_t
+get_le64(unsigned char *p)
+{
+    off_t n = 0;
+    int i;
+
+    for(i = 7;i >= 0;i--) n = (n << 8) | p[i];
+    return n;
+}
+
+/* name of the index file of container */
+static char *
+index_file(char *file)
+{
+    char *name;
+
+    name = xmalloc(strlen(file) + 5);
+    strcpy(name,file);
+    strcat(name,".idx");
+    return name;
+}
+
+struct w_container *
+container_create(char *file)
+{
+    struct w_container *w;
+    char *name;
+
+    w = xmalloc(sizeof(struct w_container));
+    name = index_file(file);
+    w->data = sink_create(file);
+    w->index = sink_create(name);
+    free(name);
+    w->size = 0;
+    w->block_start = 0;
+    w->block_num = 0;
+    return w;
+}
+
+/* write index record of current block */
+static void
+write_index(struct w_container *w)
+{
+    unsigned char record[INDEX_RECORD_SIZE];
+
+    if(!w->block_num) return;
+    put_le64(record,w->block_start);
+    put_le64(record + 8,w->size - w->block_start);
+    sink_write(w->index,record,INDEX_RECORD_SIZE);
+}
+
+/* start new block */
+void
+container_block(struct w_container *w,off_t block_number)
+{
+    write_index(w);
+    while(w->block_num && ++w->block_num < block_number)     // blocks without record are empty
+    {
+        w->block_start = w->size;
+        write_index(w);
+    }
+    w->block_start = w->size;
+    w->block_num = block_number;
+}
+
+void
+container_write(struct w_container *w,unsigned char *buf,size_t length)
+{
+    sink_write(w->data,buf,length);
+    w->size += (off_t) length;
+}
+
+void
+container_close(struct w_container *w)
+{
+    write_index(w);
+    sink_close(w->data);
+    sink_close(w->index);
+    free(w);
+}
+
+/* close container without writing, used after errors */
+void
+container_discard(struct w_container *w)
+{
+    sink_discard(w->data);
+    sink_discard(w->index);
+    free(w);
+}
+
+/* read length bytes from offset, panic if file is too short */
+static void
+read_at(int fd,char *file,unsigned char *buf,size_t length,off_t offset)
+{
+    ssize_t r;
+
+    while(length)
+    {
+        r = pread(fd,buf,length,offset);
+        if(r == -1)
+        {
+            if(errno == EINTR) continue;
+            panic("Error reading file",file,strerror(errno));
+        }
+        if(r == 0) panic("Container file is too short",file,NULL);
+        buf += r;
+        length -= (size_t) r;
+        offset += r;
+    }
+}
+
+/* write block block_number of container (the input file) to output */
+void
+execute_extract(off_t block_number)
+{
+    unsigned char record[INDEX_RECORD_SIZE];
+    unsigned char *buffer;
+    char *file,*name;
+    off_t start,offset,length;
+    size_t n;
+    ssize_t r;
+    int fd,ifd;
+
+    fd = regular_input_file(&start);
+    if(fd < 0) panic("Extract needs one container file as input",NULL,NULL);
+    file = get_current_file();
+
+    name = index_file(file);
+    ifd = open(name,O_RDONLY);
+    if(ifd == -1) panic("Cannot open file for reading",name,strerror(errno));
+    r = pread(ifd,record,INDEX_RECORD_SIZE,(block_number - 1) * INDEX_RECORD_SIZE);
+    if(r == -1) panic("Error reading file",name,strerror(errno));
+    if(r != INDEX_RECORD_SIZE) panic("No such block in container",file,NULL);
+    close(ifd);
+    free(name);
+
+    offset = get_le64(record);
+    length = get_le64(record + 8);
+
+    buffer = xmalloc(length < EXTRACT_BUFFER_SIZE ? (size_t) length + 1 : EXTRACT_BUFFER_SIZE);
+    while(length)
+    {
+        n = length < EXTRACT_BUFFER_SIZE ? (size_t) length : EXTRACT_BUFFER_SIZE;
+        read_at(fd,file,buffer,n,offset);
+        write_output_stream(buffer,(ssize_t) n);
+        offset += (off_t) n;
+        length -= (off_t) n;
+    }
+    free(buffer);
+    close_output_stream();
+}
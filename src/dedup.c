@@ -0,0 +1,235 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* U command, blocks already seen. Blocks are remembered by xxHash64 of their
+   contents in an open addressing hash table with linear probing, with the number
+   of the block where the contents were last seen. With a window, entries older
+   than the window are dropped when the table is rebuilt. If the memory limit is
+   reached, new blocks are not remembered, so blocks are only kept, never dropped,
+   because of the limit. When blocks are verified, their contents are also kept
+   and compared */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* slots in a new table */
+#define SET_INITIAL_SIZE 1024
+
+struct set_entry {
+    uint64_t hash;              // 0 for empty slot
+    off_t last;                 // number of the block where contents were seen last time
+    unsigned char *data;        // contents of the block if blocks are verified
+    off_t length;
+};
+
+struct block_set {
+    off_t window;               // n of U command, 0 for all blocks
+    size_t limit;               // max memory of table and kept blocks
+    int verify;                 // contents are compared
+    struct set_entry *table;
+    size_t size;                // slots in table, power of two
+    size_t count;               // used slots
+    size_t memory;              // bytes used by table and kept blocks
+    off_t next_sweep;           // old entries are not searched before this block
+};
+
+struct block_set *
+set_create(off_t window,size_t limit,int verify)
+{
+    struct block_set *s;
+
+    if(limit < 2 * SET_INITIAL_SIZE * sizeof(struct set_entry)) panic("Memory limit of U command too small",NULL,NULL);
+    s = xmalloc(sizeof(struct block_set));
+    s->window = window;
+    s->limit = limit;
+    s->verify = verify;
+    s->table = NULL;
+    s->size = 0;
+    s->count = 0;
+    s->memory = 0;
+    s->next_sweep = 0;
+    return s;
+}
+
+/* forget all blocks, called at start of every run */
+void
+set_clear(struct block_set *s)
+{
+    size_t i;
+
+    for(i = 0;i < s->size;i++) free(s->table[i].data);
+    free(s->table);
+    s->size = SET_INITIAL_SIZE;
+    s->table = xmalloc(s->size * sizeof(struct set_entry));
+    memset(s->table,0,s->size * sizeof(struct set_entry));
+    s->count = 0;
+    s->memory = s->size * sizeof(struct set_entry);
+    s->next_sweep = 0;
+}
+
+void
+set_free(struct block_set *s)
+{
+    size_t i;
+
+    if(s == NULL) return;
+    for(i = 0;i < s->size;i++) free(s->table[i].data);
+    free(s->table);
+    free(s);
+}
+
+/* entry having hash h or the empty slot where it should be */
+static struct set_entry *
+set_find(struct block_set *s,uint64_t h)
+{
+    size_t i,mask;
+
+    mask = s->size - 1;
+    i = (size_t) h & mask;
+    while(s->table[i].hash && s->table[i].hash != h) i = (i + 1) & mask;
+    return &s->table[i];
+}
+
+/* true if entry is older than the window */
+static int
+set_old(struct block_set *s,struct set_entry *e,off_t number)
+{
+    return s->window && number - e->last > s->window;
+}
+
+/* move entries to a table of size slots, old entries are dropped */
+static void
+set_rebuild(struct block_set *s,size_t size,off_t number)
+{
+    struct set_entry *old,*e;
+    size_t i,old_size;
+
+    old = s->table;
+    old_size = s->size;
+
+    s->size = size;
+    s->table = xmalloc(size * sizeof(struct set_entry));
+    memset(s->table,0,size * sizeof(struct set_entry));
+    s->count = 0;
+    s->memory = size * sizeof(struct set_entry);
+
+    for(i = 0;i < old_size;i++)
+    {
+        if(!old[i].hash) continue;
+        if(set_old(s,&old[i],number))
+        {
+            free(old[i].data);
+            continue;
+        }
+        e = set_find(s,old[i].hash);
+        *e = old[i];
+        s->count++;
+        if(e->data != NULL) s->memory += (size_t) e->length;
+    }
+    free(old);
+}
+
+/* make room for a new entry of length bytes, returns false if it does not fit */
+static int
+set_room(struct block_set *s,off_t length,off_t number)
+{
+    size_t data;
+
+    data = s->verify ? (size_t) length : 0;
+    if(s->count + 1 <= s->size / 4 * 3 && s->memory + data <= s->limit) return 1;
+
+    if(s->window && (number >= s->next_sweep || s->count >= 2 * (size_t) s->window))     // at most window entries are not old
+    {
+        set_rebuild(s,s->size,number);
+        s->next_sweep = number + s->window / 4 + 1;
+    }
+    if(s->count + 1 > s->size / 2 && s->memory + s->size * sizeof(struct set_entry) + data <= s->limit)
+        set_rebuild(s,2 * s->size,number);
+    return s->count + 1 <= s->size / 4 * 3 && s->memory + data <= s->limit;
+}
+
+/* keep contents of the block in entry if there is memory for them */
+static void
+set_keep(struct block_set *s,struct set_entry *e,unsigned char *p,off_t length)
+{
+    if(e->data != NULL)
+    {
+        s->memory -= (size_t) e->length;
+        free(e->data);
+        e->data = NULL;
+    }
+    if(s->memory + (size_t) length > s->limit) return;
+    e->data = xmalloc(length ? length : 1);
+    memcpy(e->data,p,length);
+    e->length = length;
+    s->memory += (size_t) length;
+}
+
+/* U command: returns true if the current block has been seen (within the window),
+   the block is remembered. Blocks which are not all in the input buffer are never
+   seen nor remembered */
+int
+seen_block(struct block_set *s)
+{
+    struct set_entry *e;
+    unsigned char *p;
+    off_t length,number;
+    uint64_t h;
+    int seen;
+
+    if(ctx->in_buffer.block_end == NULL) return 0;
+
+    p = read_pos();
+    length = (off_t) (ctx->in_buffer.block_end - p) + 1;
+    number = ctx->in_buffer.block_num;
+    h = hash64(p,length,(uint64_t) 0);
+    if(!h) h = 1;
+
+    e = set_find(s,h);
+    if(e->hash)
+    {
+        seen = !set_old(s,e,number);
+        if(s->verify)
+        {
+            if(e->data == NULL || e->length != length || memcmp(e->data,p,length) != 0)
+            {
+                seen = 0;
+                set_keep(s,e,p,length);         // collision, remember the latest contents
+            }
+        }
+        e->last = number;
+        return seen;
+    }
+
+    if(!set_room(s,length,number)) return 0;
+    e = set_find(s,h);
+    e->hash = h;
+    e->last = number;
+    e->data = NULL;
+    e->length = 0;
+    s->count++;
+    if(s->verify) set_keep(s,e,p,length);
+    return 0;
+}
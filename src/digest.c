@@ -0,0 +1,632 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* block digests for H and V commands: CRC32C, xxHash64 and SHA-256. Digests are
+   updated with the bytes of the output buffer when buffer is flushed and when
+   H or V command is executed */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_DIGEST_DISPATCH
+#endif
+
+/* largest digest in the block, SHA-256 in hex */
+#define MAX_DIGEST_TEXT 64
+
+struct block_digest {
+    int algorithm;              // DIGEST_CRC32C, DIGEST_XXH64 or DIGEST_SHA256
+    int size;                   // size of the digest in bytes
+    int hold;                   // number of last bytes not added to digest (expected digest of V command)
+    unsigned char tail[MAX_DIGEST_TEXT];   // last bytes of the block, not yet added
+    int tail_len;
+    uint32_t crc;
+    uint64_t xxh[4];            // accumulators of xxHash64
+    uint32_t sha[8];            // SHA-256 state
+    uint64_t total;             // number of bytes added
+    unsigned char pending[64];  // partial stripe (xxHash64) or block (SHA-256)
+    int pending_len;
+};
+
+static uint32_t crc32c_table[256];
+
+#ifdef HAVE_DIGEST_DISPATCH
+static int have_sse42 = 0;
+static int have_sha = 0;
+#endif
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+#define ROTL64(x,r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define ROTR32(x,r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static uint64_t
+read64le(unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+           (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static uint32_t
+read32le(unsigned char *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* CRC32C (Castagnoli), table for the bytewise code */
+static void
+init_crc32c_table()
+{
+    uint32_t c;
+    int i,j;
+
+    for(i = 0;i < 256;i++)
+    {
+        c = i;
+        for(j = 0;j < 8;j++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+}
+
+#ifdef HAVE_DIGEST_DISPATCH
+/* CRC32C using crc32 instruction of SSE4.2 */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc,unsigned char *p,off_t length)
+{
+#ifdef __x86_64__
+    uint64_t c = crc;
+
+    while(length >= 8)
+    {
+        c = _mm_crc32_u64(c,read64le(p));
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t) c;
+#endif
+    while(length >= 4)
+    {
+        crc = _mm_crc32_u32(crc,read32le(p));
+        p += 4;
+        length -= 4;
+    }
+    while(length--) crc = _mm_crc32_u8(crc,*p++);
+    return crc;
+}
+#endif
+
+static uint32_t
+crc32c_update(uint32_t crc,unsigned char *p,off_t length)
+{
+#ifdef HAVE_DIGEST_DISPATCH
+    if(have_sse42) return crc32c_sse42(crc,p,length);
+#endif
+    while(length--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/* xxHash64, seed is 0 for H and V commands */
+static uint64_t
+xxh_round(uint64_t acc,uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = ROTL64(acc,31);
+    return acc * XXH_P1;
+}
+
+static uint64_t
+xxh_merge(uint64_t acc,uint64_t val)
+{
+    acc ^= xxh_round(0,val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void
+xxh_stripes(uint64_t *v,unsigned char *p,off_t stripes)
+{
+    uint64_t v1 = v[0],v2 = v[1],v3 = v[2],v4 = v[3];
+
+    while(stripes--)
+    {
+        v1 = xxh_round(v1,read64le(p));
+        v2 = xxh_round(v2,read64le(p + 8));
+        v3 = xxh_round(v3,read64le(p + 16));
+        v4 = xxh_round(v4,read64le(p + 24));
+        p += 32;
+    }
+    v[0] = v1;
+    v[1] = v2;
+    v[2] = v3;
+    v[3] = v4;
+}
+
+static uint64_t
+xxh_final(struct block_digest *d,uint64_t seed)
+{
+    uint64_t h;
+    unsigned char *p = d->pending;
+    int len = d->pending_len;
+
+    if(d->total >= 32)
+    {
+        h = ROTL64(d->xxh[0],1) + ROTL64(d->xxh[1],7) + ROTL64(d->xxh[2],12) + ROTL64(d->xxh[3],18);
+        h = xxh_merge(h,d->xxh[0]);
+        h = xxh_merge(h,d->xxh[1]);
+        h = xxh_merge(h,d->xxh[2]);
+        h = xxh_merge(h,d->xxh[3]);
+    } else
+    {
+        h = seed + XXH_P5;
+    }
+    h += d->total;
+
+    while(len >= 8)
+    {
+        h ^= xxh_round(0,read64le(p));
+        h = ROTL64(h,27) * XXH_P1 + XXH_P4;
+        p += 8;
+        len -= 8;
+    }
+    if(len >= 4)
+    {
+        h ^= (uint64_t) read32le(p) * XXH_P1;
+        h = ROTL64(h,23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    while(len--)
+    {
+        h ^= *p++ * XXH_P5;
+        h = ROTL64(h,11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* SHA-256 compression of 64 byte blocks */
+static void
+sha256_blocks(uint32_t *state,unsigned char *p,off_t blocks)
+{
+    uint32_t w[64],a,b,c,d,e,f,g,h,t1,t2;
+    int i;
+
+    while(blocks--)
+    {
+        for(i = 0;i < 16;i++) w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+        for(i = 16;i < 64;i++)
+        {
+            t1 = ROTR32(w[i - 2],17) ^ ROTR32(w[i - 2],19) ^ (w[i - 2] >> 10);
+            t2 = ROTR32(w[i - 15],7) ^ ROTR32(w[i - 15],18) ^ (w[i - 15] >> 3);
+            w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+        }
+
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+        for(i = 0;i < 64;i++)
+        {
+            t1 = h + (ROTR32(e,6) ^ ROTR32(e,11) ^ ROTR32(e,25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            t2 = (ROTR32(a,2) ^ ROTR32(a,13) ^ ROTR32(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        p += 64;
+    }
+}
+
+#ifdef HAVE_DIGEST_DISPATCH
+/* SHA-256 compression using SHA extensions, four rounds for each group of message words */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_sha(uint32_t *state,unsigned char *p,off_t blocks)
+{
+    __m128i state0,state1,tmp,msg,abef,cdgh,w[4];
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,0x0405060700010203ULL);
+    int i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) &state[0]),0xb1);     // CDAB
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) &state[4]),0x1b);  // EFGH
+    state0 = _mm_alignr_epi8(tmp,state1,8);                                 // ABEF
+    state1 = _mm_blend_epi16(state1,tmp,0xf0);                              // CDGH
+
+    while(blocks--)
+    {
+        abef = state0;
+        cdgh = state1;
+
+        for(i = 0;i < 16;i++)
+        {
+            if(i < 4)
+            {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (p + 16 * i)),mask);
+            } else
+            {
+                tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3],w[(i - 3) & 3]),_mm_alignr_epi8(w[(i - 1) & 3],w[(i - 2) & 3],4));
+                w[i & 3] = _mm_sha256msg2_epu32(tmp,w[(i - 1) & 3]);
+            }
+            msg = _mm_add_epi32(w[i & 3],_mm_loadu_si128((__m128i *) &sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1,state0,msg);
+            state0 = _mm_sha256rnds2_epu32(state0,state1,_mm_shuffle_epi32(msg,0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0,abef);
+        state1 = _mm_add_epi32(state1,cdgh);
+        p += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0,0x1b);                                   // FEBA
+    state1 = _mm_shuffle_epi32(state1,0xb1);                                // DCHG
+    _mm_storeu_si128((__m128i *) &state[0],_mm_blend_epi16(tmp,state1,0xf0));   // DCBA
+    _mm_storeu_si128((__m128i *) &state[4],_mm_alignr_epi8(state1,tmp,8));     // HGFE
+}
+#endif
+
+static void
+sha256_compress(uint32_t *state,unsigned char *p,off_t blocks)
+{
+#ifdef HAVE_DIGEST_DISPATCH
+    if(have_sha)
+    {
+        sha256_blocks_sha(state,p,blocks);
+        return;
+    }
+#endif
+    sha256_blocks(state,p,blocks);
+}
+
+/* add bytes to digest, xxHash64 and SHA-256 collect partial stripes/blocks to pending */
+static void
+hash_update(struct block_digest *d,unsigned char *p,off_t length)
+{
+    off_t n,unit;
+
+    d->total += length;
+
+    if(d->algorithm == DIGEST_CRC32C)
+    {
+        d->crc = crc32c_update(d->crc,p,length);
+        return;
+    }
+
+    unit = d->algorithm == DIGEST_XXH64 ? 32 : 64;
+
+    if(d->pending_len)
+    {
+        n = unit - d->pending_len;
+        if(n > length) n = length;
+        memcpy(d->pending + d->pending_len,p,n);
+        d->pending_len += n;
+        p += n;
+        length -= n;
+        if(d->pending_len < unit) return;
+        if(d->algorithm == DIGEST_XXH64)
+        {
+            xxh_stripes(d->xxh,d->pending,(off_t) 1);
+        } else
+        {
+            sha256_compress(d->sha,d->pending,(off_t) 1);
+        }
+        d->pending_len = 0;
+    }
+
+    n = length / unit;
+    if(n)
+    {
+        if(d->algorithm == DIGEST_XXH64)
+        {
+            xxh_stripes(d->xxh,p,n);
+        } else
+        {
+            sha256_compress(d->sha,p,n);
+        }
+        p += n * unit;
+        length -= n * unit;
+    }
+
+    memcpy(d->pending,p,length);
+    d->pending_len = length;
+}
+
+/* add bytes to digest, last hold bytes are kept in tail */
+static void
+digest_add(struct block_digest *d,unsigned char *p,off_t length)
+{
+    off_t n;
+
+    if(!d->hold)
+    {
+        hash_update(d,p,length);
+        return;
+    }
+
+    if(d->tail_len + length <= d->hold)
+    {
+        memcpy(d->tail + d->tail_len,p,length);
+        d->tail_len += length;
+        return;
+    }
+
+    n = d->tail_len + length - d->hold;        // number of bytes to be added
+    if(n <= d->tail_len)
+    {
+        hash_update(d,d->tail,n);
+        memmove(d->tail,d->tail + n,d->tail_len - n);
+        memcpy(d->tail + d->tail_len - n,p,length);
+    } else
+    {
+        hash_update(d,d->tail,(off_t) d->tail_len);
+        hash_update(d,p,n - d->tail_len);
+        memcpy(d->tail,p + n - d->tail_len,d->hold);
+    }
+    d->tail_len = d->hold;
+}
+
+/* finish digest and write it to out, big endian. Returns the size of the digest */
+static int
+digest_final(struct block_digest *d,unsigned char *out)
+{
+    unsigned char pad[128];
+    uint64_t h,bits;
+    int i,n;
+
+    switch(d->algorithm)
+    {
+        case DIGEST_CRC32C:
+            h = ~d->crc & 0xffffffff;
+            for(i = 0;i < 4;i++) out[i] = (unsigned char) (h >> (24 - 8 * i));
+            return 4;
+        case DIGEST_XXH64:
+            h = xxh_final(d,(uint64_t) 0);
+            for(i = 0;i < 8;i++) out[i] = (unsigned char) (h >> (56 - 8 * i));
+            return 8;
+        case DIGEST_SHA256:
+            bits = d->total * 8;
+            n = d->pending_len;
+            memcpy(pad,d->pending,n);
+            pad[n++] = 0x80;
+            while(n % 64 != 56) pad[n++] = 0;
+            for(i = 0;i < 8;i++) pad[n++] = (unsigned char) (bits >> (56 - 8 * i));
+            sha256_compress(d->sha,pad,(off_t) (n / 64));
+            for(i = 0;i < 32;i++) out[i] = (unsigned char) (d->sha[i / 4] >> (24 - 8 * (i % 4)));
+            return 32;
+    }
+    return 0;
+}
+
+/* crc32c table and the instructions of the processor */
+void
+init_digest_tables()
+{
+    static int tables_done = 0;
+
+    if(tables_done) return;
+    init_crc32c_table();
+#ifdef HAVE_DIGEST_DISPATCH
+    {
+        unsigned int eax,ebx,ecx,edx;
+
+        if(__get_cpuid(1,&eax,&ebx,&ecx,&edx))
+        {
+            have_sse42 = (ecx & bit_SSE4_2) != 0;
+            if((ecx & bit_SSE4_1) && (ecx & bit_SSSE3) && __get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx))
+            {
+                have_sha = (ebx & bit_SHA) != 0;
+            }
+        }
+    }
+#endif
+    tables_done = 1;
+}
+
+/* initialize digest for H or V command */
+void
+init_digest(struct command_list *c)
+{
+    struct block_digest *d;
+
+    init_digest_tables();
+
+    d = xmalloc(sizeof(struct block_digest));
+    d->algorithm = (int) c->count;
+    switch(d->algorithm)
+    {
+        case DIGEST_CRC32C:
+            d->size = 4;
+            break;
+        case DIGEST_XXH64:
+            d->size = 8;
+            break;
+        default:
+            d->size = 32;
+            break;
+    }
+    d->hold = 0;
+    if(c->letter == 'V') d->hold = c->offset == 'X' ? 2 * d->size : d->size;
+    c->digest = d;
+
+    ctx->digests = xrealloc(ctx->digests,(ctx->digest_count + 1) * sizeof(struct block_digest *));
+    ctx->digests[ctx->digest_count++] = d;
+    ctx->block_digests = 1;
+    reset_digests();
+}
+
+/* start digests for a new block */
+void
+reset_digests()
+{
+    struct block_digest *d;
+    int i;
+
+    for(i = 0;i < ctx->digest_count;i++)
+    {
+        d = ctx->digests[i];
+        d->tail_len = 0;
+        d->total = 0;
+        d->pending_len = 0;
+        d->crc = 0xffffffff;
+        d->xxh[0] = XXH_P1 + XXH_P2;
+        d->xxh[1] = XXH_P2;
+        d->xxh[2] = 0;
+        d->xxh[3] = -XXH_P1;
+        d->sha[0] = 0x6a09e667; d->sha[1] = 0xbb67ae85; d->sha[2] = 0x3c6ef372; d->sha[3] = 0xa54ff53a;
+        d->sha[4] = 0x510e527f; d->sha[5] = 0x9b05688c; d->sha[6] = 0x1f83d9ab; d->sha[7] = 0x5be0cd19;
+    }
+}
+
+/* add bytes written to output buffer to all digests */
+void
+update_digests(unsigned char *buf,off_t length)
+{
+    int i;
+
+    if(!length) return;
+    for(i = 0;i < ctx->digest_count;i++) digest_add(ctx->digests[i],buf,length);
+}
+
+/* finish digest of command c and write it to text, hex or raw according to format of c.
+   Returns the length of the text */
+static int
+digest_text(struct command_list *c,unsigned char *text)
+{
+    unsigned char raw[32];
+    int len;
+
+    len = digest_final(c->digest,raw);
+    if(c->offset == 'R')
+    {
+        memcpy(text,raw,len);
+        return len;
+    }
+    hex_encode(raw,(off_t) len,text);
+    return 2 * len;
+}
+
+/* H command, write digest of the block */
+void
+write_digest(struct command_list *c)
+{
+    unsigned char text[MAX_DIGEST_TEXT];
+    int len;
+
+    update_block_digests();
+    len = digest_text(c,text);
+    write_buffer(text,(off_t) len);
+}
+
+/* V command, returns true if the last bytes of the block are the digest of
+   the bytes before them */
+int
+verify_digest(struct command_list *c)
+{
+    unsigned char text[MAX_DIGEST_TEXT];
+    struct block_digest *d = c->digest;
+    int i,len;
+
+    update_block_digests();
+    if(d->tail_len < d->hold) return 0;
+    len = digest_text(c,text);
+    for(i = 0;i < len;i++)
+    {
+        if(c->offset == 'R' ? text[i] != d->tail[i] : text[i] != tolower(d->tail[i])) return 0;
+    }
+    return 1;
+}
+
+/* xxHash64 of length bytes */
+uint64_t
+hash64(unsigned char *p,off_t length,uint64_t seed)
+{
+    struct block_digest d;
+    off_t stripes;
+
+    stripes = length / 32;
+    d.xxh[0] = seed + XXH_P1 + XXH_P2;
+    d.xxh[1] = seed + XXH_P2;
+    d.xxh[2] = seed;
+    d.xxh[3] = seed - XXH_P1;
+    xxh_stripes(d.xxh,p,stripes);
+    d.total = length;
+    d.pending_len = (int) (length - stripes * 32);
+    memcpy(d.pending,p + stripes * 32,d.pending_len);
+    return xxh_final(&d,seed);
+}
+
+/* 128 bit hash of length bytes for the keys of the block cache, two xxHash64
+   hashes seeded by the halves of key (second one changed, so that the halves
+   differ even if key is zero). Hash is written to key, so that hashes can be chained */
+void
+hash_key(unsigned char *p,off_t length,unsigned char *key)
+{
+    uint64_t h[2];
+    int i;
+
+    h[0] = hash64(p,length,read64le(key));
+    h[1] = hash64(p,length,read64le(key + 8) + XXH_P3);
+    for(i = 0;i < 16;i++) key[i] = (unsigned char) (h[i / 8] >> (8 * (i % 8)));
+}
+
+/* release the digests of H and V commands */
+void
+free_digests()
+{
+    int i;
+
+    for(i = 0;i < ctx->digest_count;i++) free(ctx->digests[i]);
+    free(ctx->digests);
+    ctx->digests = NULL;
+    ctx->digest_count = 0;
+    ctx->block_digests = 0;
+}
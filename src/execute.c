@@ -28,422 +28,539 @@
 #include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef _POSIX_MAPPED_FILES
+#include <sys/mman.h>
+#endif
 
-/* tells if current byte should be deleted */
-static int delete_this_byte;
+/* byte commands can be executed for spans of bytes instead of byte by byte,
+   see init_span_program */
 
-/* tells if current block should be deleted */
-static int delete_this_block;
+/* stages of span program, output of a stage is the input of the next stage */
+struct span_stage {
+    struct command_list *c;     // p or c command, NULL for translation
+    unsigned char *map;         // combined translation of &,|,^,~,x and y commands
+    off_t ratio;                // max number of bytes written for one byte
+};
 
-/* tells if current block should be skipped */
-static int skip_this_block;
+/* buffers for the output of stages */
+#define SPAN_BUFFER_SIZE (OUTPUT_BUFFER_SIZE / 2)
 
-/* tells if i or s commands are inserting bytes, meaningfull at end of the block */
-static int inserting;
+/* byte commands which act only at some block offsets (r,i,d,u,f,j and l) are indexed by
+   offset when the byte commands cannot be executed for spans, see init_byte_index.
+   Segment is a range of block offsets having the same active commands */
+struct byte_segment {
+    off_t start;                    // first block offset of segment
+    struct command_list **cmds;     // active commands in script order, NULL terminated
+};
 
-/* tells if there is w-command with file having %d 
-   this is only for performance 
-   */
-static int w_commands_block_num = 0;
-
-/* command list for write_w_command */
-static struct command_list *current_byte_commands;
-
-/* most significant bit of byte */
-#define BYTE_MASK (1 << (sizeof(unsigned char) * 8 - 1))
-
- 
-/* byte_to_string, convert byte value to visible string,
-   either hex (H), decimal (D), octal (O) or ascii (A)
-   */
-char *
-byte_to_string(unsigned char byte,char format)
-{
-    static char string[128];
-    int i;
-
-    switch(format)
-    {
-        case 'H':
-            sprintf(string,"x%02x",(int) byte);
-            break;
-        case 'D':
-            sprintf(string,"%3d",(int) byte);
-            break;
-        case 'O':
-            sprintf(string,"%03o",(int) byte);
-            break;
-        case 'A':
-            sprintf(string,"%c",isprint(byte) ? byte : ' ');
-            break;
-        case 'B':
-            i = 0;
-            do
-            {
-                string[i] = ((BYTE_MASK >> i) & byte) ? '1' : '0';
-                i++;
-            } while (BYTE_MASK >> i);
-            string[i] = 0;
-            break;
-        default:
-            string[0] = 0;
-            break;
-    }
-    return string;
-}
-
-/* convert off_t to string  */
-char *
-off_t_to_string(off_t number,char format)
-{
-    static char string[128];
-
-    switch(format)
-    {
-        case 'H':
-             sprintf(string,"x%llx",(long long) number);
-             break;
-        case 'D':
-             sprintf(string,"%lld",(long long) number);
-             break;
-        case 'O':
-             sprintf(string,"0%llo",(long long) number);
-             break;
-        default:
-             string[0] = 0;
-             break;
-    }
-    return string;
-}
+/* last offset of commands acting to the end of the block */
+#define BLOCK_END_OFFSET (~((off_t) 1 << (8 * sizeof(off_t) - 1)))
 
+#define IO_BLOCK_SIZE (8 * 1024)
 
+/* files of < and > commands having at least this size are mapped to memory */
+#define INSERT_MMAP_SIZE (1024 * 1024)
 
-#define IO_BLOCK_SIZE (8 * 1024)
+static void
+execute_sub_block(struct sub_block *s);
 
-/* execute given commands */
-void
-execute_commands(struct command_list *c)
+/* execute one command, returns true if the rest of the commands are not executed */
+static int
+execute_command(struct command_list *c)
 {
     register int i;
-    unsigned char a,b;
+    unsigned char a;
     unsigned char *p;
     char *str;
     off_t read_count;
-    static unsigned char ioblock[IO_BLOCK_SIZE];
-
-    if(skip_this_block) return;
+    unsigned char converted[SPAN_SLACK + 2];
 
-    while(c != NULL)
+    switch(c->letter)
     {
-        switch(c->letter)
-        {
-            case 'A':
-            case 'I':
+        case 'A':
+        case 'I':
+            write_buffer(c->s1,c->s1_len);
+            break;
+        case 'H':
+            write_digest(c);
+            break;
+        case 'V':
+            if(!verify_digest(c))
+            {
+                if(c->s1 == NULL)
+                {
+                    discard_buffer();
+                    ctx->skip_this_block = 1;
+                    return 1;
+                }
                 write_buffer(c->s1,c->s1_len);
-                break;
-            case 'd':
-                if(c->rpos || c->offset == in_buffer.block_offset) 
+            }
+            break;
+        case 'd':
+            if(c->rpos || c->offset == ctx->in_buffer.block_offset) 
+            {
+                if(c->rpos < c->count || c->count == 0)
                 {
-                    if(c->rpos < c->count || c->count == 0)
+                    if(ctx->inserting)
                     {
-                        if(inserting)
-                        {
-                            inserting = 0;
-                        } else
-                        {
-                             delete_this_byte = 1;
-                        }
-                        c->rpos++;
+                        ctx->inserting = 0;
                     } else
                     {
-                        c->rpos = 0;
+                         ctx->delete_this_byte = 1;
                     }
+                    c->rpos++;
+                } else
+                {
+                    c->rpos = 0;
                 }
+            }
+            break;
+        case 'D':
+            if(c->offset == ctx->in_buffer.block_num || c->offset == 0) ctx->delete_this_block = 1;
+            break;
+        case 'U':
+            if(seen_block(c->set)) ctx->delete_this_block = 1;
+            break;
+        case 'n':
+            execute_field(c);
+            break;
+        case 'k':
+        case 'K':
+            if(ctx->in_buffer.block_end == NULL)
+            {
+                defer_block_match(c);
                 break;
-            case 'D':
-                if(c->offset == in_buffer.block_num || c->offset == 0) delete_this_block = 1;
+            }
+            if(block_matches(c) != (c->letter == 'k'))
+            {
+                ctx->drop_this_block = 1;
+                ctx->delete_this_block = 1;
+                ctx->skip_this_block = 1;
+                return 1;
+            }
+            break;
+        case 'i':
+            if(c->offset == ctx->in_buffer.block_offset && !c->rpos) 
+            {
+                c->rpos = 1;
+                ctx->inserting = 1;
                 break;
-            case 'i':
-                if(c->offset == in_buffer.block_offset && !c->rpos) 
-                {
-                    c->rpos = 1;
-                    inserting = 1;
-                    break;
-                } 
-                if(c->rpos > 0 && c->rpos <= c->s1_len)
+            } 
+            if(c->rpos > 0 && c->rpos <= c->s1_len)
+            {
+                if(c->rpos <= c->s1_len)
                 {
-                    if(c->rpos <= c->s1_len)
+                    put_byte(c->s1[c->rpos - 1]);
+                    if(ctx->delete_this_byte)
                     {
-                        put_byte(c->s1[c->rpos - 1]);
-                        if(delete_this_byte)
-                        {
-                            delete_this_byte = 0;
-                        } else 
-                        {
-                            if(c->rpos < c->s1_len) inserting = 1;
-                        }
+                        ctx->delete_this_byte = 0;
+                    } else 
+                    {
+                        if(c->rpos < c->s1_len) ctx->inserting = 1;
                     }
-                    c->rpos++;
                 }
-                break;
-            case 'r':
-                if(in_buffer.block_offset >= c->offset &&
-                        in_buffer.block_offset < c->offset + c->s1_len)
+                c->rpos++;
+            }
+            break;
+        case 'r':
+            if(ctx->in_buffer.block_offset >= c->offset &&
+                    ctx->in_buffer.block_offset < c->offset + c->s1_len)
+            {
+                put_byte(c->s1[ctx->in_buffer.block_offset - c->offset]);
+            }
+            break;
+        case 's':
+            if(c->rpos)
+            {
+                if(c->rpos < c->s1_len && c->rpos < c->s2_len)
                 {
-                    put_byte(c->s1[in_buffer.block_offset - c->offset]);
-                }
-                break;
-            case 's':
-                if(c->rpos)
+                    put_byte(c->s2[c->rpos]);
+                } else if (c->rpos < c->s1_len && c->rpos >= c->s2_len)
                 {
-                    if(c->rpos < c->s1_len && c->rpos < c->s2_len)
+                    if(ctx->inserting)
                     {
-                        put_byte(c->s2[c->rpos]);
-                    } else if (c->rpos < c->s1_len && c->rpos >= c->s2_len)
+                        ctx->inserting = 0;
+                    } else
+                    {
+                        ctx->delete_this_byte = 1;
+                    }
+                } else if(c->rpos >= c->s1_len && c->rpos < c->s2_len)
+                {
+                    put_byte(c->s2[c->rpos]);
+                } 
+
+                    if(c->rpos >= c->s1_len - 1 && c->rpos < c->s2_len - 1)
                     {
-                        if(inserting)
+                        if(ctx->delete_this_byte)
                         {
-                            inserting = 0;
+                            ctx->delete_this_byte = 0;
                         } else
                         {
-                            delete_this_byte = 1;
-                        }
-                    } else if(c->rpos >= c->s1_len && c->rpos < c->s2_len)
-                    {
-                        put_byte(c->s2[c->rpos]);
-                    } 
-
-                        if(c->rpos >= c->s1_len - 1 && c->rpos < c->s2_len - 1)
-                        {
-                            if(delete_this_byte)
-                            {
-                                delete_this_byte = 0;
-                            } else
-                            {
-                                inserting = 1;
-                            }
+                            ctx->inserting = 1;
                         }
+                    }
 
-                        c->rpos++;
-                        if(c->rpos >= c->s1_len && c->rpos >= c->s2_len)
-                        {
-                            c->rpos = 0;
-                        }
-                        break;
-                }
-                if(delete_this_byte) break;
-                if(c->fpos == in_buffer.block_offset) break;
-                p = out_buffer.write_pos;
-                i = 0;
-                while(*p == c->s1[i] && i < c->s1_len)
-                {
-                    if(p == out_buffer.write_pos) p = read_pos();
-                    if(p == block_end_pos() && c->s1_len - 1 > i) break;
-                    i++;
-                    p++;
-                }
-                if(i == c->s1_len) 
+                    c->rpos++;
+                    if(c->rpos >= c->s1_len && c->rpos >= c->s2_len)
+                    {
+                        c->rpos = 0;
+                    }
+                    break;
+            }
+            if(ctx->delete_this_byte) break;
+            if(c->fpos == ctx->in_buffer.block_offset) break;
+            p = ctx->out_buffer.write_pos;
+            i = 0;
+            while(*p == c->s1[i] && i < c->s1_len)
+            {
+                if(p == ctx->out_buffer.write_pos) p = read_pos();
+                if(p == block_end_pos() && c->s1_len - 1 > i) break;
+                i++;
+                p++;
+            }
+            if(i == c->s1_len) 
+            {
+                c->fpos = ctx->in_buffer.block_offset;
+                if(c->s1_len > 1 || c->s2_len > 1) c->rpos = 1;
+                if(c->s2_len) 
                 {
-                    c->fpos = in_buffer.block_offset;
-                    if(c->s1_len > 1 || c->s2_len > 1) c->rpos = 1;
-                    if(c->s2_len) 
+                    put_byte(c->s2[0]);
+                    if(ctx->delete_this_byte)
                     {
-                        put_byte(c->s2[0]);
-                        if(delete_this_byte)
-                        {
-                            delete_this_byte = 0;
-                        } else
-                        {
-                            if(c->s1_len == 1 && c->s2_len > 1) inserting = 1;
-                        }
+                        ctx->delete_this_byte = 0;
                     } else
                     {
-                        if(inserting)
-                        {
-                            inserting = 0;
-                        } else
-                        {
-                            delete_this_byte = 1;
-                        }
+                        if(c->s1_len == 1 && c->s2_len > 1) ctx->inserting = 1;
                     }
-                }
-                break;
-            case 'y':
-                i = 0;
-                while(c->s1[i] != *out_buffer.write_pos && i < c->s1_len) i++;
-                if(c->s1[i] == *out_buffer.write_pos && i < c->s1_len) put_byte(c->s2[i]);
-                break;
-            case 'c':
-                switch(c->s1[0])
-                {
-                    case 'A':                   // from ascii
-                        switch(c->s1[3])
-                        {
-                            case 'B':           // to bcd
-                                if(c->rpos || (last_byte() && out_buffer.block_offset == 0))     // skip first nibble
-                                {
-                                    c->rpos = 0;
-                                    if(last_byte())  // unless last byte of block
-                                    {
-                                        if(*out_buffer.write_pos >= '0' && *out_buffer.write_pos <= '9') 
-                                        {
-                                            a = *out_buffer.write_pos - '0';
-                                            a = (a << 4) & 0xf0;
-                                            b = 0x0f;
-                                            *out_buffer.write_pos = a | b;
-                                        }
-                                    }
-                                    break;
-                                }
-                                if(out_buffer.block_offset == 0 || delete_this_byte) break;
-                                if((out_buffer.write_pos[-1] >= '0' && out_buffer.write_pos[-1] <= '9'))
-                                {
-                                    a = out_buffer.write_pos[-1] - '0';
-                                    a = (a << 4) & 0xf0;
-                                    if(*out_buffer.write_pos >= '0' && *out_buffer.write_pos <= '9')
-                                    {
-                                        b = *out_buffer.write_pos - '0';
-                                        b &= 0x0f;
-                                        delete_this_byte = 1;
-                                        c->rpos = 1;
-                                    } else
-                                    {
-                                        b = 0x0f;
-                                        if(*out_buffer.write_pos == 'F' || *out_buffer.write_pos == 'f') delete_this_byte=1;
-                                    }
-                                    out_buffer.write_pos[-1] = a | b;
-                                }
-                                break;
-                        }
-                        break;
-                    case 'B':               // from bcd
-                        switch(c->s1[3])
-                        {
-                            case 'A':       // to ascii
-                                if(((*out_buffer.write_pos >> 4) & 0x0f) <= 9 && 
-                                        ((*out_buffer.write_pos & 0x0f) <= 9 || (*out_buffer.write_pos & 0x0f) == 0x0f))
-                                {
-                                    a = (*out_buffer.write_pos >> 4) & 0x0f;
-                                    b = *out_buffer.write_pos & 0x0f;
-                                    *out_buffer.write_pos = '0' + a;
-                                    if(!delete_this_byte) 
-                                    {
-                                        write_next_byte();
-                                        if(b == 0x0f)
-                                        {
-                                            *out_buffer.write_pos = 'F';
-                                        } else
-                                        {
-                                            *out_buffer.write_pos = '0' + b;
-                                        }
-                                    }
-                                }
-                                break;
-                        }
-                        break;
-                }
-                break;
-            case 'j':
-                if(in_buffer.block_offset < c->count)
-                {
-                    while(c->next != NULL) c = c->next;     // skip rest of commands
-                }
-                break;
-            case 'J':
-                if(in_buffer.block_num <= c->count)
-                {
-                    skip_this_block = 1;
-                    return;
-                }
-                break;
-            case 'l':
-                if(in_buffer.block_offset >= c->count)
-                {
-                    while(c->next != NULL) c = c->next;     // skip rest of commands
-                }
-                break;
-            case 'L':
-                if(in_buffer.block_num > c->count)
-                {
-                    skip_this_block = 1;
-                    return;
-                }
-                break;
-            case 'p':
-                if (delete_this_byte) break;
-                i = 0;
-                a = *out_buffer.write_pos;
-                while(i < c->s1_len)
+                } else
                 {
-                    str = byte_to_string(a,c->s1[i]);
-                    write_string(str);
-                    i++;
-                    if (i < c->s1_len) 
+                    if(ctx->inserting)
+                    {
+                        ctx->inserting = 0;
+                    } else
                     {
-                        put_byte('-');
-                        write_next_byte();
+                        ctx->delete_this_byte = 1;
                     }
                 }
-                put_byte(' ');
+            }
+            break;
+        case 'y':
+            i = 0;
+            while(c->s1[i] != *ctx->out_buffer.write_pos && i < c->s1_len) i++;
+            if(c->s1[i] == *ctx->out_buffer.write_pos && i < c->s1_len) put_byte(c->s2[i]);
+            break;
+        case 'c':
+            if(ctx->delete_this_byte) break;
+            a = *ctx->out_buffer.write_pos;
+            read_count = convert_span(c,&a,(off_t) 1,converted,last_byte());
+            if(!read_count)
+            {
+                ctx->delete_this_byte = 1;
                 break;
-            case 'F':
-                str = off_t_to_string(in_buffer.stream_offset + (off_t) (in_buffer.read_pos-in_buffer.buffer),c->s1[0]);
-                write_string(str);
-                put_byte(':');
+            }
+            for(i = 0;i < read_count - 1;i++)
+            {
+                put_byte(converted[i]);
                 write_next_byte();
+            }
+            put_byte(converted[i]);
+            break;
+        case 'j':
+            if(ctx->in_buffer.block_offset < c->count) return 1;       // skip rest of commands
+            break;
+        case 'J':
+            if(ctx->in_buffer.block_num <= c->count)
+            {
+                ctx->skip_this_block = 1;
+                return 1;
+            }
+            break;
+        case 'l':
+            if(ctx->in_buffer.block_offset >= c->count) return 1;       // skip rest of commands
+            break;
+        case 'L':
+            if(ctx->in_buffer.block_num > c->count)
+            {
+                ctx->skip_this_block = 1;
+                return 1;
+            }
+            break;
+        case 'p':
+            if (ctx->delete_this_byte) break;
+            p = c->s2 + *ctx->out_buffer.write_pos * c->s2_len;
+            write_buffer(p + 1,(off_t) p[0]);
+            put_byte(' ');
+            break;
+        case 'F':
+            str = off_t_to_string(ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos-ctx->in_buffer.buffer),c->s1[0]);
+            write_string(str);
+            put_byte(':');
+            write_next_byte();
+            break;
+        case 'B':
+            str = off_t_to_string(ctx->in_buffer.block_num,c->s1[0]);
+            write_string(str);
+            put_byte(':');
+            write_next_byte();
+            break;
+        case 'N':
+            write_string(get_current_file());
+            put_byte(':');
+            write_next_byte();
+            break;
+        case '&':
+            put_byte(*ctx->out_buffer.write_pos & c->s1[0]);
+            break;
+        case '|':
+            put_byte(*ctx->out_buffer.write_pos | c->s1[0]);
+            break;
+        case '^':
+            put_byte(*ctx->out_buffer.write_pos ^ c->s1[0]);
+            break;
+        case '~':
+            put_byte(~*ctx->out_buffer.write_pos);
+            break;
+        case '<':
+        case '>':
+            write_buffer(c->s2,c->s2_len);
+            break;
+        case 'u':
+            if(ctx->in_buffer.block_offset <= c->offset)
+            {
+                put_byte(c->s1[0]);
+            }
+            break;
+        case 'f':
+            if(ctx->in_buffer.block_offset >= c->offset)
+            {
+                put_byte(c->s1[0]);
+            }
+            break;
+        case 'w':
+        case 'W':
+            break;
+        case 'x':
+            put_byte(((*ctx->out_buffer.write_pos << 4) & 0xf0) | ((*ctx->out_buffer.write_pos >> 4) & 0x0f));
+            break;
+        case '{':
+            execute_sub_block(c->sub);
+            break;
+        case 'P':
+            patch_byte(c->patches);
+            break;
+    }
+    return 0;
+}
+
+/* execute given commands */
+void
+execute_commands(struct command_list *c)
+{
+    if(ctx->skip_this_block) return;
+
+    while(c != NULL)
+    {
+        if(execute_command(c)) return;
+        c = c->next;
+    }
+}
+/* execute one stage of span program, returns the number of bytes written to out */
+static off_t
+execute_span_stage(struct span_stage *st,unsigned char *in,off_t length,unsigned char *out,int last)
+{
+    register off_t i;
+    register unsigned char *map;
+
+    if(st->c == NULL)
+    {
+        map = st->map;
+        for(i = 0;i < length;i++) out[i] = map[in[i]];
+        return length;
+    }
+
+    switch(st->c->letter)
+    {
+        case 'p':
+            return p_format_span(st->c,in,length,out);
+        case 'c':
+            return convert_span(st->c,in,length,out,last);
+        case 'P':
+            return patch_span(st->c->patches,in,length,out,ctx->span_pos);
+    }
+    return 0;
+}
+
+/* execute span program for length bytes starting from in, bytes are written to output buffer.
+   last is true if the span ends the block */
+static void
+execute_span(unsigned char *in,off_t length,int last)
+{
+    unsigned char *out,*stage_in;
+    off_t chunk,stage_len;
+    int i;
+
+    if(ctx->skip_this_block || !ctx->span_stage_count)
+    {
+        while(length)
+        {
+            chunk = length > SPAN_BUFFER_SIZE ? SPAN_BUFFER_SIZE : length;
+            out = reserve_buffer(chunk);
+            memcpy(out,in,chunk);
+            commit_buffer(chunk);
+            in += chunk;
+            length -= chunk;
+        }
+        return;
+    }
+
+    while(length)
+    {
+        chunk = length > ctx->span_chunk ? ctx->span_chunk : length;
+        ctx->span_pos = ctx->in_buffer.stream_offset + (off_t) (in - ctx->in_buffer.buffer);
+        stage_in = in;
+        stage_len = chunk;
+        for(i = 0;i < ctx->span_stage_count;i++)
+        {
+            if(i == ctx->span_stage_count - 1)
+            {
+                out = reserve_buffer(stage_len * ctx->span_stages[i].ratio + SPAN_SLACK);
+            } else
+            {
+                out = ctx->span_buffer[i & 1];
+            }
+            stage_len = execute_span_stage(&ctx->span_stages[i],stage_in,stage_len,out,last && chunk == length);
+            stage_in = out;
+        }
+        commit_buffer(stage_len);
+        in += chunk;
+        length -= chunk;
+    }
+}
+
+/* check if byte commands can be executed for spans of bytes. This is possible when byte
+   commands are translations of single bytes (&,|,^,~,x and y), p, w, c and P commands. Consecutive translations
+   (also EBCDIC conversions of c command) are combined in one table. Commands after p or a c writing many bytes
+   act only on the last written byte, so only w can follow them */
+static void
+init_span_program(struct command_list *c)
+{
+    unsigned char map[256],*conv;
+    struct command_list *f;
+    struct span_stage *st;
+    int i,j,n,identity,moved;
+    off_t ratio,slack,max_chunk;
+
+    n = 0;
+    moved = 0;
+    for(f = c;f != NULL;f = f->next)
+    {
+        if(moved && f->letter != 'w' && f->letter != 'W') return;
+        switch(f->letter)
+        {
+            case '&':
+            case '|':
+            case '^':
+            case '~':
+            case 'x':
+            case 'y':
+            case 'w':
+            case 'W':
                 break;
-            case 'B':
-                str = off_t_to_string(in_buffer.block_num,c->s1[0]);
-                write_string(str);
-                put_byte(':');
-                write_next_byte();
+            case 'p':
+                moved = 1;
                 break;
-            case 'N':
-                write_string(get_current_file());
-                put_byte(':');
-                write_next_byte();
+            case 'c':
+                if(convert_map(f) == NULL) moved = 1;
+                break;
+            case 'P':
                 break;
+            default:
+                return;
+        }
+        n++;
+    }
+
+    ctx->span_stages = xmalloc((n + 1) * sizeof(struct span_stage));
+    ctx->span_stage_count = 0;
+    identity = 1;
+    for(i = 0;i < 256;i++) map[i] = (unsigned char) i;
+
+    for(f = c;;f = f->next)
+    {
+        if(f == NULL || f->letter == 'p' || f->letter == 'P' || (f->letter == 'c' && convert_map(f) == NULL))
+        {
+            if(!identity)
+            {
+                st = &ctx->span_stages[ctx->span_stage_count++];
+                st->c = NULL;
+                st->map = xmalloc(256);
+                memcpy(st->map,map,256);
+                st->ratio = 1;
+                for(i = 0;i < 256;i++) map[i] = (unsigned char) i;
+                identity = 1;
+            }
+            if(f == NULL) break;
+            st = &ctx->span_stages[ctx->span_stage_count++];
+            st->c = f;
+            st->map = NULL;
+            st->ratio = f->letter == 'p' ? f->s2_len : (f->letter == 'P' ? 1 : convert_ratio(f));
+            continue;
+        }
+
+        switch(f->letter)
+        {
             case '&':
-                put_byte(*out_buffer.write_pos & c->s1[0]);
+                for(i = 0;i < 256;i++) map[i] &= f->s1[0];
                 break;
             case '|':
-                put_byte(*out_buffer.write_pos | c->s1[0]);
+                for(i = 0;i < 256;i++) map[i] |= f->s1[0];
                 break;
             case '^':
-                put_byte(*out_buffer.write_pos ^ c->s1[0]);
+                for(i = 0;i < 256;i++) map[i] ^= f->s1[0];
                 break;
             case '~':
-                put_byte(~*out_buffer.write_pos);
+                for(i = 0;i < 256;i++) map[i] = ~map[i];
                 break;
-            case '<':
-            case '>':
-                if (fseeko(c->fd,0,SEEK_SET)) panic("Cannot seek file",c->s1,strerror(errno));
-                do
-                {
-                    read_count = fread(ioblock,1,IO_BLOCK_SIZE,c->fd);
-                    write_buffer(ioblock,read_count);
-                } while(read_count);
+            case 'x':
+                for(i = 0;i < 256;i++) map[i] = ((map[i] << 4) & 0xf0) | ((map[i] >> 4) & 0x0f);
                 break;
-            case 'u':
-                if(in_buffer.block_offset <= c->offset)
+            case 'y':
+                for(i = 0;i < 256;i++)
                 {
-                    put_byte(c->s1[0]);
+                    j = 0;
+                    while(j < f->s1_len && f->s1[j] != map[i]) j++;
+                    if(j < f->s1_len) map[i] = f->s2[j];
                 }
                 break;
-            case 'f':
-                if(in_buffer.block_offset >= c->offset)
-                {
-                    put_byte(c->s1[0]);
-                }
+            case 'c':
+                conv = convert_map(f);
+                for(i = 0;i < 256;i++) map[i] = conv[map[i]];
                 break;
             case 'w':
-                break;
-            case 'x':
-                put_byte(((*out_buffer.write_pos << 4) & 0xf0) | ((*out_buffer.write_pos >> 4) & 0x0f));
-                break;
+            case 'W':
+                continue;
         }
-        c = c->next;
+        identity = 1;
+        for(i = 0;i < 256;i++) if(map[i] != (unsigned char) i) identity = 0;
+    }
+
+    /* output of every stage must fit to buffer, output of stage is at most ratio * chunk + slack */
+    ratio = 1;
+    slack = 0;
+    ctx->span_chunk = SPAN_BUFFER_SIZE;
+    for(i = 0;i < ctx->span_stage_count;i++)
+    {
+        ratio *= ctx->span_stages[i].ratio;
+        slack = slack * ctx->span_stages[i].ratio + SPAN_SLACK;
+        if(slack >= SPAN_BUFFER_SIZE) return;
+        max_chunk = (SPAN_BUFFER_SIZE - slack) / ratio;
+        if(max_chunk < ctx->span_chunk) ctx->span_chunk = max_chunk;
     }
+    if(ctx->span_chunk < 1) return;
+
+    ctx->span_buffer[0] = xmalloc(SPAN_BUFFER_SIZE);
+    ctx->span_buffer[1] = xmalloc(SPAN_BUFFER_SIZE);
+    ctx->span_program = 1;
 }
 
 /* write w command, will be called when output_buffer is written, same will be written to w-command files */
@@ -451,20 +568,24 @@ void
 write_w_command(unsigned char *buf,size_t length)
 {
     struct command_list *c;
+    PHASE_BEGIN(PHASE_W);
 
-    if(skip_this_block) return;
+    if(ctx->skip_this_block)
+    {
+        PHASE_END();
+        return;
+    }
 
-    c = current_byte_commands;
+    c = ctx->current_byte_commands;
 
     while(c != NULL)
     {
-        if(c->letter == 'w')
-        {
-            if(fwrite(buf,1,length,c->fd) != length) panic("Cannot write to file",c->s2,strerror(errno));
-            if(length) c->count = 1;    // file was written
-        }
+        if(c->letter == 'w') sink_write(c->sink,buf,length);
+        if(c->letter == 'W') container_write(c->container,buf,length);
+        if(c->letter == 'w' || c->letter == 'W') REPORT_ADD(w_bytes,length);
         c = c->next;
     }
+    PHASE_END();
 }
 
 /* finds the %B or %nB format string from the filename of w-command 
@@ -523,107 +644,379 @@ bn_printf(char *file,char *str,off_t block_number)
     strcat(file,f);
 }
 
-/* close (if open) and open next w-command files for new block */
+/* move w-command sinks to the files of new block and start new block in W-command containers */
 void
 open_w_files(off_t block_number)
 {
     struct command_list *c;
-    static char file[4096];
+    char file[4096];
 
-    c = current_byte_commands;
+    c = ctx->current_byte_commands;
 
     while(c != NULL)
     {
         if(c->letter == 'w' && c->offset)
         {
-            if(c->fd != NULL) 
-            {
-                if(fclose(c->fd) != 0) panic("Error closing file",c->s2,strerror(errno));
-                if (!c->count && c->s2 != NULL)  // remove if empty
-                {
-                    unlink(c->s2);
-                }
-                c->fd = NULL;
-            }
-
             bn_printf(file,c->s1,block_number);
-            c->fd = fopen(file,"w");
-            if(c->fd == NULL) panic("Cannot open file for writing",file,strerror(errno));
-            c->count = 0;
-            if(c->s2 != NULL) free(c->s2);
-            c->s2 = xstrdup(file);
+            sink_next_file(c->sink,file);
         }
+        if(c->letter == 'W') container_block(c->container,block_number);
         c = c->next;
     }
 }
 
                 
 
-/* init_commands, initialize those wich need it, currently w - open file and rpos=0 for all */
+/* read the contents of the file of < or > command to s2, large files are mapped to memory */
+static void
+load_insert_file(struct command_list *c)
+{
+    struct stat st;
+    ssize_t read_count;
+    off_t size;
+    int fd;
+
+    fd = open(c->s1,O_RDONLY);
+    if(fd == -1) panic("Cannot open file for reading",c->s1,strerror(errno));
+    if(fstat(fd,&st) == -1) panic("Cannot stat file",c->s1,strerror(errno));
+
+    c->offset = 0;
+#ifdef _POSIX_MAPPED_FILES
+    if(S_ISREG(st.st_mode) && st.st_size >= INSERT_MMAP_SIZE)
+    {
+        c->s2 = mmap(NULL,(size_t) st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(c->s2 != MAP_FAILED)
+        {
+            c->s2_len = st.st_size;
+            c->offset = 1;
+            close(fd);
+            return;
+        }
+    }
+#endif
+
+    size = S_ISREG(st.st_mode) && st.st_size > 0 ? st.st_size : IO_BLOCK_SIZE;
+    c->s2 = xmalloc(size);
+    c->s2_len = 0;
+    do
+    {
+        if(c->s2_len == size)
+        {
+            size *= 2;
+            c->s2 = xrealloc(c->s2,size);
+        }
+        read_count = read(fd,c->s2 + c->s2_len,(size_t) (size - c->s2_len));
+        if(read_count == -1) panic("Error reading file",c->s1,strerror(errno));
+        c->s2_len += read_count;
+    } while(read_count);
+    close(fd);
+}
+
+/* release the contents of < or > command file */
+static void
+free_insert_file(struct command_list *c)
+{
+#ifdef _POSIX_MAPPED_FILES
+    if(c->offset)
+    {
+        munmap(c->s2,(size_t) c->s2_len);
+        return;
+    }
+#endif
+    free(c->s2);
+}
+
+/* make p tables of the commands of sub-block */
+static void
+init_sub_block(struct sub_block *s)
+{
+    struct command_list *c;
+
+    for(c = s->cmds.byte;c != NULL;c = c->next)
+    {
+        if(c->letter == 'p') c->s2 = make_p_table(c->s1,c->s1_len,&c->s2_len);
+        if(c->letter == '{') init_sub_block(c->sub);
+    }
+}
+
+/* offsets of the block where byte command c can act, from first to last. Returns
+   false for commands which can act at every offset */
+static int
+command_range(struct command_list *c,off_t *first,off_t *last)
+{
+    switch(c->letter)
+    {
+        case 'r':
+            *first = c->offset;
+            *last = c->offset + c->s1_len - 1;
+            return 1;
+        case 'i':
+            *first = c->offset;
+            *last = c->offset + c->s1_len;      // inserting continues at next bytes if other commands delete
+            return 1;
+        case 'd':
+            *first = c->offset;
+            *last = c->count ? c->offset + c->count : BLOCK_END_OFFSET;
+            return 1;
+        case 'u':
+            *first = 0;
+            *last = c->offset;
+            return 1;
+        case 'f':
+            *first = c->offset;
+            *last = BLOCK_END_OFFSET;
+            return 1;
+        case 'j':
+            *first = 0;
+            *last = c->count - 1;
+            return 1;
+        case 'l':
+            *first = c->count;
+            *last = BLOCK_END_OFFSET;
+            return 1;
+        case 'w':
+        case 'W':
+            *first = 1;                          // never, block is written at flush
+            *last = 0;
+            return 1;
+    }
+    return 0;
+}
+
+/* true if command c is active in segment starting at start */
+static int
+active_in_segment(struct command_list *c,off_t start)
+{
+    off_t first,last;
+
+    if(!command_range(c,&first,&last)) return 1;
+    return first <= start && start <= last;
+}
+
+static int
+compare_offsets(const void *a,const void *b)
+{
+    off_t x = *(const off_t *) a,y = *(const off_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* divide the block offsets to segments at the offsets where commands start or stop acting, and
+   make the list of active commands of every segment. Bytes of the segments without active commands
+   are copied without executing commands */
+static void
+init_byte_index(struct command_list *commands)
+{
+    struct command_list *c,**pool;
+    off_t *bounds,first,last;
+    size_t n,used;
+    int count,i,j;
+
+    n = 0;
+    for(c = commands;c != NULL;c = c->next) if(command_range(c,&first,&last)) n++;
+    if(!n) return;
+
+    bounds = xmalloc((2 * n + 1) * sizeof(off_t));
+    count = 0;
+    bounds[count++] = 0;
+    for(c = commands;c != NULL;c = c->next)
+    {
+        if(!command_range(c,&first,&last) || first > last) continue;
+        bounds[count++] = first;
+        if(last < BLOCK_END_OFFSET) bounds[count++] = last + 1;
+    }
+    qsort(bounds,(size_t) count,sizeof(off_t),compare_offsets);
+    j = 0;
+    for(i = 1;i < count;i++) if(bounds[i] != bounds[j]) bounds[++j] = bounds[i];
+    count = j + 1;
+
+    used = 0;
+    for(i = 0;i < count;i++)
+    {
+        for(c = commands;c != NULL;c = c->next) if(active_in_segment(c,bounds[i])) used++;
+        used++;
+    }
+
+    ctx->byte_segments = xmalloc(count * sizeof(struct byte_segment));
+    pool = xmalloc(used * sizeof(struct command_list *));
+    for(i = 0;i < count;i++)
+    {
+        ctx->byte_segments[i].start = bounds[i];
+        ctx->byte_segments[i].cmds = pool;
+        for(c = commands;c != NULL;c = c->next) if(active_in_segment(c,bounds[i])) *pool++ = c;
+        *pool++ = NULL;
+    }
+    ctx->byte_segment_count = count;
+    free(bounds);
+}
+
+/* move to the segment of the current byte, offsets only grow within the block */
+static struct byte_segment *
+current_segment()
+{
+    while(ctx->byte_segment + 1 < ctx->byte_segment_count &&
+          ctx->in_buffer.block_offset >= ctx->byte_segments[ctx->byte_segment + 1].start) ctx->byte_segment++;
+    return &ctx->byte_segments[ctx->byte_segment];
+}
+
+/* execute the byte commands for the current byte, only those active at the current
+   offset if the commands are indexed */
+static void
+execute_byte_commands(struct command_list *c)
+{
+    struct command_list **a;
+
+    if(ctx->byte_segments == NULL)
+    {
+        execute_commands(c);
+        return;
+    }
+    if(ctx->skip_this_block) return;
+    for(a = current_segment()->cmds;*a != NULL;a++) if(execute_command(*a)) return;
+}
+
+/* number of bytes starting from the current byte for which no byte commands are executed,
+   they can be copied as they are. Zero if there are commands for the current byte */
+static off_t
+quiet_bytes()
+{
+    struct byte_segment *s;
+    off_t span;
+
+    span = block_span();
+    if(ctx->skip_this_block) return span;
+    s = current_segment();
+    if(*s->cmds != NULL) return 0;
+    if(ctx->byte_segment + 1 < ctx->byte_segment_count && s[1].start - ctx->in_buffer.block_offset < span)
+        span = s[1].start - ctx->in_buffer.block_offset;
+    return span;
+}
+
+/* init_commands, initialize those wich need it once before the runs: p - make the output table,
+   w and W - check if there are per block files, span program or index of byte commands, digests of H and V commands */
 void
 init_commands(struct commands *commands)
 {
     struct command_list *c;
     int wlen;
 
+    if(ctx->sub_depth) panic("{ without }",NULL,NULL);
+
+    init_format_tables();
+    init_codec_tables();
+
     c = commands->byte;
 
     while(c != NULL)
     {
         switch(c->letter)
         {
+            case 'p':
+                c->s2 = make_p_table(c->s1,c->s1_len,&c->s2_len);
+                break;
+            case '{':
+                init_sub_block(c->sub);
+                break;
             case 'w':
-                if(find_block_w_file(c->s1,&wlen) != NULL)
-                {
-                    c->fd = NULL;
-                    c->offset = 1;
-                    w_commands_block_num = 1;
-                    c->s2 = NULL;
-                } else
-                {
-                    c->fd = fopen(c->s1,"w");
-                    if(c->fd == NULL) panic("Cannot open file for writing",c->s1,strerror(errno));
-                    c->offset = 0;
-                    c->s2 = xstrdup(c->s1);
-                }
-                c->count = 0;
+                c->offset = find_block_w_file(c->s1,&wlen) != NULL;
+                if(c->offset) ctx->w_commands_block_num = 1;
+                break;
+            case 'W':
+                ctx->w_commands_block_num = 1;
                 break;
         }
         c = c->next;
     }
 
-    c = commands->block_start;
+    init_span_program(commands->byte);
+    if(!ctx->span_program) init_byte_index(commands->byte);
+
+    c = commands->block_end;
 
     while(c != NULL)
     {
         switch(c->letter)
         {
-            case '>':
-                c->fd = fopen(c->s1,"r");
-                if(c->fd == NULL) panic("Cannot open file for reading",c->s1,strerror(errno));
+            case 'H':
+            case 'V':
+                init_digest(c);
+                if(c->letter == 'V' && c->s1 == NULL) ctx->hold_output = 1;
                 break;
         }
         c = c->next;
     }
+    ctx->commands_ready = 1;
+}
 
-    c = commands->block_end;
+/* open_commands, open those wich need it at start of every run: w - sink, W - container,
+   < and > - read the file */
+void
+open_commands(struct commands *commands)
+{
+    struct command_list *c;
+
+    ctx->skip_this_block = 0;
+
+    c = commands->byte;
 
     while(c != NULL)
     {
         switch(c->letter)
         {
-            case '<':
-                c->fd = fopen(c->s1,"r");
-                if(c->fd == NULL) panic("Cannot open file for reading",c->s1,strerror(errno));
+            case 'w':
+                c->sink = sink_create(c->offset ? NULL : (char *) c->s1);
+                break;
+            case 'W':
+                c->container = container_create(c->s1);
+                break;
+            case 'P':
+                load_patches(c);
+                break;
+            case '{':
+                c->sub->parent = -1;
+                c->sub->pos = -1;
+                c->sub->inside = 0;
+                c->sub->inserting = 0;
+                open_commands(&c->sub->cmds);
                 break;
         }
         c = c->next;
     }
-    
+
+    c = commands->block_start;
+
+    while(c != NULL)
+    {
+        if(c->letter == '>') load_insert_file(c);
+        if(c->letter == 'U') set_clear(c->set);
+        c = c->next;
+    }
+
+    c = commands->block_end;
+
+    while(c != NULL)
+    {
+        if(c->letter == '<') load_insert_file(c);
+        c = c->next;
+    }
 }
 
+/* release the files of < and > commands */
+static void
+free_insert_files(struct command_list *c)
+{
+    while(c != NULL)
+    {
+        if((c->letter == '<' || c->letter == '>') && c->s2 != NULL)
+        {
+            free_insert_file(c);
+            c->s2 = NULL;
+        }
+        c = c->next;
+    }
+}
 
-/* close_commands, close those wich need it, currently w - close file */
+/* close_commands, close those wich need it at end of run, currently w and W - close file */
 void
 close_commands(struct commands *commands)
 {
@@ -636,46 +1029,104 @@ close_commands(struct commands *commands)
         switch(c->letter)
         {
             case 'w':
-                if(c->fd != NULL)
-                {
-                    if(fclose(c->fd) != 0) panic("Error in closing file",c->s2,strerror(errno));
-                    if(!c->count && c->s2 != NULL)
-                    {
-                        unlink(c->s2);
-                    }
-                }
+                sink_close(c->sink);
+                c->sink = NULL;
+                break;
+            case 'W':
+                container_close(c->container);
+                c->container = NULL;
                 break;
         }
         c = c->next;
     }
+    sink_shutdown();
 
-    c = commands->block_start;
+    free_insert_files(commands->block_start);
+    free_insert_files(commands->block_end);
+}
 
-    while(c != NULL)
+/* discard_commands, after an error: files of w and W commands are closed without writing
+   the buffered data, nothing here can fail */
+void
+discard_commands(struct commands *commands)
+{
+    struct command_list *c;
+
+    for(c = commands->byte;c != NULL;c = c->next)
     {
-        switch(c->letter)
-        {
-            case '>':
-                fclose(c->fd);
-                break;
-        }
-        c = c->next;
+        if(c->letter == 'w' && c->sink != NULL) sink_discard(c->sink);
+        if(c->letter == 'W' && c->container != NULL) container_discard(c->container);
+        c->sink = NULL;
+        c->container = NULL;
     }
 
-    c = commands->block_end;
+    free_insert_files(commands->block_start);
+    free_insert_files(commands->block_end);
+}
+
+static void
+free_command_list(struct command_list *c)
+{
+    struct command_list *next;
 
     while(c != NULL)
     {
-        switch(c->letter)
+        next = c->next;
+        free(c->s1);
+        if(c->letter != '<' && c->letter != '>') free(c->s2);
+        set_free(c->set);
+        free(c->field);
+        free_patches(c->patches);
+        filter_free(c->filter);
+        if(c->sub != NULL)
         {
-            case '<':
-                fclose(c->fd);
-                break;
+            free_command_list(c->sub->cmds.block_start);
+            free_command_list(c->sub->cmds.byte);
+            free_command_list(c->sub->cmds.block_end);
+            if(c->sub->block.type & BLOCK_START_S) free(c->sub->block.start.S.string);
+            if(c->sub->block.type & BLOCK_STOP_S) free(c->sub->block.stop.S.string);
+            free(c->sub);
         }
-        c = c->next;
+        free(c);
+        c = next;
     }
 }
 
+/* free_commands, release the commands and everything made by init_commands */
+void
+free_commands(struct commands *commands)
+{
+    int i;
+
+    free_command_list(commands->block_start);
+    free_command_list(commands->byte);
+    free_command_list(commands->block_end);
+    commands->block_start = NULL;
+    commands->byte = NULL;
+    commands->block_end = NULL;
+    ctx->sub_depth = 0;
+
+    for(i = 0;i < ctx->span_stage_count;i++) free(ctx->span_stages[i].map);
+    free(ctx->span_stages);
+    free(ctx->span_buffer[0]);
+    free(ctx->span_buffer[1]);
+    ctx->span_stages = NULL;
+    ctx->span_stage_count = 0;
+    ctx->span_buffer[0] = NULL;
+    ctx->span_buffer[1] = NULL;
+    ctx->span_program = 0;
+
+    if(ctx->byte_segments != NULL) free(ctx->byte_segments[0].cmds);
+    free(ctx->byte_segments);
+    ctx->byte_segments = NULL;
+    ctx->byte_segment_count = 0;
+
+    free_digests();
+    ctx->w_commands_block_num = 0;
+    ctx->hold_output = 0;
+    ctx->commands_ready = 0;
+}
+
 /* reset the rpos counter for next block, in case block was shorter eg. delete count */
 inline void
 reset_rpos(struct command_list *c)
@@ -690,37 +1141,233 @@ reset_rpos(struct command_list *c)
 
 
 
+/* stream offset of the current byte */
+static off_t
+stream_pos()
+{
+    return ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos - ctx->in_buffer.buffer);
+}
+
+/* last byte of the current block which is in the buffer */
+unsigned char *
+available_end()
+{
+    if(ctx->in_buffer.block_end != NULL) return ctx->in_buffer.block_end;
+    if(ctx->in_buffer.stream_end != NULL) return ctx->in_buffer.stream_end;
+    return ctx->in_buffer.buffer + INPUT_BUFFER_SIZE - 1;
+}
+
+/* true if string is at p and inside the current block */
+static int
+match_at(unsigned char *p,unsigned char *string,off_t length)
+{
+    if(length > available_end() - p + 1) return 0;
+    return memcmp(p,string,length) == 0;
+}
+
+/* check if a sub-block starts at the current byte */
+static int
+sub_block_starts(struct sub_block *s)
+{
+    struct block *b = &s->block;
+
+    if(b->type & BLOCK_START_M) return ctx->in_buffer.block_offset == b->start.N;
+    if(b->start.S.length) return match_at(read_pos(),b->start.S.string,b->start.S.length);
+    return 1;
+}
+
+/* find the end of the current sub-block if it is at or after the current byte, end
+   is searched like in mark_block_end but only within the enclosing block */
+static void
+sub_block_end(struct sub_block *s,off_t pos)
+{
+    struct block *b = &s->block;
+    off_t start_length;
+
+    start_length = b->type & BLOCK_START_S ? b->start.S.length : 0;
+
+    if(b->type & BLOCK_STOP_S)
+    {
+        if(b->stop.S.length)
+        {
+            if(pos - s->start >= start_length && match_at(read_pos(),b->stop.S.string,b->stop.S.length))
+                s->end = pos + b->stop.S.length - 1;
+        } else if(start_length)
+        {
+            if(pos + 1 - s->start >= start_length && match_at(read_pos() + 1,b->start.S.string,start_length))
+                s->end = pos;
+        }
+    }
+
+    if(s->end < 0 && last_byte()) s->end = pos;
+}
+
+/* { command, executed for every byte of the enclosing block. When the commands of
+   the sub-block are executed, block offset, number and end of the current block
+   are those of the sub-block. Sub-blocks are numbered from 1 in every enclosing block */
+static void
+execute_sub_block(struct sub_block *s)
+{
+    off_t pos,parent;
+    off_t saved_offset,saved_num;
+    unsigned char *saved_end;
+    int saved_inserting;
+    unsigned char byte;
+
+    if(ctx->delete_this_block) return;
+
+    pos = stream_pos();
+    if(pos == s->pos && !s->inserting)         // other commands are inserting
+    {
+        if(s->inside && s->deleted) ctx->delete_this_byte = 1;
+        return;
+    }
+
+    parent = pos - ctx->in_buffer.block_offset;
+    if(parent != s->parent)
+    {
+        s->parent = parent;
+        s->inside = 0;
+        s->number = 0;
+        s->inserting = 0;
+    }
+
+    if(s->inside && s->end >= 0 && pos > s->end) s->inside = 0;
+
+    if(!s->inside && sub_block_starts(s))
+    {
+        s->inside = 1;
+        s->number++;
+        s->start = pos;
+        s->end = -1;
+        if(s->block.type & BLOCK_STOP_M) s->end = pos + s->block.stop.M - 1;
+        s->deleted = 0;
+        s->skipped = 0;
+        s->inserting = 0;
+        reset_rpos(s->cmds.byte);
+    }
+
+    if(!s->inside) return;
+    if(s->end < 0 && !s->inserting) sub_block_end(s,pos);
+    s->pos = pos;
+
+    saved_offset = ctx->in_buffer.block_offset;
+    saved_num = ctx->in_buffer.block_num;
+    saved_end = ctx->in_buffer.block_end;
+
+    ctx->in_buffer.block_offset = pos - s->start;
+    ctx->in_buffer.block_num = s->number;
+    if(s->end >= 0 && s->end - pos <= available_end() - read_pos()) ctx->in_buffer.block_end = read_pos() + (s->end - pos);
+
+    if(pos == s->start && !s->inserting)
+    {
+        byte = *ctx->out_buffer.write_pos;
+        execute_commands(s->cmds.block_start);
+        put_byte(byte);
+        s->deleted = ctx->delete_this_block;
+        s->skipped = ctx->skip_this_block;
+        ctx->delete_this_block = 0;
+        ctx->skip_this_block = 0;
+    }
+
+    if(s->deleted)
+    {
+        ctx->delete_this_byte = 1;
+    } else if(!s->skipped)
+    {
+        saved_inserting = ctx->inserting;
+        ctx->inserting = 0;
+        execute_commands(s->cmds.byte);
+        s->inserting = ctx->inserting;
+        ctx->inserting |= saved_inserting;
+        ctx->skip_this_block = 0;
+    }
+
+    if(!s->inserting && last_byte())
+    {
+        if(s->cmds.block_end != NULL && !s->deleted && !s->skipped)
+        {
+            if(!ctx->delete_this_byte) write_next_byte();     // block end commands are written after the last byte
+            ctx->delete_this_byte = 1;
+            execute_commands(s->cmds.block_end);
+        }
+        s->inside = 0;
+    }
+
+    ctx->in_buffer.block_offset = saved_offset;
+    ctx->in_buffer.block_num = saved_num;
+    ctx->in_buffer.block_end = saved_end;
+}
+
 /* main execution loop */
 void
 execute_program(struct commands *commands)
 {
     int block_end;
+    off_t span;
 
-    current_byte_commands = commands->byte;
+    ctx->current_byte_commands = commands->byte;
+    if(ctx->cache_dir != NULL) open_cache(commands);
+    reset_filters();
 
     while(find_block())
     {
+        if(stats_report) report_phase(PHASE_EXECUTE);
+        if(ctx->cache_path != NULL && cached_block()) continue;
         reset_rpos(commands->byte);
-        delete_this_block = 0;
-        out_buffer.block_offset = 0;
-        skip_this_block = 0;
-        if(w_commands_block_num) open_w_files(in_buffer.block_num);
+        ctx->delete_this_block = 0;
+        ctx->out_buffer.block_offset = 0;
+        ctx->skip_this_block = 0;
+        ctx->drop_this_block = 0;
+        if(ctx->block_digests) reset_digests();
+        if(ctx->w_commands_block_num) open_w_files(ctx->in_buffer.block_num);
         execute_commands(commands->block_start);
-        do
+        if(ctx->drop_this_block)
         {
-            delete_this_byte = 0;
-            inserting = 0;
-            block_end = last_byte();
-            put_byte(read_byte());     // as default write current byte from input
-            execute_commands(commands->byte);
-            if(!delete_this_byte && !delete_this_block)
+            discard_buffer();           // output of commands before k or K
+            do
             {
-               write_next_byte();           // advance the write pointer if byte is not marked for del
-            }
-            if(!block_end && !inserting) get_next_byte();
-        } while (!block_end || inserting);
+                span = block_span();
+            } while(!skip_span(span));
+        } else if(ctx->span_program && !ctx->delete_this_block)
+        {
+            do
+            {
+                span = block_span();
+                execute_span(read_pos(),span,read_pos() + span - 1 == block_end_pos());
+            } while(!skip_span(span));
+        } else
+        {
+            ctx->byte_segment = 0;
+            do
+            {
+                if(ctx->byte_segments != NULL && !ctx->inserting && (span = quiet_bytes()) > 0)
+                {
+                    if(!ctx->delete_this_block) write_buffer(read_pos(),span);
+                    block_end = skip_span(span);
+                    continue;
+                }
+                ctx->delete_this_byte = 0;
+                ctx->inserting = 0;
+                block_end = last_byte();
+                put_byte(read_byte());     // as default write current byte from input
+                execute_byte_commands(commands->byte);
+                if(!ctx->delete_this_byte && !ctx->delete_this_block)
+                {
+                   write_next_byte();           // advance the write pointer if byte is not marked for del
+                }
+                if(!block_end && !ctx->inserting) get_next_byte();
+            } while (!block_end || ctx->inserting);
+        }
+        if(ctx->filters_pending && !deferred_block_matches())
+        {
+            discard_buffer();           // held output of the whole block
+            ctx->skip_this_block = 1;
+        }
         execute_commands(commands->block_end);
         flush_buffer();
+        if(ctx->cache_capture) store_block();
     }
+    if(stats_report) report_phase(PHASE_OTHER);
     close_output_stream();
 }
@@ -0,0 +1,308 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* n command, unsigned integer fields at a block offset. The load and store functions
+   for the width and byte order of the field are selected when the command is parsed,
+   the command is executed once at the start of the block on the input buffer, before
+   the bytes of the block are written */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static uint64_t
+load_u8(unsigned char *p)
+{
+    return (uint64_t) p[0];
+}
+
+static void
+store_u8(unsigned char *p,uint64_t v)
+{
+    p[0] = (unsigned char) v;
+}
+
+static uint64_t
+load_u16le(unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8;
+}
+
+static void
+store_u16le(unsigned char *p,uint64_t v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+}
+
+static uint64_t
+load_u16be(unsigned char *p)
+{
+    return (uint64_t) p[0] << 8 | (uint64_t) p[1];
+}
+
+static void
+store_u16be(unsigned char *p,uint64_t v)
+{
+    p[0] = (unsigned char) (v >> 8);
+    p[1] = (unsigned char) v;
+}
+
+static uint64_t
+load_u32le(unsigned char *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24;
+}
+
+static void
+store_u32le(unsigned char *p,uint64_t v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+static uint64_t
+load_u32be(unsigned char *p)
+{
+    return (uint64_t) p[0] << 24 | (uint64_t) p[1] << 16 | (uint64_t) p[2] << 8 | (uint64_t) p[3];
+}
+
+static void
+store_u32be(unsigned char *p,uint64_t v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static uint64_t
+load_u64le(unsigned char *p)
+{
+    return load_u32le(p) | load_u32le(p + 4) << 32;
+}
+
+static void
+store_u64le(unsigned char *p,uint64_t v)
+{
+    store_u32le(p,v);
+    store_u32le(p + 4,v >> 32);
+}
+
+static uint64_t
+load_u64be(unsigned char *p)
+{
+    return load_u32be(p) << 32 | load_u32be(p + 4);
+}
+
+static void
+store_u64be(unsigned char *p,uint64_t v)
+{
+    store_u32be(p,v >> 32);
+    store_u32be(p + 4,v);
+}
+
+/* field types, u8 has no byte order. Store functions take the low bytes of the value */
+static struct {
+    char *name;
+    int width;
+    uint64_t (*load)(unsigned char *p);
+    void (*store)(unsigned char *p,uint64_t v);
+} field_types[] = {
+    {"U8",1,load_u8,store_u8},
+    {"U16LE",2,load_u16le,store_u16le},
+    {"U16BE",2,load_u16be,store_u16be},
+    {"U32LE",4,load_u32le,store_u32le},
+    {"U32BE",4,load_u32be,store_u32be},
+    {"U64LE",8,load_u64le,store_u64le},
+    {"U64BE",8,load_u64be,store_u64be},
+    {"",0,NULL,NULL},
+};
+
+/* operations of n command, order is the order of FIELD_ defines */
+static char *field_ops[] = {
+    "=",
+    "+",
+    "-",
+    "P",
+    "==",
+    "!=",
+    "<",
+    "<=",
+    ">",
+    ">=",
+    "",
+};
+
+/* parse unsigned value of n command, value must fit to the field */
+static uint64_t
+parse_field_value(char *value,int width)
+{
+    unsigned long long v;
+    char *end;
+
+    if(!isdigit(*value)) panic("Error in number",value,NULL);
+    errno = 0;
+    v = strtoull(value,&end,0);
+    if(*end || errno == ERANGE) panic("Error in number",value,NULL);
+    if(width < 8 && v >> (8 * width)) panic("Value too large for field",value,NULL);
+    return (uint64_t) v;
+}
+
+/* parse n offset type operation [value], token[0] is the command letter */
+struct field *
+parse_field(char **token,int count,char *command_string)
+{
+    struct field *f;
+    char *s;
+    int i;
+
+    if(count < 4 || count > 5) panic("Error in command",command_string,NULL);
+
+    for(s = token[2];*s;s++) *s = toupper(*s);
+    for(s = token[3];*s;s++) *s = toupper(*s);
+
+    f = xmalloc(sizeof(struct field));
+    memset(f,0,sizeof(struct field));
+
+    i = 0;
+    while(*field_types[i].name != 0 && strcmp(field_types[i].name,token[2]) != 0) i++;
+    if(*field_types[i].name == 0)
+    {
+        if(strcmp(token[2],"U8LE") == 0 || strcmp(token[2],"U8BE") == 0)
+        {
+            i = 0;
+        } else
+        {
+            panic("Unknown field type",command_string,NULL);
+        }
+    }
+    f->type = i;
+    f->width = field_types[i].width;
+    f->load = field_types[i].load;
+    f->store = field_types[i].store;
+
+    i = 0;
+    while(*field_ops[i] != 0 && strcmp(field_ops[i],token[3]) != 0) i++;
+    if(*field_ops[i] == 0) panic("Unknown operation",command_string,NULL);
+    f->op = i;
+
+    if(f->op == FIELD_PRINT)
+    {
+        f->format = 'D';
+        if(count == 5)
+        {
+            f->format = toupper(token[4][0]);
+            if(strlen(token[4]) != 1 || strchr("DOH",f->format) == NULL) panic("Error in command",command_string,NULL);
+        }
+    } else
+    {
+        if(count != 5) panic("Error in command",command_string,NULL);
+        f->value = parse_field_value(token[4],f->width);
+    }
+    return f;
+}
+
+/* unsigned value as F and B commands write numbers */
+static char *
+field_to_string(uint64_t v,char format)
+{
+    char *string = ctx->number_string;
+
+    switch(format)
+    {
+        case 'H':
+            sprintf(string,"x%llx",(unsigned long long) v);
+            break;
+        case 'O':
+            sprintf(string,"0%llo",(unsigned long long) v);
+            break;
+        default:
+            sprintf(string,"%llu",(unsigned long long) v);
+            break;
+    }
+    return string;
+}
+
+/* execute n command at the start of the block. Field is changed in the input buffer,
+   so the changed bytes are seen by the byte commands. If the field is not inside the
+   block or the whole field is not in the buffer, nothing is changed or written and
+   the comparisons are false */
+void
+execute_field(struct command_list *c)
+{
+    struct field *f = c->field;
+    unsigned char *p;
+    uint64_t v;
+    int match;
+
+    if(c->offset + f->width - 1 > available_end() - read_pos())
+    {
+        if(f->op >= FIELD_EQ) ctx->delete_this_block = 1;
+        return;
+    }
+
+    p = read_pos() + c->offset;
+    v = f->load(p);
+    match = 1;
+    switch(f->op)
+    {
+        case FIELD_SET:
+            f->store(p,f->value);
+            return;
+        case FIELD_ADD:
+            f->store(p,v + f->value);
+            return;
+        case FIELD_SUB:
+            f->store(p,v - f->value);
+            return;
+        case FIELD_PRINT:
+            write_string(field_to_string(v,f->format));
+            put_byte(':');
+            write_next_byte();
+            return;
+        case FIELD_EQ:
+            match = v == f->value;
+            break;
+        case FIELD_NE:
+            match = v != f->value;
+            break;
+        case FIELD_LT:
+            match = v < f->value;
+            break;
+        case FIELD_LE:
+            match = v <= f->value;
+            break;
+        case FIELD_GT:
+            match = v > f->value;
+            break;
+        case FIELD_GE:
+            match = v >= f->value;
+            break;
+    }
+    if(!match) ctx->delete_this_block = 1;
+}
@@ -0,0 +1,277 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* k and K commands, block predicates. If the whole block is in the input buffer,
+   predicate is tested at the start of the block. For a longer block the output of
+   the block is held and the predicate is tested on the bytes of the block when they
+   are left behind by the refills of the input buffer, the block is kept or dropped at
+   the end of the block. Predicate is one of
+     s1 != NULL   block contains string s1
+     s2 != NULL   all bytes of the block are between s2[0] and s2[1]
+     otherwise    length of the block is between offset and count (-1 for no limit) */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* state of a predicate waiting for the end of the block */
+struct block_filter {
+    int pending;                // predicate is tested at the end of the block
+    int matches;                // string found or all bytes in range so far
+    unsigned char *tail;        // last s1_len - 1 bytes tested, string can start in them
+    off_t tail_len;
+    unsigned char *join;        // tail and the start of the next bytes
+};
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* search string from length bytes at p. Vector version compares the first and
+   the last byte of string at 16 positions at once and compares the rest only
+   at the positions where both match */
+static int
+contains_string(unsigned char *p,off_t length,unsigned char *string,off_t string_length)
+{
+    unsigned char *end,*q;
+#ifdef __SSE2__
+    __m128i first,last;
+    unsigned int mask;
+    int bit;
+#endif
+
+    if(string_length > length) return 0;
+    end = p + (length - string_length);         // last possible start
+#ifdef __SSE2__
+    first = _mm_set1_epi8((char) string[0]);
+    last = _mm_set1_epi8((char) string[string_length - 1]);
+    while(end - p >= 15)
+    {
+        mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) p),first),
+                    _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (p + string_length - 1)),last)));
+        while(mask)
+        {
+            bit = __builtin_ctz(mask);
+            if(string_length <= 2 || memcmp(p + bit + 1,string + 1,(size_t) string_length - 2) == 0) return 1;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    while(p <= end && (q = memchr(p,string[0],(size_t) (end - p) + 1)) != NULL)
+    {
+        if(memcmp(q,string,(size_t) string_length) == 0) return 1;
+        p = q + 1;
+    }
+    return 0;
+}
+
+/* true if all length bytes at p are between low and high */
+static int
+bytes_in_range(unsigned char *p,off_t length,unsigned char low,unsigned char high)
+{
+    unsigned char *end = p + length;
+    unsigned char width = high - low;
+#ifdef __SSE2__
+    __m128i l = _mm_set1_epi8((char) low);
+    __m128i w = _mm_set1_epi8((char) width);
+    __m128i d;
+
+    while(end - p >= 16)
+    {
+        d = _mm_sub_epi8(_mm_loadu_si128((__m128i *) p),l);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d,w),d)) != 0xffff) return 0;     // d <= width
+        p += 16;
+    }
+#endif
+    while(p < end)
+    {
+        if((unsigned char) (*p - low) > width) return 0;
+        p++;
+    }
+    return 1;
+}
+
+struct block_filter *
+filter_create(struct command_list *c)
+{
+    struct block_filter *f;
+    off_t n;
+
+    n = c->s1 != NULL ? c->s1_len - 1 : 0;
+    f = xmalloc(sizeof(struct block_filter));
+    f->pending = 0;
+    f->matches = 0;
+    f->tail = xmalloc(n + 1);
+    f->tail_len = 0;
+    f->join = xmalloc(2 * n + 1);
+    return f;
+}
+
+void
+filter_free(struct block_filter *f)
+{
+    if(f == NULL) return;
+    free(f->tail);
+    free(f->join);
+    free(f);
+}
+
+/* test the predicate of k or K command for the current block, whole block is in the buffer */
+int
+block_matches(struct command_list *c)
+{
+    unsigned char *p;
+    off_t length;
+
+    p = read_pos();
+    length = (off_t) (available_end() - p) + 1;
+
+    if(c->s1 != NULL) return contains_string(p,length,c->s1,c->s1_len);
+    if(c->s2 != NULL) return bytes_in_range(p,length,c->s2[0],c->s2[1]);
+    return length >= c->offset && (c->count < 0 || length <= c->count);
+}
+
+/* test the predicate of c on the next length bytes of the block */
+static void
+filter_bytes(struct command_list *c,unsigned char *p,off_t length)
+{
+    struct block_filter *f = c->filter;
+    off_t n,k;
+
+    if(length <= 0 || (c->s1 == NULL && c->s2 == NULL)) return;
+
+    if(c->s2 != NULL)
+    {
+        if(f->matches && !bytes_in_range(p,length,c->s2[0],c->s2[1])) f->matches = 0;
+        return;
+    }
+
+    if(f->matches) return;
+    n = c->s1_len - 1;
+    if(f->tail_len)             // string starting in the previous bytes
+    {
+        k = length < n ? length : n;
+        memcpy(f->join,f->tail,f->tail_len);
+        memcpy(f->join + f->tail_len,p,k);
+        if(contains_string(f->join,f->tail_len + k,c->s1,c->s1_len))
+        {
+            f->matches = 1;
+            return;
+        }
+    }
+    if(contains_string(p,length,c->s1,c->s1_len))
+    {
+        f->matches = 1;
+        return;
+    }
+    if(length >= n)
+    {
+        memcpy(f->tail,p + length - n,n);
+        f->tail_len = n;
+    } else
+    {
+        k = n - length < f->tail_len ? n - length : f->tail_len;
+        memmove(f->tail,f->tail + f->tail_len - k,k);
+        memcpy(f->tail + k,p,length);
+        f->tail_len = k + length;
+    }
+}
+
+/* k or K command for a block which is not all in the buffer, predicate is tested at the
+   end of the block. Output of the block is held until then */
+void
+defer_block_match(struct command_list *c)
+{
+    struct block_filter *f = c->filter;
+
+    if(!ctx->filters_pending)
+    {
+        ctx->filter_pos = read_pos();
+        ctx->filter_hold = ctx->hold_output;
+        ctx->hold_output = 1;
+    }
+    ctx->filters_pending++;
+    f->pending = 1;
+    f->matches = c->s1 == NULL;         // no string found, all bytes in range
+    f->tail_len = 0;
+}
+
+/* test the bytes of the block before read_pos, called before the buffer is refilled */
+void
+filter_input()
+{
+    struct command_list *c;
+
+    for(c = ctx->cmds.block_start;c != NULL;c = c->next)
+    {
+        if(c->filter != NULL && c->filter->pending)
+            filter_bytes(c,ctx->filter_pos,(off_t) (ctx->in_buffer.read_pos - ctx->filter_pos));
+    }
+}
+
+/* test the rest of the block for the deferred predicates at the last byte of the block,
+   returns true if the block is kept */
+int
+deferred_block_matches()
+{
+    struct command_list *c;
+    struct block_filter *f;
+    off_t length;
+    int keep,match;
+
+    keep = 1;
+    for(c = ctx->cmds.block_start;c != NULL;c = c->next)
+    {
+        f = c->filter;
+        if(f == NULL || !f->pending) continue;
+        f->pending = 0;
+        if(c->s1 != NULL || c->s2 != NULL)
+        {
+            filter_bytes(c,ctx->filter_pos,(off_t) (ctx->in_buffer.read_pos - ctx->filter_pos) + 1);
+            match = f->matches;
+        } else
+        {
+            length = ctx->in_buffer.block_offset + 1;
+            match = length >= c->offset && (c->count < 0 || length <= c->count);
+        }
+        if(match != (c->letter == 'k')) keep = 0;
+    }
+    ctx->filters_pending = 0;
+    ctx->hold_output = ctx->filter_hold;
+    return keep;
+}
+
+/* forget predicates left waiting by a failed run */
+void
+reset_filters()
+{
+    struct command_list *c;
+
+    if(!ctx->filters_pending) return;
+    for(c = ctx->cmds.block_start;c != NULL;c = c->next) if(c->filter != NULL) c->filter->pending = 0;
+    ctx->filters_pending = 0;
+    ctx->hold_output = ctx->filter_hold;
+}
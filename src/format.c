@@ -0,0 +1,403 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* printable formats of bytes and numbers: p-command tables, hex encoding and hexdump output */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* most significant bit of byte */
+#define BYTE_MASK (1 << (sizeof(unsigned char) * 8 - 1))
+
+/* longest string of one byte in one format (B) */
+#define BYTE_STRING_MAX 8
+
+/* format codes of p command, order is the order of byte_strings */
+static char *byte_formats = "DOHAB";
+
+/* all byte values as strings in all formats, filled by init_format_tables */
+static char byte_strings[5][256][BYTE_STRING_MAX + 1];
+static unsigned char byte_string_len[5][256];
+
+/* longest string in each format */
+static int byte_string_max[5];
+
+/* hexdump ascii column */
+static char hexdump_chars[256];
+
+static int format_tables_done = 0;
+
+static char hex_digits[] = "0123456789abcdef";
+
+/* hexdump, bytes of the incomplete line are saved between calls */
+#define HEXDUMP_LINE_MAX 128
+#define HEXDUMP_BUFFER_SIZE (HEXDUMP_LINE_MAX * 1024)
+
+/* fill the byte string tables, same results as sprintf would give */
+void
+init_format_tables()
+{
+    int byte,i;
+    char *s;
+
+    if(format_tables_done) return;
+
+    for(byte = 0;byte < 256;byte++)
+    {
+        s = byte_strings[0][byte];
+        s[0] = byte >= 100 ? '0' + byte / 100 : ' ';
+        s[1] = byte >= 10 ? '0' + (byte / 10) % 10 : ' ';
+        s[2] = '0' + byte % 10;
+        s[3] = 0;
+
+        s = byte_strings[1][byte];
+        s[0] = '0' + ((byte >> 6) & 0x07);
+        s[1] = '0' + ((byte >> 3) & 0x07);
+        s[2] = '0' + (byte & 0x07);
+        s[3] = 0;
+
+        s = byte_strings[2][byte];
+        s[0] = 'x';
+        s[1] = hex_digits[(byte >> 4) & 0x0f];
+        s[2] = hex_digits[byte & 0x0f];
+        s[3] = 0;
+
+        s = byte_strings[3][byte];
+        s[0] = isprint(byte) ? (char) byte : ' ';
+        s[1] = 0;
+
+        s = byte_strings[4][byte];
+        i = 0;
+        do
+        {
+            s[i] = ((BYTE_MASK >> i) & byte) ? '1' : '0';
+            i++;
+        } while (BYTE_MASK >> i);
+        s[i] = 0;
+
+        for(i = 0;i < 5;i++)
+        {
+            byte_string_len[i][byte] = (unsigned char) strlen(byte_strings[i][byte]);
+            if(byte_string_len[i][byte] > byte_string_max[i]) byte_string_max[i] = byte_string_len[i][byte];
+        }
+
+        hexdump_chars[byte] = isprint(byte) ? (char) byte : '.';
+    }
+    format_tables_done = 1;
+}
+
+/* byte_to_string, convert byte value to visible string,
+   either hex (H), decimal (D), octal (O), ascii (A) or binary (B)
+   */
+char *
+byte_to_string(unsigned char byte,char format)
+{
+    char *f;
+
+    f = strchr(byte_formats,format);
+    if(f == NULL || format == 0) return "";
+    return byte_strings[f - byte_formats][byte];
+}
+
+/* convert off_t to string  */
+char *
+off_t_to_string(off_t number,char format)
+{
+    char *string = ctx->number_string;
+
+    switch(format)
+    {
+        case 'H':
+             sprintf(string,"x%llx",(long long) number);
+             break;
+        case 'D':
+             sprintf(string,"%lld",(long long) number);
+             break;
+        case 'O':
+             sprintf(string,"0%llo",(long long) number);
+             break;
+        default:
+             string[0] = 0;
+             break;
+    }
+    return string;
+}
+
+/* make the output table of p command, all formats of one byte value in one entry,
+   separated by hyphen. First byte of each entry is the length of the string.
+   stride is the size of one entry */
+unsigned char *
+make_p_table(unsigned char *formats,off_t format_count,off_t *stride)
+{
+    unsigned char *table,*e;
+    char *f;
+    off_t i,len;
+    int byte;
+
+    init_format_tables();
+
+    len = 0;
+    for(i = 0;i < format_count;i++)
+    {
+        f = strchr(byte_formats,formats[i]);
+        if(f != NULL && formats[i]) len += byte_string_max[f - byte_formats];
+        if(i < format_count - 1) len++;
+    }
+    if(len > 255) panic("Too many formats in p-command",NULL,NULL);
+
+    *stride = len + 1;
+    table = xmalloc(256 * *stride);
+
+    for(byte = 0;byte < 256;byte++)
+    {
+        e = table + byte * *stride;
+        len = 0;
+        for(i = 0;i < format_count;i++)
+        {
+            f = strchr(byte_formats,formats[i]);
+            if(f != NULL && formats[i])
+            {
+                memcpy(e + 1 + len,byte_strings[f - byte_formats][byte],byte_string_len[f - byte_formats][byte]);
+                len += byte_string_len[f - byte_formats][byte];
+            }
+            if(i < format_count - 1) e[1 + len++] = '-';
+        }
+        e[0] = (unsigned char) len;
+    }
+    return table;
+}
+
+/* format span of bytes as p command c does, every byte is followed by space.
+   returns the number of bytes written to out, which must have room for length * c->s2_len bytes */
+off_t
+p_format_span(struct command_list *c,unsigned char *in,off_t length,unsigned char *out)
+{
+    unsigned char *o = out,*e;
+    unsigned char *end = in + length;
+
+    if(c->s1_len == 1 && c->s1[0] == 'H')
+    {
+        return hex_p_span(in,length,out);
+    }
+
+    while(in < end)
+    {
+        e = c->s2 + *in * c->s2_len;
+        memcpy(o,e + 1,e[0]);
+        o += e[0];
+        *o++ = ' ';
+        in++;
+    }
+    return o - out;
+}
+
+#ifdef __SSE2__
+/* hex digits of 16 nibbles (values 0-15) */
+static inline __m128i
+hex_digits_sse2(__m128i nibbles)
+{
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(nibbles,nine),_mm_set1_epi8('a' - '0' - 10));
+
+    return _mm_add_epi8(_mm_add_epi8(nibbles,_mm_set1_epi8('0')),letter);
+}
+#endif
+
+/* same as p H, but for a span of bytes, output has four bytes for every input byte ("x41 ") */
+off_t
+hex_p_span(unsigned char *in,off_t length,unsigned char *out)
+{
+    off_t i = 0;
+#ifdef __SSE2__
+    __m128i lo_mask = _mm_set1_epi8(0x0f);
+    __m128i frame = _mm_set1_epi32(0x20000078);     // 'x' and ' ' around the digits
+    __m128i zero = _mm_setzero_si128();
+    __m128i v,hi,lo,pairs;
+
+    for(;i + 16 <= length;i += 16)
+    {
+        v = _mm_loadu_si128((__m128i *) (in + i));
+        hi = hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(v,4),lo_mask));
+        lo = hex_digits_sse2(_mm_and_si128(v,lo_mask));
+
+        pairs = _mm_unpacklo_epi8(hi,lo);
+        _mm_storeu_si128((__m128i *) (out + 4 * i),_mm_or_si128(frame,_mm_slli_epi32(_mm_unpacklo_epi16(pairs,zero),8)));
+        _mm_storeu_si128((__m128i *) (out + 4 * i + 16),_mm_or_si128(frame,_mm_slli_epi32(_mm_unpackhi_epi16(pairs,zero),8)));
+        pairs = _mm_unpackhi_epi8(hi,lo);
+        _mm_storeu_si128((__m128i *) (out + 4 * i + 32),_mm_or_si128(frame,_mm_slli_epi32(_mm_unpacklo_epi16(pairs,zero),8)));
+        _mm_storeu_si128((__m128i *) (out + 4 * i + 48),_mm_or_si128(frame,_mm_slli_epi32(_mm_unpackhi_epi16(pairs,zero),8)));
+    }
+#endif
+    for(;i < length;i++)
+    {
+        out[4 * i] = 'x';
+        out[4 * i + 1] = hex_digits[(in[i] >> 4) & 0x0f];
+        out[4 * i + 2] = hex_digits[in[i] & 0x0f];
+        out[4 * i + 3] = ' ';
+    }
+    return 4 * length;
+}
+
+/* plain hex encoding of span, two lower case digits for every byte */
+void
+hex_encode(unsigned char *in,off_t length,unsigned char *out)
+{
+    off_t i = 0;
+#ifdef __SSE2__
+    __m128i lo_mask = _mm_set1_epi8(0x0f);
+    __m128i v,hi,lo;
+
+    for(;i + 16 <= length;i += 16)
+    {
+        v = _mm_loadu_si128((__m128i *) (in + i));
+        hi = hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(v,4),lo_mask));
+        lo = hex_digits_sse2(_mm_and_si128(v,lo_mask));
+        _mm_storeu_si128((__m128i *) (out + 2 * i),_mm_unpacklo_epi8(hi,lo));
+        _mm_storeu_si128((__m128i *) (out + 2 * i + 16),_mm_unpackhi_epi8(hi,lo));
+    }
+#endif
+    for(;i < length;i++)
+    {
+        out[2 * i] = hex_digits[(in[i] >> 4) & 0x0f];
+        out[2 * i + 1] = hex_digits[in[i] & 0x0f];
+    }
+}
+
+/* format one hexdump line of count bytes, returns the length of the line.
+   offset is printed as off_t_to_string(offset,'H') would print it */
+static int
+hexdump_format_line(unsigned char *line,int count,off_t offset,unsigned char *out)
+{
+    unsigned char *o = out;
+    unsigned char hex[2 * HEXDUMP_WIDTH];
+    char off[2 * sizeof(off_t) + 1];
+    int i,len;
+
+    len = 0;
+    do
+    {
+        off[sizeof(off) - 1 - len++] = hex_digits[offset & 0x0f];
+        offset = (off_t) ((unsigned long long) offset >> 4);
+    } while(offset);
+    for(i = len + 1;i < 9;i++) *o++ = ' ';
+    *o++ = 'x';
+    memcpy(o,off + sizeof(off) - len,len);
+    o += len;
+    *o++ = ' ';
+
+    hex_encode(line,(off_t) count,hex);
+    for(i = 0;i < HEXDUMP_WIDTH;i++)
+    {
+        if(i == HEXDUMP_WIDTH / 2) *o++ = ' ';
+        *o++ = ' ';
+        if(i < count)
+        {
+            *o++ = hex[2 * i];
+            *o++ = hex[2 * i + 1];
+        } else
+        {
+            *o++ = ' ';
+            *o++ = ' ';
+        }
+    }
+    *o++ = ' ';
+    *o++ = ' ';
+    *o++ = '|';
+    for(i = 0;i < count;i++) *o++ = hexdump_chars[line[i]];
+    *o++ = '|';
+    *o++ = '\n';
+    return (int) (o - out);
+}
+
+/* write output in hexdump format, incomplete last line is saved for next call */
+void
+write_hexdump(unsigned char *buffer,off_t length)
+{
+    unsigned char *out,*o;
+    int n;
+
+    if(ctx->hexdump_out == NULL)
+    {
+        init_format_tables();
+        ctx->hexdump_out = xmalloc(HEXDUMP_BUFFER_SIZE);
+    }
+
+    out = ctx->hexdump_out;
+    o = out;
+
+    if(ctx->hexdump_line_len)
+    {
+        n = HEXDUMP_WIDTH - ctx->hexdump_line_len;
+        if(n > length) n = (int) length;
+        memcpy(ctx->hexdump_line + ctx->hexdump_line_len,buffer,n);
+        ctx->hexdump_line_len += n;
+        buffer += n;
+        length -= n;
+        if(ctx->hexdump_line_len < HEXDUMP_WIDTH) return;
+        o += hexdump_format_line(ctx->hexdump_line,HEXDUMP_WIDTH,ctx->hexdump_offset,o);
+        ctx->hexdump_offset += HEXDUMP_WIDTH;
+        ctx->hexdump_line_len = 0;
+    }
+
+    while(length >= HEXDUMP_WIDTH)
+    {
+        if(o - out > HEXDUMP_BUFFER_SIZE - HEXDUMP_LINE_MAX)
+        {
+            write_output_fd(out,o - out);
+            o = out;
+        }
+        o += hexdump_format_line(buffer,HEXDUMP_WIDTH,ctx->hexdump_offset,o);
+        ctx->hexdump_offset += HEXDUMP_WIDTH;
+        buffer += HEXDUMP_WIDTH;
+        length -= HEXDUMP_WIDTH;
+    }
+
+    if(length)
+    {
+        memcpy(ctx->hexdump_line,buffer,length);
+        ctx->hexdump_line_len = (int) length;
+    }
+
+    if(o > out) write_output_fd(out,o - out);
+}
+
+/* write the incomplete last line of hexdump */
+void
+flush_hexdump()
+{
+    unsigned char line[HEXDUMP_LINE_MAX];
+    int len;
+
+    if(!ctx->hexdump_line_len) return;
+    len = hexdump_format_line(ctx->hexdump_line,ctx->hexdump_line_len,ctx->hexdump_offset,line);
+    ctx->hexdump_offset += ctx->hexdump_line_len;
+    ctx->hexdump_line_len = 0;
+    write_output_fd(line,len);
+}
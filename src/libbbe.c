@@ -0,0 +1,555 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* library interface, see libbbe.h. Every function sets ctx to the context
+   given and sets the place where panic jumps, so errors deep in the editor
+   return -1 from the library function instead of exiting.
+
+   bbe_push runs the editor in a coroutine with its own stack: the editor
+   reads input with push_read, which returns to the caller of bbe_push when
+   there is no more data pushed. Without ucontext.h the pushed data is
+   collected and the run is done by bbe_finish */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_UCONTEXT_H
+#include <ucontext.h>
+#endif
+
+/* context of the calling thread */
+BBE_THREAD struct bbe_ctx *ctx = NULL;
+
+/* name used in messages */
+#ifdef PACKAGE
+char *program = PACKAGE;
+#else
+char *program = "bbe";
+#endif
+
+/* stack of the push coroutine */
+#define PUSH_STACK_SIZE (1024 * 1024)
+
+struct push_state {
+    unsigned char *data;        // pushed data not yet read by the editor
+    size_t length;
+    int finish;                 // no more data
+    int done;                   // run has ended
+    int failed;                 // run has ended with error
+#ifdef HAVE_UCONTEXT_H
+    int started;
+    ucontext_t caller;
+    ucontext_t engine;
+    void *stack;
+    jmp_buf jump;               // errors of the run
+#else
+    size_t size;                // all pushed data is in data
+#endif
+};
+
+/* input of bbe_run_buffer */
+struct memory_input {
+    unsigned char *data;
+    size_t length;
+};
+
+/* write error message to ctx->error and jump back to library function, or
+   write it to stderr and exit if not called through library */
+void
+panic(char *msg,char *info,char *syserror)
+{
+    char *prefix = "";
+
+    if(ctx != NULL && ctx->panic_info != NULL) prefix = ctx->panic_info;
+
+    if(ctx != NULL && ctx->error_jump != NULL)
+    {
+        snprintf(ctx->error,sizeof(ctx->error),"%s%s%s%s%s%s%s",
+                prefix,*prefix ? ": " : "",
+                msg,
+                info != NULL ? ": " : "",info != NULL ? info : "",
+                syserror != NULL ? "; " : "",syserror != NULL ? syserror : "");
+        longjmp(*ctx->error_jump,1);
+    }
+
+    if(*prefix) fprintf(stderr,"%s: %s\n",program,prefix);
+
+    if (info == NULL && syserror == NULL)
+    {
+        fprintf(stderr,"%s: %s\n",program,msg);
+    } else if(info != NULL && syserror == NULL)
+    {
+        fprintf(stderr,"%s: %s: %s\n",program,msg,info);
+    } else if(info != NULL && syserror != NULL)
+    {
+        fprintf(stderr,"%s: %s: %s; %s\n",program,msg,info,syserror);
+    } else if(info == NULL && syserror != NULL)
+    {
+        fprintf(stderr,"%s: %s; %s\n",program,msg,syserror);
+    }
+    exit(EXIT_FAILURE);
+}
+
+/* tables shared by all contexts */
+static void
+init_tables()
+{
+    init_format_tables();
+    init_codec_tables();
+    init_digest_tables();
+}
+
+/* begin library function: context c is made current and errors jump here,
+   on error cleanup is done and -1 returned */
+#define ENTER(c,cleanup) \
+    struct bbe_ctx *saved_ctx = ctx; \
+    jmp_buf jump; \
+    ctx = (c); \
+    ctx->error_jump = &jump; \
+    if(setjmp(jump)) \
+    { \
+        cleanup; \
+        ctx->error_jump = NULL; \
+        ctx = saved_ctx; \
+        return -1; \
+    }
+
+#define LEAVE() \
+    ctx->error_jump = NULL; \
+    ctx = saved_ctx
+
+struct bbe_ctx *
+bbe_new()
+{
+    struct bbe_ctx *c;
+#ifdef _POSIX_THREADS
+    static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&tables_once,init_tables);
+#else
+    init_tables();
+#endif
+
+    c = malloc(sizeof(struct bbe_ctx));
+    if(c == NULL) return NULL;
+    memset(c,0,sizeof(struct bbe_ctx));
+    c->out_stream.fd = -1;
+    return c;
+}
+
+void
+bbe_free(struct bbe_ctx *c)
+{
+    struct bbe_ctx *saved_ctx = ctx;
+
+    ctx = c;
+#ifdef HAVE_UCONTEXT_H
+    if(c->push != NULL && c->push->started && !c->push->done) discard_commands(&c->cmds);
+    if(c->push != NULL) free(c->push->stack);
+#else
+    if(c->push != NULL) free(c->push->data);
+#endif
+    free(c->push);
+    clear_input_files();
+    clear_output_stream();
+    free_commands(&c->cmds);
+    free_cache();
+    free(c->in_files);
+    free_input_buffer();
+    free(c->out_buffer.buffer);
+    free(c->memory.data);
+    free(c->hexdump_out);
+    free(c->panic_info);
+    free(c->script);
+    free(c->parse_temp[0]);
+    free(c->parse_temp[1]);
+    if(c->block.type & BLOCK_START_S) free(c->block.start.S.string);
+    if(c->block.type & BLOCK_STOP_S) free(c->block.stop.S.string);
+    free(c);
+    ctx = saved_ctx;
+}
+
+char *
+bbe_error(struct bbe_ctx *c)
+{
+    return c->error;
+}
+
+int
+bbe_compile(struct bbe_ctx *c,char *block,char *commands)
+{
+    char * volatile script = NULL;
+
+    ENTER(c,free(script);parse_failed());
+    if(ctx->commands_ready) panic("Commands cannot be added after the first run",NULL,NULL);
+    if(block != NULL)
+    {
+        if(ctx->block.type) panic("Only one block definition allowed",NULL,NULL);
+        parse_block(block);
+    }
+    if(commands != NULL)
+    {
+        script = xstrdup(commands);
+        parse_commands(script);
+        free(script);
+    }
+    LEAVE();
+    return 0;
+}
+
+int
+bbe_command_file(struct bbe_ctx *c,char *file)
+{
+    ENTER(c,parse_failed());
+    if(ctx->commands_ready) panic("Commands cannot be added after the first run",NULL,NULL);
+    parse_command_file(file);
+    LEAVE();
+    return 0;
+}
+
+int
+bbe_options(struct bbe_ctx *c,int options)
+{
+    c->output_only_block = (options & BBE_SUPPRESS) != 0;
+    c->output_hexdump = (options & BBE_HEXDUMP) != 0;
+    return 0;
+}
+
+int
+bbe_input_file(struct bbe_ctx *c,char *file)
+{
+    ENTER(c,);
+    set_input_file(file);
+    LEAVE();
+    return 0;
+}
+
+int
+bbe_input(struct bbe_ctx *c,char *name,bbe_io_fn read_fn,void *arg)
+{
+    ENTER(c,);
+    set_input_io(name == NULL ? "(input)" : name,read_fn,arg);
+    LEAVE();
+    return 0;
+}
+
+/* standard output is not closed by the library */
+static ssize_t
+stdout_write(void *arg,unsigned char *buf,size_t length)
+{
+    (void) arg;
+    return write(STDOUT_FILENO,buf,length);
+}
+
+int
+bbe_output_file(struct bbe_ctx *c,char *file)
+{
+    ENTER(c,);
+    if(file[0] == '-' && file[1] == 0)
+    {
+        set_output_io("(stdout)",stdout_write,NULL);
+    } else
+    {
+        set_output_file(file);
+    }
+    LEAVE();
+    return 0;
+}
+
+int
+bbe_output(struct bbe_ctx *c,char *name,bbe_io_fn write_fn,void *arg)
+{
+    ENTER(c,);
+    set_output_io(name == NULL ? "(output)" : name,write_fn,arg);
+    LEAVE();
+    return 0;
+}
+
+/* output to memory */
+static ssize_t
+memory_write(void *arg,unsigned char *buf,size_t length)
+{
+    struct memory_output *m = arg;
+
+    if(m->length + length > m->size)
+    {
+        m->size = m->size ? 2 * m->size : 64 * 1024;
+        while(m->length + length > m->size) m->size *= 2;
+        m->data = xrealloc(m->data,m->size);
+    }
+    memcpy(m->data + m->length,buf,length);
+    m->length += length;
+    return (ssize_t) length;
+}
+
+static ssize_t
+memory_read(void *arg,unsigned char *buf,size_t length)
+{
+    struct memory_input *m = arg;
+
+    if(length > m->length) length = m->length;
+    memcpy(buf,m->data,length);
+    m->data += length;
+    m->length -= length;
+    return (ssize_t) length;
+}
+
+/* one run of the editor for the current context */
+static void
+run()
+{
+    if(ctx->parse_error) panic("Commands have errors",NULL,NULL);
+    if(!ctx->in_file_count) panic("No input given",NULL,NULL);
+    if(ctx->out_stream.file == NULL) set_output_io("(memory)",memory_write,&ctx->memory);
+    if(!ctx->commands_ready)
+    {
+        if(!ctx->block.type) parse_block("0:$");
+        init_commands(&ctx->cmds);
+    }
+    init_buffer();
+    open_commands(&ctx->cmds);
+    execute_program(&ctx->cmds);
+    close_commands(&ctx->cmds);
+    clear_input_files();
+}
+
+/* forget the files of failed run */
+static void
+abort_run()
+{
+    discard_commands(&ctx->cmds);
+    clear_input_files();
+    clear_output_stream();
+}
+
+int
+bbe_run(struct bbe_ctx *c)
+{
+    ENTER(c,abort_run());
+    run();
+    LEAVE();
+    return 0;
+}
+
+int
+bbe_run_buffer(struct bbe_ctx *c,unsigned char *in,size_t length,unsigned char **out,size_t *out_length)
+{
+    struct memory_input input;
+
+    input.data = in;
+    input.length = length;
+
+    ENTER(c,abort_run());
+    set_input_io("(buffer)",memory_read,&input);
+    run();
+    *out = ctx->memory.data + ctx->memory.pulled;
+    *out_length = ctx->memory.length - ctx->memory.pulled;
+    if(ctx->memory.pulled)
+    {
+        memmove(ctx->memory.data,*out,*out_length);
+        *out = ctx->memory.data;
+    }
+    if(!*out_length)
+    {
+        *out = NULL;
+    } else
+    {
+        ctx->memory.data = NULL;
+        ctx->memory.size = 0;
+    }
+    ctx->memory.length = 0;
+    ctx->memory.pulled = 0;
+    LEAVE();
+    return 0;
+}
+
+size_t
+bbe_pull(struct bbe_ctx *c,unsigned char *buf,size_t length)
+{
+    struct memory_output *m = &c->memory;
+
+    if(length > m->length - m->pulled) length = m->length - m->pulled;
+    memcpy(buf,m->data + m->pulled,length);
+    m->pulled += length;
+    if(m->pulled == m->length)
+    {
+        m->pulled = 0;
+        m->length = 0;
+    }
+    return length;
+}
+
+static struct push_state *
+push_state()
+{
+    if(ctx->push == NULL)
+    {
+        ctx->push = xmalloc(sizeof(struct push_state));
+        memset(ctx->push,0,sizeof(struct push_state));
+    }
+    if(ctx->push->done) panic("Input of the run is already finished",NULL,NULL);
+    return ctx->push;
+}
+
+static void
+free_push_state()
+{
+#ifdef HAVE_UCONTEXT_H
+    free(ctx->push->stack);
+#else
+    free(ctx->push->data);
+#endif
+    free(ctx->push);
+    ctx->push = NULL;
+}
+
+#ifdef HAVE_UCONTEXT_H
+/* read function of the pushed input, runs in the coroutine */
+static ssize_t
+push_read(void *arg,unsigned char *buf,size_t length)
+{
+    struct push_state *p = arg;
+
+    while(!p->length && !p->finish)
+    {
+        swapcontext(&p->engine,&p->caller);
+        ctx->error_jump = &p->jump;         // caller has set its own jump
+    }
+    if(length > p->length) length = p->length;
+    memcpy(buf,p->data,length);
+    p->data += length;
+    p->length -= length;
+    return (ssize_t) length;
+}
+
+/* the coroutine, returns to the latest caller when the run ends */
+static void
+push_main()
+{
+    if(setjmp(ctx->push->jump))
+    {
+        abort_run();
+        ctx->push->failed = 1;
+    } else
+    {
+        ctx->error_jump = &ctx->push->jump;
+        set_input_io("(push)",push_read,ctx->push);
+        run();
+    }
+    ctx->push->done = 1;
+}
+
+/* give the pushed data to the editor, returns when it is read */
+static void
+push_resume(struct push_state *p)
+{
+    if(!p->started)
+    {
+        if(getcontext(&p->engine) == -1) panic("Cannot get context",NULL,strerror(errno));
+        p->stack = xmalloc(PUSH_STACK_SIZE);
+        p->engine.uc_stack.ss_sp = p->stack;
+        p->engine.uc_stack.ss_size = PUSH_STACK_SIZE;
+        p->engine.uc_link = &p->caller;
+        makecontext(&p->engine,push_main,0);
+        p->started = 1;
+    }
+    swapcontext(&p->caller,&p->engine);
+}
+
+int
+bbe_push(struct bbe_ctx *c,unsigned char *buf,size_t length)
+{
+    struct push_state *p;
+    int failed;
+
+    ENTER(c,);
+    p = push_state();
+    p->data = buf;
+    p->length = length;
+    push_resume(p);
+    p->length = 0;
+    failed = p->failed;
+    LEAVE();
+    return failed ? -1 : 0;
+}
+
+int
+bbe_finish(struct bbe_ctx *c)
+{
+    struct push_state *p;
+    int failed;
+
+    ENTER(c,if(ctx->push != NULL) free_push_state());
+    p = ctx->push;
+    if(p == NULL || !p->done)           // not ended by error of bbe_push
+    {
+        p = push_state();
+        p->finish = 1;
+        p->length = 0;
+        push_resume(p);
+    }
+    failed = p->failed;
+    free_push_state();
+    LEAVE();
+    return failed ? -1 : 0;
+}
+#else
+int
+bbe_push(struct bbe_ctx *c,unsigned char *buf,size_t length)
+{
+    struct push_state *p;
+
+    ENTER(c,);
+    p = push_state();
+    if(p->length + length > p->size)
+    {
+        p->size = p->size ? 2 * p->size : 64 * 1024;
+        while(p->length + length > p->size) p->size *= 2;
+        p->data = xrealloc(p->data,p->size);
+    }
+    memcpy(p->data + p->length,buf,length);
+    p->length += length;
+    LEAVE();
+    return 0;
+}
+
+int
+bbe_finish(struct bbe_ctx *c)
+{
+    struct memory_input input;
+
+    ENTER(c,abort_run();free_push_state());
+    push_state();
+    input.data = ctx->push->data;
+    input.length = ctx->push->length;
+    set_input_io("(push)",memory_read,&input);
+    run();
+    free_push_state();
+    LEAVE();
+    return 0;
+}
+#endif
@@ -0,0 +1,114 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* libbbe, binary block editor as a library.
+
+   All state of the editor is in a context made by bbe_new. Block definition
+   and commands are compiled into the context once and can then be run any
+   number of times, input and output are given for every run. Functions
+   returning int return 0 on success and -1 on error, bbe_error gives the
+   message of the error.
+
+   One context must be used by one thread at a time, different contexts can
+   be used in different threads at the same time. */
+
+#ifndef LIBBBE_H
+#define LIBBBE_H
+
+#include <sys/types.h>
+
+struct bbe_ctx;
+
+/* read or write function, works like read(2) and write(2). Read function
+   returns 0 at end of input, both return -1 on error (errno is used in the message) */
+typedef ssize_t (*bbe_io_fn)(void *arg,unsigned char *buf,size_t length);
+
+/* options of bbe_options */
+#define BBE_SUPPRESS 1          // write only the blocks, like -s
+#define BBE_HEXDUMP  2          // write output as hexdump, like -x
+
+/* new context, NULL if there is no memory */
+extern struct bbe_ctx *
+bbe_new(void);
+
+extern void
+bbe_free(struct bbe_ctx *c);
+
+/* message of the last error */
+extern char *
+bbe_error(struct bbe_ctx *c);
+
+/* add block definition and commands, either can be NULL. Block is given
+   like with -b and commands like with -e, separated by ; or newlines.
+   Default block is the whole input. Must be called before the first run */
+extern int
+bbe_compile(struct bbe_ctx *c,char *block,char *commands);
+
+/* add commands from file, like -f */
+extern int
+bbe_command_file(struct bbe_ctx *c,char *file);
+
+extern int
+bbe_options(struct bbe_ctx *c,int options);
+
+/* add input file for the next run, "-" is the standard input */
+extern int
+bbe_input_file(struct bbe_ctx *c,char *file);
+
+/* add input read by function read_fn for the next run, name is used by N command */
+extern int
+bbe_input(struct bbe_ctx *c,char *name,bbe_io_fn read_fn,void *arg);
+
+/* write output of the next run to file, "-" is the standard output */
+extern int
+bbe_output_file(struct bbe_ctx *c,char *file);
+
+/* write output of the next run with function write_fn */
+extern int
+bbe_output(struct bbe_ctx *c,char *name,bbe_io_fn write_fn,void *arg);
+
+/* run commands for the input files and functions. If no output is given,
+   output is collected to memory and can be taken with bbe_pull */
+extern int
+bbe_run(struct bbe_ctx *c);
+
+/* run commands for length bytes from in, output is returned in malloced
+   *out (to be freed by caller) if no output is given for the run */
+extern int
+bbe_run_buffer(struct bbe_ctx *c,unsigned char *in,size_t length,unsigned char **out,size_t *out_length);
+
+/* push input of a run piece by piece, bbe_finish ends the input and the run.
+   Output made so far can be taken with bbe_pull after every call */
+extern int
+bbe_push(struct bbe_ctx *c,unsigned char *buf,size_t length);
+
+extern int
+bbe_finish(struct bbe_ctx *c);
+
+/* copy at most length bytes of output collected to memory to buf,
+   returns the number of bytes copied */
+extern size_t
+bbe_pull(struct bbe_ctx *c,unsigned char *buf,size_t length);
+
+#endif
@@ -0,0 +1,899 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ * 
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* parsing of block definition and commands */
+
+#include "bbe.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* c command conversions */
+char *convert_strings[] = {
+    "BCDASC",
+    "ASCBCD",
+    "BINHEX",
+    "HEXBIN",
+    "BINB64",
+    "B64BIN",
+    "BCDEBC",
+    "EBCBCD",
+    "ZONASC",
+    "ASCZON",
+    "ASCEBC",
+    "EBCASC",
+          "",
+};
+
+/* digests of H and V commands */
+char *digest_strings[] = {
+    "CRC32C",
+    "XXH64",
+    "SHA256",
+          "",
+};
+/* commands to be executed at start of buffer */
+#define BLOCK_START_COMMANDS "DIJLFBN>UnkK"
+
+/* commands to be executed for each byte  */
+#define BYTE_COMMANDS "acdirsywWjpl&|^~ufx{P"
+
+/* commands to be executed at end of buffer  */
+#define BLOCK_END_COMMANDS "A<HV"
+
+/* format types for p command */
+char *p_formats="DOHAB";
+
+/* commands which cannot be used in sub-blocks */
+#define NOT_IN_SUB_BLOCK "wW<>HVUnkK"
+
+/* formats for F and B commands */
+char *FB_formats="DOH";
+
+/* temporary buffer n for parsing, buffers are kept in context so they can be freed after errors */
+static char *
+parse_buffer(int n,size_t size)
+{
+    if(ctx->parse_temp[n] != NULL) free(ctx->parse_temp[n]);
+    ctx->parse_temp[n] = xmalloc(size);
+    return ctx->parse_temp[n];
+}
+
+static void
+free_parse_buffer(int n)
+{
+    free(ctx->parse_temp[n]);
+    ctx->parse_temp[n] = NULL;
+}
+
+/* free what was left by a parse error */
+void
+parse_failed()
+{
+    free_parse_buffer(0);
+    free_parse_buffer(1);
+    if(ctx->script != NULL) free(ctx->script);
+    ctx->script = NULL;
+    if(ctx->panic_info != NULL) free(ctx->panic_info);
+    ctx->panic_info = NULL;
+    ctx->parse_error = 1;
+}
+
+/* parse a long int, can start with n (dec), x (hex), 0 (oct) */
+off_t
+parse_long(char *long_int)
+{
+    long long int l;
+    char *scan = long_int;
+    char type='d';           // others are x and o
+
+
+    if(*scan == '0')
+    {
+        type = 'o';
+        scan++;
+        if(*scan == 'x' || *scan == 'X') {
+            type = 'x';
+            scan++;
+        }
+    }
+
+    while(*scan != 0)
+    {
+        switch(type)
+        {
+            case 'd':
+                if(!isdigit(*scan)) panic("Error in number",long_int,NULL);
+                break;
+            case 'o':
+                if(!isdigit(*scan) || *scan >= '8') panic("Error in number",long_int,NULL);
+                break;
+            case 'x':
+                if(!isxdigit(*scan)) panic("Error in number",long_int,NULL);
+                break;
+        }
+        scan++;
+    }
+
+    if (sscanf(long_int,"%lli",&l) != 1)
+    {
+        panic("Error in number",long_int,NULL);
+    }
+    return (off_t) l;
+}
+
+/* parse memory size, number followed by K, M or G */
+static size_t
+parse_size(char *size)
+{
+    char number[64];
+    size_t len,unit;
+
+    len = strlen(size);
+    if(len < 2 || len >= sizeof(number)) panic("Error in number",size,NULL);
+    switch(toupper(size[len - 1]))
+    {
+        case 'K':
+            unit = 1024;
+            break;
+        case 'M':
+            unit = 1024 * 1024;
+            break;
+        case 'G':
+            unit = 1024 * 1024 * 1024;
+            break;
+        default:
+            panic("Error in number",size,NULL);
+            return 0;
+    }
+    strcpy(number,size);
+    number[len - 1] = 0;
+    return (size_t) parse_long(number) * unit;
+}
+
+/* parse a string, string can contain \n, \xn, \0n and \\
+   escape codes. memory will be allocated */
+unsigned char *
+parse_string(char *string,off_t *length)
+{
+    char *p;
+    int j,k,i = 0;
+    int min_len;
+    unsigned char buf[INPUT_BUFFER_LOW+1];
+    char num[5];
+    unsigned char *ret;
+
+    p = string;
+
+    while(*p != 0)
+    {
+        if(*p == '\\')
+        {
+            p++;
+            if(strchr("\\;abtnvfr",*p) != NULL)
+            {
+                switch(*p)
+                {
+                    case 'a':
+                        buf[i] = '\a';
+                        break;
+                    case 'b':
+                        buf[i] = '\b';
+                        break;
+                    case 't':
+                        buf[i] = '\t';
+                        break;
+                    case 'n':
+                        buf[i] = '\n';
+                        break;
+                    case 'v':
+                        buf[i] = '\v';
+                        break;
+                    case 'f':
+                        buf[i] = '\f';
+                        break;
+                    case 'r':
+                        buf[i] = '\r';
+                        break;
+                    default:
+                        buf[i] = *p;
+                }
+                p++;
+            } else
+            {
+                j = 0;
+                switch(*p)
+                {
+                    case 'x':
+                    case 'X':
+                        num[j++] = '0';
+                        num[j++] = *p++;
+                        while(isxdigit(*p) && j < 4) num[j++] = *p++;
+                        min_len=3;
+                        break;
+                    case '0':
+                        while(isdigit(*p) && *p < '8' && j < 4) num[j++] = *p++;
+                        min_len=1;
+                        break;
+                    default:
+                        while(isdigit(*p) && j < 3) num[j++] = *p++;
+                        min_len=1;
+                        break;
+                }
+                num[j] = 0;
+                if (sscanf(num,"%i",&k) != 1 || j < min_len)
+                {
+                    panic("Syntax error in escape code",string,NULL);
+                }
+                if (k < 0 || k > 255)
+                {
+                    panic("Escape code not in range (0-255)",string,NULL);
+                }
+                buf[i] = (unsigned char) k;
+            }
+        } else
+        {
+            buf[i] = (unsigned char) *p++;
+        }
+        if(i > INPUT_BUFFER_LOW)
+        {
+            panic("string too long",string,NULL);
+        }
+        i++;
+    }
+    if(i)       
+    {
+        ret = (unsigned char *) xmalloc(i);
+        memcpy(ret,buf,i);
+    } else
+    {
+        ret = NULL;
+    }
+    *length = i;
+    return ret;
+}
+
+
+/* parse a block definition and save it to b */
+static void
+parse_block_def(struct block *b,char *bs)
+{
+    char slash_char;
+    char *p = bs;
+    int i = 0;
+    char *buf;
+
+    if(strlen(bs) > (2*4*INPUT_BUFFER_LOW))
+    {
+        panic("Block definition too long",NULL,NULL);
+    }
+
+    buf = parse_buffer(0,2*4*INPUT_BUFFER_LOW);
+
+    if (*p == ':')
+    {
+        b->start.S.length = 0;
+        b->type |= BLOCK_START_S;
+    } else
+    {
+        if(*p == 'x' || *p == 'X' || isdigit(*p))
+        {
+            switch(*p)
+            {
+                case 'x':
+                case 'X':
+                    buf[i++] = '0';
+                    buf[i++] = *p++;
+                    while(isxdigit(*p)) buf[i++] = *p++;
+                    break;
+                case '0':
+                    while(isdigit(*p) && *p < '8') buf[i++] = *p++;
+                    break;
+                default:
+                    while(isdigit(*p)) buf[i++] = *p++;
+                    break;
+            }
+
+            buf[i] = 0;
+            b->start.N = parse_long(buf);
+            b->type |= BLOCK_START_M;
+        } else                                // string start
+        {
+            slash_char = *p;
+            p++;
+            while(*p != slash_char && *p != 0) buf[i++] = *p++;
+            if (*p == slash_char) p++;
+            buf[i] = 0;
+            b->start.S.string = parse_string(buf,&b->start.S.length);
+            b->type |= BLOCK_START_S;
+        }
+    } 
+
+    if (*p != ':')
+    {
+        panic("Error in block definition",bs,NULL);
+    }
+
+    p++;
+
+    if (*p == 0)
+    {
+        b->stop.S.length = 0;
+        b->type |= BLOCK_STOP_S;
+    } else
+    { 
+        i = 0;
+        if (*p == 'x' || *p == 'X' || isxdigit(*p))
+        {
+            switch(*p)
+            {
+                case 'x':
+                case 'X':
+                    buf[i++] = '0';
+                    buf[i++] = *p++;
+                    while(isxdigit(*p)) buf[i++] = *p++;
+                    break;
+                case '0':
+                    while(isdigit(*p) && *p < '8') buf[i++] = *p++;
+                    break;
+                default:
+                    while(isdigit(*p)) buf[i++] = *p++;
+                    break;
+            } 
+            buf[i] = 0;
+            b->stop.M = parse_long(buf);
+            if(b->stop.M == 0) panic("Block length must be greater than zero",NULL,NULL);
+            b->type |= BLOCK_STOP_M;
+        } else
+        {
+            if(*p == '$')
+            {
+                b->stop.S.length = 0;
+                p++;
+            } else
+            {
+                slash_char = *p;
+                p++;
+                while(*p != slash_char && *p != 0) buf[i++] = *p++;
+                if (*p == slash_char)
+                {
+                    p++;
+                } else
+                {
+                    panic("syntax error in block definition",bs,NULL);
+                }
+                buf[i] = 0;
+                b->stop.S.string = parse_string(buf,&b->stop.S.length);
+                b->type |= BLOCK_STOP_S;
+            }
+        }
+    } 
+    if (*p != 0)
+    {
+        panic("syntax error in block definition",bs,NULL);
+    }
+    free_parse_buffer(0);
+}
+
+/* parse the block definition of -b */
+void
+parse_block(char *bs)
+{
+    parse_block_def(&ctx->block,bs);
+}
+
+/* { command, commands up to } are added to the sub-block */
+static void
+parse_sub_block(struct command_list *new,char *bs)
+{
+    struct sub_block *s;
+    char *buf,*e;
+
+    if(ctx->sub_depth == SUB_BLOCK_DEPTH) panic("Sub-blocks nested too deep",NULL,NULL);
+
+    while(isspace(*bs)) bs++;
+    buf = parse_buffer(1,strlen(bs) + 1);
+    strcpy(buf,bs);
+    e = buf + strlen(buf);
+    while(e > buf && isspace(e[-1])) *--e = 0;
+    if(!*buf) panic("Error in command","{",NULL);
+
+    s = xmalloc(sizeof(struct sub_block));
+    memset(s,0,sizeof(struct sub_block));
+    new->sub = s;
+    parse_block_def(&s->block,buf);
+
+    if((s->block.type & BLOCK_START_S) && !s->block.start.S.length &&
+       (s->block.type & BLOCK_STOP_S) && !s->block.stop.S.length) panic("Both block start and stop zero size",buf,NULL);
+    if(((s->block.type & BLOCK_START_S) && s->block.start.S.length >= INPUT_BUFFER_LOW) ||
+       ((s->block.type & BLOCK_STOP_S) && s->block.stop.S.length >= INPUT_BUFFER_LOW)) panic("String in sub-block definition too long",buf,NULL);
+    free_parse_buffer(1);
+
+    ctx->sub_commands[ctx->sub_depth++] = &s->cmds;
+}
+
+/* predicate of k and K commands: /string/, l min[:max] or r low high */
+static void
+parse_predicate(struct command_list *new,char *p,char **token,int count,char *command_string)
+{
+    char *buf,*colon;
+    char slash_char;
+    int j;
+
+    while(isspace(*p)) p++;
+    if(!isalnum(*p))
+    {
+        buf = parse_buffer(1,(4*INPUT_BUFFER_LOW) + 1);
+        slash_char = *p++;
+        j = 0;
+        while(*p != 0 && *p != slash_char && j < 4*INPUT_BUFFER_LOW) buf[j++] = *p++;
+        if(*p != slash_char) panic("Error in command",command_string,NULL);
+        buf[j] = 0;
+        p++;
+        while(isspace(*p)) p++;
+        if(*p) panic("Error in command",command_string,NULL);
+        new->s1 = parse_string(buf,&new->s1_len);
+        if(new->s1_len > INPUT_BUFFER_LOW) panic("String in command too long",command_string,NULL);
+        if(new->s1_len == 0) panic("Error in command",command_string,NULL);
+        free_parse_buffer(1);
+        return;
+    }
+
+    if(strlen(token[1]) != 1) panic("Error in command",command_string,NULL);
+    switch(token[1][0])
+    {
+        case 'l':
+            if(count != 3) panic("Error in command",command_string,NULL);
+            new->count = -1;
+            colon = strchr(token[2],':');
+            if(colon != NULL)
+            {
+                *colon++ = 0;
+                new->count = parse_long(colon);
+            }
+            new->offset = parse_long(token[2]);
+            if(new->count >= 0 && new->count < new->offset) panic("Error in command",command_string,NULL);
+            break;
+        case 'r':
+            if(count != 4) panic("Error in command",command_string,NULL);
+            new->s2 = xmalloc(2);
+            new->s2_len = 2;
+            buf = parse_string(token[2],&new->s1_len);
+            if(new->s1_len != 1) panic("Error in command",command_string,NULL);
+            new->s2[0] = buf[0];
+            free(buf);
+            buf = parse_string(token[3],&new->s1_len);
+            if(new->s1_len != 1) panic("Error in command",command_string,NULL);
+            new->s2[1] = buf[0];
+            free(buf);
+            new->s1_len = 0;
+            if(new->s2[1] < new->s2[0]) panic("Error in command",command_string,NULL);
+            break;
+        default:
+            panic("Error in command",command_string,NULL);
+            break;
+    }
+}
+
+/* parse one command, commands are in list pointed by commands */
+void
+parse_command(char *command_string)
+{
+    struct command_list *curr,*new,**start;
+    struct commands *cmds;
+    char *c,*p,*buf;
+    char *f;
+    char *token[10];
+    char *save;
+    char slash_char;
+    int i,j,verify;
+    off_t window;
+    size_t limit;
+
+   
+    p = command_string;
+    while(isspace(*p)) p++;              // remove leading spaces
+    if (p[0] == 0) return;      // empty line
+    if (p[0] == '#') return;       // comment
+
+    c = parse_buffer(0,strlen(p) + 1);
+    strcpy(c,p);
+
+    i = 0;
+    token[i] = strtok_r(c," \t\n",&save);
+    i++;
+    while(token[i - 1] != NULL && i < 10) token[i++] = strtok_r(NULL," \t\n",&save);
+    i--;
+
+    if(token[0][0] == '}')
+    {
+        if(i != 1 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+        if(!ctx->sub_depth) panic("} without {",NULL,NULL);
+        ctx->sub_depth--;
+        free_parse_buffer(0);
+        return;
+    }
+
+    cmds = ctx->sub_depth ? ctx->sub_commands[ctx->sub_depth - 1] : &ctx->cmds;
+    if(ctx->sub_depth && strchr(NOT_IN_SUB_BLOCK,token[0][0]) != NULL) panic("Command cannot be used in sub-block",command_string,NULL);
+
+    if(strchr(BLOCK_START_COMMANDS,token[0][0]) != NULL)
+    {
+        curr = cmds->block_start;
+        start = &cmds->block_start;
+    } else if(strchr(BYTE_COMMANDS,token[0][0]) != NULL)
+    {
+        curr = cmds->byte;
+        start = &cmds->byte;
+    } else if(strchr(BLOCK_END_COMMANDS,token[0][0]) != NULL)
+    {
+        curr = cmds->block_end;
+        start = &cmds->block_end;
+    } else
+    {
+        panic("Error in command",command_string,NULL);
+    }
+
+    if (curr != NULL)
+    {
+        while(curr->next != NULL)  curr = curr->next;
+    }
+    new = xmalloc(sizeof(struct command_list));
+    memset(new,0,sizeof(struct command_list));
+    if(curr == NULL)
+    {
+        *start = new;
+    } else
+    {
+        curr->next = new;
+    }
+    
+
+    new->letter = token[0][0];
+    switch(new->letter)
+    {
+        case 'D':
+            if(i < 1 || i > 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            if(i == 2) 
+            {
+                new->offset = parse_long(token[1]);
+                if(new->offset < 1) panic("n for D-command must be at least 1",NULL,NULL);
+            } else
+            {
+                new->offset = 0;
+            }
+            break;
+        case 'A':
+        case 'I':
+            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->s1 = parse_string(token[1],&new->s1_len);
+            break;
+        case 'w':
+        case 'W':
+        case '<':
+        case '>':
+        case 'P':
+            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->s1 = xstrdup(token[1]);
+            break;
+        case 'j':
+        case 'J':
+            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->count = parse_long(token[1]);
+            break;
+        case 'l':
+        case 'L':
+            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->count = parse_long(token[1]);
+            break;
+        case 'r':
+        case 'i':
+            if(i != 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->offset = parse_long(token[1]);
+            new->s1 = parse_string(token[2],&new->s1_len);
+            break;
+        case 'd':
+            if(i < 2 || i > 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->offset = parse_long(token[1]);
+
+            if(token[2][0] == '*' && !token[2][1])
+            {
+                new->count = 0;
+            } else
+            {
+                new->count = parse_long(token[2]);
+                if(new->count < 1) panic("Error in command",command_string,NULL);
+            }
+            break;
+        case 'c':
+            if(i != 3 || strlen(token[1]) != 3 || strlen(token[2]) != 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->s1 = xmalloc(strlen(token[1]) + strlen(token[2]) + 2);
+            strcpy(new->s1,token[1]);
+            strcat(new->s1,token[2]);
+            j = 0;
+            while(new->s1[j] != 0) {
+                new->s1[j] = toupper(new->s1[j]);
+                j++;
+            }
+            j = 0;
+            while(*convert_strings[j] != 0 && strcmp(convert_strings[j],new->s1) != 0) j++;
+            if(*convert_strings[j] == 0) panic("Unknown conversion",command_string,NULL);
+            new->count = j;
+            break;
+        case 's':
+        case 'y':
+            if(strlen(p) < 4) panic("Error in command",command_string,NULL);
+
+            buf = parse_buffer(1,(4*INPUT_BUFFER_LOW) + 1);
+
+            slash_char = p[1];
+            p += 2;
+            j = 0;
+            while(*p != 0 && *p != slash_char && j < 4*INPUT_BUFFER_LOW) buf[j++] = *p++;
+            if(*p != slash_char) panic("Error in command",command_string,NULL);
+            buf[j] = 0;
+            new->s1 = parse_string(buf,&new->s1_len);
+            if(new->s1_len > INPUT_BUFFER_LOW) panic("String in command too long",command_string,NULL);
+            if(new->s1_len == 0) panic("Error in command",command_string,NULL);
+
+            p++;
+
+            j = 0;
+            while(*p != 0 && *p != slash_char && j < 4*INPUT_BUFFER_LOW) buf[j++] = *p++;
+            buf[j] = 0;
+            if(*p != slash_char) panic("Error in command",command_string,NULL);
+            new->s2 = parse_string(buf,&new->s2_len);
+            if(new->s2_len > INPUT_BUFFER_LOW) panic("String in command too long",command_string,NULL);
+
+            if(new->letter == 'y' && new->s1_len != new->s2_len) panic("Strings in y-command must have equal length",command_string,NULL);
+            free_parse_buffer(1);
+            break;
+        case 'F':
+        case 'B':
+            if(i > 1 && (strlen(token[1]) != 1)) panic("Error in command",command_string,NULL);
+        case 'p':
+            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->s1 = parse_string(token[1],&new->s1_len);
+            j = 0;
+            while(new->s1[j] != 0) {
+                new->s1[j] = toupper(new->s1[j]);
+                j++;
+            }
+            if (new->letter == 'p') 
+            {
+                f = p_formats;
+            } else
+            {
+                f = FB_formats;
+            }
+            while(*f != 0 && strchr(new->s1,*f) == NULL) f++;
+            if (*f == 0) panic("Error in command",command_string,NULL);
+            break;
+        case 'N':
+            if(i != 1 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            break;
+        case 'U':
+            if(i > 4 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            window = 0;
+            limit = SET_MEMORY_LIMIT;
+            verify = 0;
+            for(j = 1;j < i;j++)
+            {
+                if(toupper(token[j][0]) == 'V' && !token[j][1])
+                {
+                    verify = 1;
+                } else if(strchr("KMGkmg",token[j][strlen(token[j]) - 1]) != NULL)
+                {
+                    limit = parse_size(token[j]);
+                } else
+                {
+                    window = parse_long(token[j]);
+                    if(window < 1) panic("n for U-command must be at least 1",NULL,NULL);
+                }
+            }
+            new->set = set_create(window,limit,verify);
+            break;
+        case 'k':
+        case 'K':
+            if(strlen(token[0]) > 1 || i < 2) panic("Error in command",command_string,NULL);
+            parse_predicate(new,p + 1,token,i,command_string);
+            new->filter = filter_create(new);
+            break;
+        case 'n':
+            if(i < 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->offset = parse_long(token[1]);
+            new->field = parse_field(token,i,command_string);
+            break;
+        case '{':
+            parse_sub_block(new,p + 1);
+            break;
+        case 'H':
+        case 'V':
+            if(strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            if(new->letter == 'H' && (i < 2 || i > 3)) panic("Error in command",command_string,NULL);
+            if(new->letter == 'V' && (i < 4 || i > 5)) panic("Error in command",command_string,NULL);
+            j = 0;
+            while(token[1][j] != 0) {
+                token[1][j] = toupper(token[1][j]);
+                j++;
+            }
+            j = 0;
+            while(*digest_strings[j] != 0 && strcmp(digest_strings[j],token[1]) != 0) j++;
+            if(*digest_strings[j] == 0) panic("Unknown digest",command_string,NULL);
+            new->count = j;
+            new->offset = 'X';
+            if(i > 2)
+            {
+                new->offset = toupper(token[2][0]);
+                if(strlen(token[2]) != 1 || (new->offset != 'X' && new->offset != 'R')) panic("Error in command",command_string,NULL);
+            }
+            new->s1 = NULL;
+            if(new->letter == 'V')
+            {
+                if(strlen(token[3]) != 1) panic("Error in command",command_string,NULL);
+                switch(toupper(token[3][0]))
+                {
+                    case 'D':
+                        if(i != 4) panic("Error in command",command_string,NULL);
+                        break;
+                    case 'F':
+                        if(i != 5) panic("Error in command",command_string,NULL);
+                        new->s1 = parse_string(token[4],&new->s1_len);
+                        break;
+                    default:
+                        panic("Error in command",command_string,NULL);
+                        break;
+                }
+            }
+            break;
+        case '&':
+        case '|':
+        case '^':
+            if(i != 2 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->s1 = parse_string(token[1],&new->s1_len);
+            if(new->s1_len != 1)  panic("Error in command",command_string,NULL);
+            break;
+        case '~':
+        case 'x':
+            if(i != 1 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            break;
+        case 'u':
+        case 'f':
+            if(i != 3 || strlen(token[0]) > 1) panic("Error in command",command_string,NULL);
+            new->offset = parse_long(token[1]);
+            new->s1 = parse_string(token[2],&new->s1_len);
+            if(new->s1_len != 1)  panic("Error in command",command_string,NULL);
+            break;
+        default:
+            panic("Unknown command",command_string,NULL);
+            break;
+    }
+    free_parse_buffer(0);
+}
+
+/* parse commands, commands are separated by ;. ; can be escaped as \;
+   and ;s inside " or ' are not separators
+   */
+void 
+parse_commands(char *command_string)
+{
+    char *c;
+    char *start;
+    int inside_d = 0;  // double
+    int inside_s = 0;  // single 
+
+    c = command_string;
+    start = c;
+
+    while(*start != 0)
+    {
+        switch(*c)
+        {
+            case '\\':
+                c++;
+                break;
+            case '"':
+                if(inside_d) 
+                {
+                    inside_d--;
+                } else
+                {
+                    inside_d++;
+                }
+                break;
+            case '\'':
+                if(inside_s) 
+                {
+                    inside_s--;
+                } else
+                {
+                    inside_s++;
+                }
+                break;
+            case ';':
+                if(!inside_d && !inside_s)
+                {
+                    *c = 0;
+                    parse_command(start);
+                    start = c + 1;
+                }
+                break;
+            case 0:
+                parse_command(start);
+                start = c;
+                break;
+        }
+        c++;
+    }
+}
+    
+
+
+/* read commands from file. The whole file is read first, so that nothing
+   is left open if a command has an error */
+void
+parse_command_file(char *file)
+{
+    FILE *fp;
+    char *line,*next;
+    size_t size = 8 * 1024,length = 0,n;
+    int line_no = 0;
+
+    fp = fopen(file,"r");
+    if (fp == NULL) panic("Error in opening file",file,strerror(errno));
+
+    if(ctx->script != NULL) free(ctx->script);
+    ctx->script = xmalloc(size);
+    while((n = fread(ctx->script + length,1,size - length - 1,fp)) > 0)
+    {
+        length += n;
+        if(length == size - 1)
+        {
+            size *= 2;
+            ctx->script = xrealloc(ctx->script,size);
+        }
+    }
+    if(ferror(fp)) panic("Error in reading file",file,strerror(errno));
+    fclose(fp);
+    ctx->script[length] = 0;
+
+    if(ctx->panic_info != NULL) free(ctx->panic_info);
+    ctx->panic_info = xmalloc(strlen(file) + 100);
+
+    line = ctx->script;
+    while(*line)
+    {
+        next = strchr(line,'\n');
+        if(next != NULL) *next++ = 0; else next = line + strlen(line);
+        line_no++;
+        sprintf(ctx->panic_info,"Error in file '%s' in line %d",file,line_no);
+        parse_commands(line);
+        line = next;
+    }
+
+    free(ctx->panic_info);
+    ctx->panic_info = NULL;
+    free(ctx->script);
+    ctx->script = NULL;
+}
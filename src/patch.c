@@ -0,0 +1,231 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* P command, patch table. Lines of the file have a stream offset and a string, the
+   bytes of the string replace the bytes of the blocks starting at the offset. Patches
+   are sorted by offset and a cursor is moved forward with the stream, so only the
+   patches at the current position are looked at. In span programs the patches of the
+   span are copied over the copy of the span */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+struct patch {
+    off_t offset;               // stream offset of the first byte
+    off_t length;
+    size_t data;                // index of the bytes in data of table
+};
+
+struct patch_table {
+    struct patch *patches;
+    size_t count;
+    unsigned char *data;        // bytes of all patches
+    size_t cursor;              // first patch not ending before the current position
+};
+
+static int
+compare_patches(const void *a,const void *b)
+{
+    const struct patch *p = a,*q = b;
+
+    if(p->offset != q->offset) return p->offset < q->offset ? -1 : 1;
+    return 0;
+}
+
+/* read the whole file to memory, file is zero terminated */
+static char *
+read_patch_file(char *file)
+{
+    FILE *fp;
+    char *text;
+    size_t size = 64 * 1024,length = 0,n;
+
+    fp = fopen(file,"r");
+    if (fp == NULL) panic("Error in opening file",file,strerror(errno));
+
+    text = xmalloc(size);
+    while((n = fread(text + length,1,size - length - 1,fp)) > 0)
+    {
+        length += n;
+        if(length == size - 1)
+        {
+            size *= 2;
+            text = xrealloc(text,size);
+        }
+    }
+    if(ferror(fp)) panic("Error in reading file",file,strerror(errno));
+    fclose(fp);
+    text[length] = 0;
+    return text;
+}
+
+/* load the patch file of P command, called at start of every run. Empty lines and
+   lines starting with # are skipped. Patches need not be sorted in the file but they
+   must not overlap */
+void
+load_patches(struct command_list *c)
+{
+    struct patch_table *t;
+    char *text,*line,*next,*string,*info,*end;
+    unsigned char *bytes;
+    size_t size,data_size,data_used,i;
+    off_t length;
+    int line_no = 0;
+
+    free_patches(c->patches);
+    t = xmalloc(sizeof(struct patch_table));
+    c->patches = t;
+    t->count = 0;
+    t->cursor = 0;
+    size = 1024;
+    t->patches = xmalloc(size * sizeof(struct patch));
+    data_size = 16 * 1024;
+    data_used = 0;
+    t->data = xmalloc(data_size);
+
+    text = read_patch_file((char *) c->s1);
+    info = xmalloc(strlen((char *) c->s1) + 100);
+
+    line = text;
+    while(*line)
+    {
+        next = strchr(line,'\n');
+        if(next != NULL) *next++ = 0; else next = line + strlen(line);
+        line_no++;
+        if(*line && line[strlen(line) - 1] == '\r') line[strlen(line) - 1] = 0;
+        while(isspace(*line)) line++;
+        if(!*line || *line == '#')
+        {
+            line = next;
+            continue;
+        }
+
+        sprintf(info,"Error in file '%s' in line %d",(char *) c->s1,line_no);
+        string = line;
+        while(*string && !isspace(*string)) string++;
+        if(!*string) panic(info,line,NULL);
+        *string++ = 0;
+        while(isspace(*string)) string++;
+
+        if(t->count == size)
+        {
+            size *= 2;
+            t->patches = xrealloc(t->patches,size * sizeof(struct patch));
+        }
+        t->patches[t->count].offset = (off_t) strtoll(line,&end,0);
+        if(*end || !isdigit(*line)) panic(info,line,NULL);
+        bytes = parse_string(string,&length);
+        if(!length) panic(info,string,NULL);
+        while(data_used + (size_t) length > data_size)
+        {
+            data_size *= 2;
+            t->data = xrealloc(t->data,data_size);
+        }
+        memcpy(t->data + data_used,bytes,(size_t) length);
+        free(bytes);
+        t->patches[t->count].length = length;
+        t->patches[t->count].data = data_used;
+        data_used += (size_t) length;
+        t->count++;
+        line = next;
+    }
+    free(info);
+    free(text);
+
+    qsort(t->patches,t->count,sizeof(struct patch),compare_patches);
+    for(i = 1;i < t->count;i++)
+    {
+        if(t->patches[i - 1].offset + t->patches[i - 1].length > t->patches[i].offset)
+            panic("Overlapping patches in file",(char *) c->s1,NULL);
+    }
+}
+
+void
+free_patches(struct patch_table *t)
+{
+    if(t == NULL) return;
+    free(t->patches);
+    free(t->data);
+    free(t);
+}
+
+/* move cursor over the patches ending before pos */
+static void
+patch_seek(struct patch_table *t,off_t pos)
+{
+    while(t->cursor < t->count && t->patches[t->cursor].offset + t->patches[t->cursor].length <= pos) t->cursor++;
+}
+
+/* P command for the current byte */
+void
+patch_byte(struct patch_table *t)
+{
+    struct patch *p;
+    off_t pos;
+
+    pos = ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos - ctx->in_buffer.buffer);
+    patch_seek(t,pos);
+    if(t->cursor == t->count) return;
+    p = &t->patches[t->cursor];
+    if(p->offset <= pos) put_byte(t->data[p->data + (pos - p->offset)]);
+}
+
+/* P command as a stage of span program, length bytes from in starting at stream offset pos
+   are copied to out and the patches are copied over them */
+off_t
+patch_span(struct patch_table *t,unsigned char *in,off_t length,unsigned char *out,off_t pos)
+{
+    struct patch *p;
+    off_t from,to;
+    size_t i;
+
+    memcpy(out,in,(size_t) length);
+    patch_seek(t,pos);
+    for(i = t->cursor;i < t->count && t->patches[i].offset < pos + length;i++)
+    {
+        p = &t->patches[i];
+        from = p->offset > pos ? p->offset : pos;
+        to = p->offset + p->length < pos + length ? p->offset + p->length : pos + length;
+        memcpy(out + (from - pos),t->data + p->data + (from - p->offset),(size_t) (to - from));
+    }
+    return length;
+}
+
+/* add the patches to key of --cache */
+void
+hash_patches(struct patch_table *t,unsigned char *key)
+{
+    size_t i;
+    off_t fields[2];
+
+    for(i = 0;i < t->count;i++)
+    {
+        fields[0] = t->patches[i].offset;
+        fields[1] = t->patches[i].length;
+        hash_key((unsigned char *) fields,(off_t) sizeof(fields),key);
+        hash_key(t->data + t->patches[i].data,t->patches[i].length,key);
+    }
+}
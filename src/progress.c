@@ -0,0 +1,204 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* progress of long runs. SIGUSR1 (and SIGALRM when --progress is given) only
+   sets progress_requested, the progress line and the metrics file are written
+   by read_input_stream when the input buffer is filled next time, so nothing
+   is done in the signal handler and nothing is checked per byte or per block.
+   The metrics file is in Prometheus text format and it is replaced atomically */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/* seconds between progress lines, 0 = only when SIGUSR1 is received */
+int progress_interval = 0;
+
+/* metrics file, NULL = no metrics */
+char *metrics_file = NULL;
+
+volatile sig_atomic_t progress_requested = 0;
+
+/* metrics are written this often if no --progress is given */
+#define METRICS_INTERVAL 10
+
+static off_t input_total;       // -1 if size of input is not known
+static double progress_start;
+static int progress_lines;      // progress lines are written only by --progress or SIGUSR1
+static volatile sig_atomic_t usr1_received = 0;
+
+static void
+progress_signal(int sig)
+{
+    if(sig == SIGUSR1) usr1_received = 1;
+    progress_requested = 1;
+}
+
+static void
+catch_signal(int sig)
+{
+    struct sigaction sa;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = progress_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(sig,&sa,NULL) == -1) panic("Cannot set signal handler",NULL,strerror(errno));
+}
+
+static off_t
+stream_offset()
+{
+    if(ctx->in_buffer.read_pos == NULL) return ctx->in_buffer.stream_offset;
+    return ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos - ctx->in_buffer.buffer);
+}
+
+/* write metrics to file.tmp and rename it to file */
+static void
+write_metrics()
+{
+    FILE *f;
+    char *tmp;
+    int i;
+
+    tmp = xmalloc(strlen(metrics_file) + 5);
+    strcpy(tmp,metrics_file);
+    strcat(tmp,".tmp");
+
+    f = fopen(tmp,"w");
+    if(f == NULL) panic("Cannot open file for writing",tmp,strerror(errno));
+
+    report_phase(report_phase(PHASE_OTHER));          // update time of the current phase
+
+    fprintf(f,"# HELP bbe_input_bytes_total Bytes read from input.\n");
+    fprintf(f,"# TYPE bbe_input_bytes_total counter\n");
+    fprintf(f,"bbe_input_bytes_total %lld\n",(long long) report.bytes_read);
+    fprintf(f,"# HELP bbe_stream_offset_bytes Current offset in input stream.\n");
+    fprintf(f,"# TYPE bbe_stream_offset_bytes gauge\n");
+    fprintf(f,"bbe_stream_offset_bytes %lld\n",(long long) stream_offset());
+    if(input_total >= 0)
+    {
+        fprintf(f,"# HELP bbe_input_size_bytes Total size of input files.\n");
+        fprintf(f,"# TYPE bbe_input_size_bytes gauge\n");
+        fprintf(f,"bbe_input_size_bytes %lld\n",(long long) input_total);
+    }
+    fprintf(f,"# HELP bbe_blocks_total Blocks found.\n");
+    fprintf(f,"# TYPE bbe_blocks_total counter\n");
+    fprintf(f,"bbe_blocks_total %lld\n",(long long) ctx->in_buffer.block_num);
+    fprintf(f,"# HELP bbe_output_bytes_total Bytes written to output.\n");
+    fprintf(f,"# TYPE bbe_output_bytes_total counter\n");
+    fprintf(f,"bbe_output_bytes_total %lld\n",(long long) report.bytes_written);
+    fprintf(f,"# HELP bbe_read_calls_total Read calls.\n");
+    fprintf(f,"# TYPE bbe_read_calls_total counter\n");
+    fprintf(f,"bbe_read_calls_total %lld\n",(long long) report.read_calls);
+    fprintf(f,"# HELP bbe_write_calls_total Write calls.\n");
+    fprintf(f,"# TYPE bbe_write_calls_total counter\n");
+    fprintf(f,"bbe_write_calls_total %lld\n",(long long) report.write_calls);
+    fprintf(f,"# HELP bbe_w_bytes_total Bytes written by w commands.\n");
+    fprintf(f,"# TYPE bbe_w_bytes_total counter\n");
+    fprintf(f,"bbe_w_bytes_total %lld\n",(long long) report.w_bytes);
+    fprintf(f,"# HELP bbe_phase_seconds_total Time spent in phases of the run.\n");
+    fprintf(f,"# TYPE bbe_phase_seconds_total counter\n");
+    for(i = 0;i < PHASES;i++) fprintf(f,"bbe_phase_seconds_total{phase=\"%s\"} %.6f\n",phase_name(i),report.time[i]);
+    fprintf(f,"# HELP bbe_elapsed_seconds Time since start.\n");
+    fprintf(f,"# TYPE bbe_elapsed_seconds gauge\n");
+    fprintf(f,"bbe_elapsed_seconds %.6f\n",monotonic_time() - progress_start);
+
+    if(fclose(f) == EOF) panic("Error writing to file",tmp,strerror(errno));
+    if(rename(tmp,metrics_file) == -1) panic("Cannot rename file",tmp,strerror(errno));
+    free(tmp);
+}
+
+static void
+final_metrics()
+{
+    write_metrics();
+}
+
+/* write progress line to stderr */
+static void
+write_progress()
+{
+    off_t offset;
+    double elapsed,rate,eta;
+    long secs;
+
+    offset = stream_offset();
+    elapsed = monotonic_time() - progress_start;
+    rate = elapsed > 0 ? (double) offset / elapsed : 0.0;
+
+    fprintf(stderr,"%s: offset %lld",program,(long long) offset);
+    if(input_total > 0) fprintf(stderr," of %lld (%.1f%%)",(long long) input_total,100.0 * (double) offset / (double) input_total);
+    fprintf(stderr,", block %lld, file %s, %.1f MB/s",(long long) ctx->in_buffer.block_num,get_current_file(),rate / (1024.0 * 1024.0));
+    if(input_total > 0 && rate > 0 && offset <= input_total)
+    {
+        eta = (double) (input_total - offset) / rate;
+        secs = (long) (eta + 0.5);
+        fprintf(stderr,", eta %ld:%02ld:%02ld",secs / 3600,(secs / 60) % 60,secs % 60);
+    }
+    fprintf(stderr,"\n");
+}
+
+/* called when progress_requested is set */
+void
+show_progress()
+{
+    progress_requested = 0;
+    if(progress_lines || usr1_received) write_progress();
+    usr1_received = 0;
+    if(metrics_file != NULL) write_metrics();
+}
+
+/* catch SIGUSR1, start the interval timer and the counters for metrics */
+void
+init_progress()
+{
+    struct itimerval it;
+    int interval;
+
+    input_total = input_size();
+    progress_start = monotonic_time();
+    progress_lines = progress_interval > 0;
+
+    catch_signal(SIGUSR1);
+
+    interval = progress_interval;
+    if(metrics_file != NULL)
+    {
+        start_counters();
+        if(!interval) interval = METRICS_INTERVAL;
+        write_metrics();
+        atexit(final_metrics);
+    }
+
+    if(interval)
+    {
+        catch_signal(SIGALRM);
+        memset(&it,0,sizeof(it));
+        it.it_interval.tv_sec = interval;
+        it.it_value.tv_sec = interval;
+        if(setitimer(ITIMER_REAL,&it,NULL) == -1) panic("Cannot set timer",NULL,strerror(errno));
+    }
+}
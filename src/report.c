@@ -0,0 +1,133 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* --stats-report: counters and time spent in the phases of the run, written
+   to stderr at exit. Counters are updated and clock is read only when
+   stats_report is set (by --stats-report or --metrics), see REPORT_ADD,
+   PHASE_BEGIN and PHASE_END in bbe.h.
+   Time of a phase does not include the time of phases called from it */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+
+int stats_report = 0;
+
+struct run_report report;
+
+static char *phase_names[PHASES] = {
+    "other",
+    "read_input_stream",
+    "find_block",
+    "mark_block_end",
+    "execute_commands",
+    "flush_buffer",
+    "write_output",
+    "write_w_command"
+};
+
+static int phase = PHASE_OTHER;
+static double phase_start;
+static double run_start;
+
+double
+monotonic_time()
+{
+#if defined(_POSIX_TIMERS) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+#endif
+}
+
+/* start phase p, returns the phase which was running */
+int
+report_phase(int p)
+{
+    double t;
+    int old;
+
+    t = monotonic_time();
+    report.time[phase] += t - phase_start;
+    phase_start = t;
+    old = phase;
+    phase = p;
+    return old;
+}
+
+static void
+write_report()
+{
+    double total;
+    int i;
+
+    report_phase(PHASE_OTHER);
+    total = monotonic_time() - run_start;
+
+    fprintf(stderr,"bytes_read %lld\n",(long long) report.bytes_read);
+    fprintf(stderr,"read_calls %lld\n",(long long) report.read_calls);
+    fprintf(stderr,"refills %lld\n",(long long) report.refills);
+    fprintf(stderr,"bytes_moved %lld\n",(long long) report.bytes_moved);
+    fprintf(stderr,"bytes_written %lld\n",(long long) report.bytes_written);
+    fprintf(stderr,"write_calls %lld\n",(long long) report.write_calls);
+    fprintf(stderr,"w_bytes %lld\n",(long long) report.w_bytes);
+    fprintf(stderr,"w_files %lld\n",(long long) report.w_files);
+    fprintf(stderr,"cache_hits %lld\n",(long long) report.cache_hits);
+    fprintf(stderr,"cache_misses %lld\n",(long long) report.cache_misses);
+    fprintf(stderr,"blocks %lld\n",(long long) ctx->in_buffer.block_num);
+    for(i = 0;i < PHASES;i++) fprintf(stderr,"time %s %.6f\n",phase_names[i],report.time[i]);
+    fprintf(stderr,"time total %.6f\n",total);
+}
+
+/* start collecting counters */
+void
+start_counters()
+{
+    if(stats_report) return;
+    stats_report = 1;
+    run_start = monotonic_time();
+    phase_start = run_start;
+}
+
+/* --stats-report, report is written at exit */
+void
+init_report()
+{
+    start_counters();
+    atexit(write_report);
+}
+
+/* name of phase p */
+char *
+phase_name(int p)
+{
+    return phase_names[p];
+}
@@ -0,0 +1,389 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* --count and --list-offsets: only the locations of the blocks are written.
+   If input is one regular file, the block start and stop strings are searched
+   by several threads, each thread searching its own segment of the file. Segments
+   are read with overlap of string length - 1 bytes so that strings crossing segment
+   boundaries are found. Found positions are then walked through in file order,
+   applying the same rules as find_block and mark_block_end */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+#endif
+
+/* 0 = normal mode, SCAN_COUNT or SCAN_LIST */
+int scan_mode = 0;
+
+/* number of blocks found */
+static off_t block_count = 0;
+
+/* output line buffer */
+static char scan_out[64 * 1024];
+static size_t scan_out_len = 0;
+
+/* write location of one block */
+static void
+found_block(off_t number,off_t offset,off_t length)
+{
+    block_count++;
+    if(scan_mode != SCAN_LIST) return;
+    if(scan_out_len > sizeof(scan_out) - 80)
+    {
+        write_output_fd((unsigned char *) scan_out,(ssize_t) scan_out_len);
+        scan_out_len = 0;
+    }
+    scan_out_len += sprintf(scan_out + scan_out_len,"%lld %lld %lld\n",(long long) number,(long long) offset,(long long) length);
+}
+
+/* find the blocks with find_block, blocks are not copied to output */
+static void
+scan_stream()
+{
+    off_t offset,length,span;
+
+    while(find_block())
+    {
+        offset = ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos - ctx->in_buffer.buffer);
+        length = 0;
+        do
+        {
+            span = block_span();
+            length += span;
+        } while(!skip_span(span));
+        found_block(ctx->in_buffer.block_num,offset,length);
+    }
+}
+
+#ifdef _POSIX_THREADS
+
+/* size of the file segment searched by one thread at a time */
+#ifndef SCAN_SEGMENT_SIZE
+#define SCAN_SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
+
+#define MAX_SCAN_THREADS 32
+
+/* sorted positions of one string, positions before head are used */
+struct positions {
+    off_t *pos;
+    long head;
+    long tail;
+    long size;
+};
+
+/* strings to search, 0 = block start and 1 = block stop */
+static unsigned char *scan_string[2];
+static off_t scan_length[2];
+static int string_count;
+
+/* found positions which are not yet used */
+static struct positions found[2];
+
+/* one search thread */
+struct scan_thread {
+    pthread_t thread;
+    unsigned char *buffer;
+    off_t start;                // start of the segment, -1 if thread has no segment
+    struct positions hits[2];   // positions found in segment
+};
+
+static struct scan_thread threads[MAX_SCAN_THREADS];
+static int thread_count;
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+static int scan_round = 0;
+static int threads_done;
+static int scan_quit = 0;
+
+/* input file */
+static int scan_fd;
+static off_t file_start;
+static off_t file_size;
+
+/* file is searched up to this offset */
+static off_t scanned;
+
+/* longest string - 1 */
+static off_t overlap;
+
+static void
+add_position(struct positions *p,off_t pos)
+{
+    if(p->tail == p->size)
+    {
+        p->size = p->size ? 2 * p->size : 1024;
+        p->pos = xrealloc(p->pos,p->size * sizeof(off_t));
+    }
+    p->pos[p->tail++] = pos;
+}
+
+/* search one segment, positions are added to t->hits */
+static void
+search_segment(struct scan_thread *t)
+{
+    off_t length,last,got;
+    ssize_t r;
+    unsigned char *p,*end;
+    int k;
+
+    length = SCAN_SEGMENT_SIZE + overlap;
+    if(t->start + length > file_size) length = file_size - t->start;
+
+    got = 0;
+    while(got < length)
+    {
+        r = pread(scan_fd,t->buffer + got,(size_t) (length - got),file_start + t->start + got);
+        if(r == -1) panic("Error reading file",get_current_file(),strerror(errno));
+        if(r == 0) panic("Input file has shrunk",get_current_file(),NULL);
+        got += r;
+    }
+
+    for(k = 0;k < string_count;k++)
+    {
+        t->hits[k].tail = 0;
+        last = length - scan_length[k];            // last possible position in buffer
+        if(last >= SCAN_SEGMENT_SIZE) last = SCAN_SEGMENT_SIZE - 1;
+        if(last < 0) continue;
+        p = t->buffer;
+        end = t->buffer + last;
+        while(p <= end && (p = memchr(p,scan_string[k][0],(size_t) (end - p) + 1)) != NULL)
+        {
+            if(!memcmp(p,scan_string[k],(size_t) scan_length[k])) add_position(&t->hits[k],t->start + (off_t) (p - t->buffer));
+            p++;
+        }
+    }
+}
+
+static void *
+scan_thread_main(void *arg)
+{
+    struct scan_thread *t = arg;
+    int round = 0;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&scan_lock);
+        while(scan_round == round && !scan_quit) pthread_cond_wait(&scan_work,&scan_lock);
+        if(scan_quit)
+        {
+            pthread_mutex_unlock(&scan_lock);
+            return NULL;
+        }
+        round = scan_round;
+        pthread_mutex_unlock(&scan_lock);
+
+        if(t->start >= 0) search_segment(t);
+
+        pthread_mutex_lock(&scan_lock);
+        if(++threads_done == thread_count) pthread_cond_signal(&scan_done);
+        pthread_mutex_unlock(&scan_lock);
+    }
+}
+
+/* search next thread_count segments and add the positions to found */
+static void
+search_round()
+{
+    int i,k;
+    long n;
+
+    for(i = 0;i < thread_count;i++)
+    {
+        threads[i].start = scanned < file_size ? scanned : -1;
+        if(scanned < file_size) scanned += SCAN_SEGMENT_SIZE;
+    }
+    if(scanned > file_size) scanned = file_size;
+
+    pthread_mutex_lock(&scan_lock);
+    threads_done = 0;
+    scan_round++;
+    pthread_cond_broadcast(&scan_work);
+    while(threads_done < thread_count) pthread_cond_wait(&scan_done,&scan_lock);
+    pthread_mutex_unlock(&scan_lock);
+
+    for(k = 0;k < string_count;k++)
+    {
+        if(found[k].head)          // remove used positions
+        {
+            n = found[k].tail - found[k].head;
+            memmove(found[k].pos,found[k].pos + found[k].head,n * sizeof(off_t));
+            found[k].head = 0;
+            found[k].tail = n;
+        }
+        for(i = 0;i < thread_count;i++)
+        {
+            if(threads[i].start < 0) continue;
+            for(n = 0;n < threads[i].hits[k].tail;n++) add_position(&found[k],threads[i].hits[k].pos[n]);
+        }
+    }
+}
+
+/* returns the first position of string k at or after offset, -1 if not found.
+   Offsets of the calls for same k must not decrease */
+static off_t
+next_position(int k,off_t offset)
+{
+    struct positions *p = &found[k];
+    struct positions *other = &found[1 - k];
+
+    for(;;)
+    {
+        while(p->head < p->tail && p->pos[p->head] < offset) p->head++;
+        if(p->head < p->tail) return p->pos[p->head];
+        if(scanned >= file_size) return (off_t) -1;
+
+        /* result will be after the searched part, so will the next offset for the other string */
+        if(string_count == 2) while(other->head < other->tail && other->pos[other->head] < scanned) other->head++;
+        search_round();
+    }
+}
+
+/* walk the blocks using the positions found by threads */
+static void
+scan_file()
+{
+    off_t pos,start,end,next,number;
+    int start_k = -1,stop_k = -1;
+    int i;
+    long cpus;
+
+    string_count = 0;
+    overlap = 0;
+    if(ctx->block.type & BLOCK_START_S && ctx->block.start.S.length)
+    {
+        start_k = string_count;
+        scan_string[string_count] = ctx->block.start.S.string;
+        scan_length[string_count++] = ctx->block.start.S.length;
+    }
+    if(ctx->block.type & BLOCK_STOP_S && ctx->block.stop.S.length)
+    {
+        stop_k = string_count;
+        scan_string[string_count] = ctx->block.stop.S.string;
+        scan_length[string_count++] = ctx->block.stop.S.length;
+    }
+    for(i = 0;i < string_count;i++) if(scan_length[i] - 1 > overlap) overlap = scan_length[i] - 1;
+
+    if(ctx->block.type & BLOCK_STOP_S && !ctx->block.stop.S.length && ctx->block.type & BLOCK_START_S && !ctx->block.start.S.length)
+        panic("Both block start and stop zero size",NULL,NULL);
+
+    scanned = 0;
+    if(ctx->block.type & BLOCK_START_M) scanned = ctx->block.start.N < file_size ? ctx->block.start.N : file_size;
+
+    thread_count = 0;
+    if(string_count)
+    {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus < 1 ? 1 : (cpus > MAX_SCAN_THREADS ? MAX_SCAN_THREADS : (int) cpus);
+        for(i = 0;i < thread_count;i++)
+        {
+            memset(&threads[i],0,sizeof(struct scan_thread));
+            threads[i].buffer = xmalloc(SCAN_SEGMENT_SIZE + overlap);
+            if(pthread_create(&threads[i].thread,NULL,scan_thread_main,&threads[i]) != 0)
+                panic("Cannot create thread",NULL,strerror(errno));
+        }
+    }
+
+    pos = 0;
+    number = 0;
+    while(pos < file_size)
+    {
+        if(ctx->block.type & BLOCK_START_M)
+        {
+            if(number || ctx->block.start.N >= file_size) break;
+            start = ctx->block.start.N;
+        } else if(start_k >= 0)
+        {
+            start = next_position(start_k,pos);
+            if(start < 0) break;
+        } else
+        {
+            start = pos;
+        }
+
+        end = file_size - 1;
+        if(ctx->block.type & BLOCK_STOP_M)
+        {
+            if(start + ctx->block.stop.M - 1 < end) end = start + ctx->block.stop.M - 1;
+        } else if(stop_k >= 0)
+        {
+            next = next_position(stop_k,start + (start_k >= 0 ? ctx->block.start.S.length : 0));
+            if(next >= 0) end = next + ctx->block.stop.S.length - 1;
+        } else if(ctx->block.type & BLOCK_STOP_S && start_k >= 0)
+        {
+            next = next_position(start_k,start + ctx->block.start.S.length);
+            if(next >= 0) end = next - 1;
+        }
+
+        found_block(++number,start,end - start + 1);
+        pos = end + 1;
+    }
+
+    if(thread_count)
+    {
+        pthread_mutex_lock(&scan_lock);
+        scan_quit = 1;
+        pthread_cond_broadcast(&scan_work);
+        pthread_mutex_unlock(&scan_lock);
+        for(i = 0;i < thread_count;i++) pthread_join(threads[i].thread,NULL);
+    }
+}
+#endif
+
+/* execute --count or --list-offsets */
+void
+execute_scan()
+{
+    char line[64];
+#ifdef _POSIX_THREADS
+    struct stat st;
+
+    scan_fd = regular_input_file(&file_start);
+    if(scan_fd >= 0 && fstat(scan_fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size >= file_start)
+    {
+        file_size = st.st_size - file_start;
+        scan_file();
+    } else
+    {
+        scan_stream();
+    }
+#else
+    scan_stream();
+#endif
+    if(scan_mode == SCAN_COUNT)
+    {
+        sprintf(line,"%lld\n",(long long) block_count);
+        write_output_fd((unsigned char *) line,(ssize_t) strlen(line));
+    } else
+    {
+        write_output_fd((unsigned char *) scan_out,(ssize_t) scan_out_len);
+    }
+    close_output_stream();
+}
@@ -0,0 +1,561 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* --serve: bbe as a daemon running jobs given over a UNIX socket, so that
+   small files are edited without starting a process, parsing the commands
+   and allocating the buffers for every file.
+
+   Scripts are the block definitions and commands of the command line (script 0
+   is the first -b, 1 the second and so on) and scripts compiled by clients.
+   Every worker thread accepts connections and runs the jobs of its connection
+   one after another. A worker keeps a context (see libbbe.h) for every script
+   it has run, so commands are compiled and buffers allocated once per worker.
+
+   Requests are packets of a SOCK_SEQPACKET socket, fields are separated by
+   newlines:
+
+   RUN script input output      input and output are file names or - for a file
+                                descriptor passed with the request (SCM_RIGHTS),
+                                input first
+   COMPILE block commands       block and commands as with -b and -e, empty block
+                                is the whole input
+
+   Reply is "OK" (COMPILE: "OK script") or "ERROR message" */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+#endif
+
+/* max size of request and reply */
+#define REQUEST_SIZE 8192
+
+/* max number of descriptors passed with one request */
+#define REQUEST_FDS 2
+
+#define MAX_WORKERS 256
+
+/* block definition and commands as text, every worker compiles its own context */
+struct script {
+    char *block;                // NULL = whole input
+    char **commands;            // -e expressions and lines of -f files
+    int command_count;
+    int options;                // BBE_SUPPRESS and BBE_HEXDUMP
+};
+
+/* file of -f, lines are read when serving starts */
+#define SCRIPT_FILE_MARK '\001'
+
+static struct script **scripts = NULL;
+static int script_count = 0;
+static int script_options = 0;
+
+#ifdef _POSIX_THREADS
+static pthread_mutex_t script_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_SCRIPTS() pthread_mutex_lock(&script_lock)
+#define UNLOCK_SCRIPTS() pthread_mutex_unlock(&script_lock)
+#else
+#define LOCK_SCRIPTS()
+#define UNLOCK_SCRIPTS()
+#endif
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+
+/* contexts of one worker, index is script number */
+struct worker {
+    struct bbe_ctx **ctxs;
+    int ctx_count;
+    int in_fd;                  // descriptors of the current job, arguments of fd_read and fd_write
+    int out_fd;
+};
+
+static struct script *
+current_script()
+{
+    if(!script_count) serve_definition();
+    return scripts[script_count - 1];
+}
+
+static void
+add_command(struct script *s,char *command)
+{
+    s->commands = xrealloc(s->commands,(s->command_count + 1) * sizeof(char *));
+    s->commands[s->command_count++] = command;
+}
+
+/* -b starting a new definition */
+void
+serve_definition()
+{
+    struct script *s;
+
+    s = xmalloc(sizeof(struct script));
+    memset(s,0,sizeof(struct script));
+    scripts = xrealloc(scripts,(script_count + 1) * sizeof(struct script *));
+    scripts[script_count++] = s;
+}
+
+void
+serve_block(char *block)
+{
+    current_script()->block = xstrdup(block);
+}
+
+void
+serve_commands(char *commands)
+{
+    add_command(current_script(),xstrdup(commands));
+}
+
+void
+serve_command_file(char *file)
+{
+    char *mark;
+
+    mark = xmalloc(strlen(file) + 2);
+    mark[0] = SCRIPT_FILE_MARK;
+    strcpy(mark + 1,file);
+    add_command(current_script(),mark);
+}
+
+/* replace the -f files of script by their lines */
+static void
+read_script_files(struct script *s)
+{
+    char **commands = s->commands;
+    int count = s->command_count;
+    char line[4 * INPUT_BUFFER_LOW];
+    FILE *fp;
+    size_t len;
+    int i;
+
+    s->commands = NULL;
+    s->command_count = 0;
+    for(i = 0;i < count;i++)
+    {
+        if(commands[i][0] != SCRIPT_FILE_MARK)
+        {
+            add_command(s,commands[i]);
+            continue;
+        }
+        fp = fopen(commands[i] + 1,"r");
+        if(fp == NULL) panic("Error in opening file",commands[i] + 1,strerror(errno));
+        while(fgets(line,sizeof(line),fp) != NULL)
+        {
+            len = strlen(line);
+            if(len && line[len - 1] == '\n') line[len - 1] = 0;
+            add_command(s,xstrdup(line));
+        }
+        if(ferror(fp)) panic("Error in reading file",commands[i] + 1,strerror(errno));
+        fclose(fp);
+        free(commands[i]);
+    }
+    free(commands);
+}
+
+/* new context having the commands of script s, NULL on error and message in error */
+static struct bbe_ctx *
+compile_script(struct script *s,char *error)
+{
+    struct bbe_ctx *c;
+    int i;
+
+    c = bbe_new();
+    if(c == NULL)
+    {
+        strcpy(error,"Out of memory");
+        return NULL;
+    }
+    if(bbe_compile(c,s->block,NULL) == -1) goto failed;
+    for(i = 0;i < s->command_count;i++)
+    {
+        if(bbe_compile(c,NULL,s->commands[i]) == -1) goto failed;
+    }
+    bbe_options(c,s->options);
+    return c;
+
+failed:
+    snprintf(error,REQUEST_SIZE,"%s",bbe_error(c));
+    bbe_free(c);
+    return NULL;
+}
+
+/* make room for the context of script n */
+static void
+worker_slots(struct worker *w,int n)
+{
+    if(n < w->ctx_count) return;
+    w->ctxs = xrealloc(w->ctxs,(n + 1) * sizeof(struct bbe_ctx *));
+    memset(w->ctxs + w->ctx_count,0,(n + 1 - w->ctx_count) * sizeof(struct bbe_ctx *));
+    w->ctx_count = n + 1;
+}
+
+/* context of the worker for script n */
+static struct bbe_ctx *
+worker_context(struct worker *w,int n,char *error)
+{
+    struct script *s;
+
+    LOCK_SCRIPTS();
+    s = n >= 0 && n < script_count ? scripts[n] : NULL;
+    UNLOCK_SCRIPTS();
+    if(s == NULL)
+    {
+        strcpy(error,"Unknown script");
+        return NULL;
+    }
+
+    worker_slots(w,n);
+    if(w->ctxs[n] == NULL) w->ctxs[n] = compile_script(s,error);
+    return w->ctxs[n];
+}
+
+static ssize_t
+fd_read(void *arg,unsigned char *buf,size_t length)
+{
+    ssize_t r;
+
+    do r = read(*(int *) arg,buf,length); while(r == -1 && errno == EINTR);
+    return r;
+}
+
+static ssize_t
+fd_write(void *arg,unsigned char *buf,size_t length)
+{
+    ssize_t r;
+
+    do r = write(*(int *) arg,buf,length); while(r == -1 && errno == EINTR);
+    return r;
+}
+
+/* forget the input and output given to context c for a job which was not run */
+static void
+forget_job(struct bbe_ctx *c)
+{
+    struct bbe_ctx *saved_ctx = ctx;
+
+    ctx = c;
+    clear_input_files();
+    clear_output_stream();
+    ctx = saved_ctx;
+}
+
+/* RUN request */
+static int
+run_job(struct worker *w,char **field,int fields,int *fds,int fd_count,char *error)
+{
+    struct bbe_ctx *c;
+    char *end;
+    long n;
+    int next_fd = 0;
+
+    if(fields != 4)
+    {
+        strcpy(error,"Error in request");
+        return -1;
+    }
+    n = strtol(field[1],&end,10);
+    if(*end || end == field[1])
+    {
+        strcpy(error,"Error in script number");
+        return -1;
+    }
+    c = worker_context(w,(int) n,error);
+    if(c == NULL) return -1;
+
+    if(strcmp(field[2],"-") == 0)
+    {
+        if(next_fd == fd_count) goto no_fd;
+        w->in_fd = fds[next_fd++];
+        if(bbe_input(c,"(client input)",fd_read,&w->in_fd) == -1) goto failed;
+    } else
+    {
+        if(bbe_input_file(c,field[2]) == -1) goto failed;
+    }
+
+    if(strcmp(field[3],"-") == 0)
+    {
+        if(next_fd == fd_count) goto no_fd;
+        w->out_fd = fds[next_fd++];
+        if(bbe_output(c,"(client output)",fd_write,&w->out_fd) == -1) goto failed;
+    } else
+    {
+        if(bbe_output_file(c,field[3]) == -1) goto failed;
+    }
+
+    if(bbe_run(c) == -1) goto failed;
+    return 0;
+
+no_fd:
+    strcpy(error,"File descriptor missing from request");
+    forget_job(c);
+    return -1;
+
+failed:
+    snprintf(error,REQUEST_SIZE,"%s",bbe_error(c));
+    forget_job(c);
+    return -1;
+}
+
+/* COMPILE request, new script is added for all workers */
+static int
+compile_request(struct worker *w,char **field,int fields,char *error)
+{
+    struct script *s;
+    struct bbe_ctx *c;
+    int n;
+
+    if(fields != 3)
+    {
+        strcpy(error,"Error in request");
+        return -1;
+    }
+
+    s = xmalloc(sizeof(struct script));
+    memset(s,0,sizeof(struct script));
+    s->block = *field[1] ? xstrdup(field[1]) : NULL;
+    add_command(s,xstrdup(field[2]));
+    s->options = script_options;
+
+    c = compile_script(s,error);
+    if(c == NULL)
+    {
+        free(s->block);
+        free(s->commands[0]);
+        free(s->commands);
+        free(s);
+        return -1;
+    }
+
+    LOCK_SCRIPTS();
+    scripts = xrealloc(scripts,(script_count + 1) * sizeof(struct script *));
+    n = script_count;
+    scripts[script_count++] = s;
+    UNLOCK_SCRIPTS();
+
+    worker_slots(w,n);
+    w->ctxs[n] = c;
+    sprintf(error,"%d",n);
+    return 0;
+}
+
+/* receive request and descriptors passed with it, returns length of request, 0 at end of connection */
+static ssize_t
+receive_request(int conn,char *buf,int *fds,int *fd_count)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(REQUEST_FDS * sizeof(int))];
+    } control;
+    ssize_t r;
+    int i,n;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = REQUEST_SIZE - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do r = recvmsg(conn,&msg,0); while(r == -1 && errno == EINTR);
+    if(r <= 0) return 0;
+
+    *fd_count = 0;
+    for(cmsg = CMSG_FIRSTHDR(&msg);cmsg != NULL;cmsg = CMSG_NXTHDR(&msg,cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for(i = 0;i < n;i++)
+        {
+            if(*fd_count < REQUEST_FDS)
+            {
+                memcpy(&fds[(*fd_count)++],CMSG_DATA(cmsg) + i * sizeof(int),sizeof(int));
+            }
+        }
+    }
+    buf[r] = 0;
+    return r;
+}
+
+/* run the requests of one connection */
+static void
+serve_connection(struct worker *w,int conn)
+{
+    char request[REQUEST_SIZE];
+    char reply[REQUEST_SIZE + 16];
+    char message[REQUEST_SIZE];
+    char *field[8];
+    char *p;
+    int fds[REQUEST_FDS];
+    int fd_count,fields,i,ret;
+    ssize_t len;
+
+    while((len = receive_request(conn,request,fds,&fd_count)) > 0)
+    {
+        if(request[len - 1] == '\n') request[--len] = 0;
+        fields = 0;
+        p = request;
+        while(fields < 8)
+        {
+            field[fields++] = p;
+            p = strchr(p,'\n');
+            if(p == NULL) break;
+            *p++ = 0;
+        }
+
+        if(strcmp(field[0],"RUN") == 0)
+        {
+            ret = run_job(w,field,fields,fds,fd_count,message);
+        } else if(strcmp(field[0],"COMPILE") == 0)
+        {
+            ret = compile_request(w,field,fields,message);
+        } else
+        {
+            strcpy(message,"Unknown request");
+            ret = -1;
+        }
+        for(i = 0;i < fd_count;i++) close(fds[i]);
+
+        if(ret == -1)
+        {
+            snprintf(reply,sizeof(reply),"ERROR %s\n",message);
+        } else if(field[0][0] == 'C')
+        {
+            snprintf(reply,sizeof(reply),"OK %s\n",message);
+        } else
+        {
+            strcpy(reply,"OK\n");
+        }
+        if(send(conn,reply,strlen(reply),MSG_NOSIGNAL) == -1) break;
+    }
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker w;
+    int conn;
+
+    (void) arg;
+    w.ctxs = NULL;
+    w.ctx_count = 0;
+    w.in_fd = -1;
+    w.out_fd = -1;
+
+    for(;;)
+    {
+        conn = accept(listen_fd,NULL,NULL);
+        if(conn == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr,"%s: Cannot accept connection: %s; %s\n",program,socket_path,strerror(errno));
+            sleep(1);           // e.g. out of descriptors, other workers may free some
+            continue;
+        }
+        serve_connection(&w,conn);
+        close(conn);
+    }
+    return NULL;
+}
+
+static void
+remove_socket(int sig)
+{
+    (void) sig;
+    unlink(socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+/* serve jobs at socket path with workers threads, does not return */
+void
+serve(char *path,int workers,int options)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    struct sigaction sa;
+    char error[REQUEST_SIZE];
+    struct bbe_ctx *c;
+    int i;
+#ifdef _POSIX_THREADS
+    pthread_t thread;
+#endif
+
+    if(!script_count) serve_definition();
+    for(i = 0;i < script_count;i++)
+    {
+        read_script_files(scripts[i]);
+        scripts[i]->options = options;
+        c = compile_script(scripts[i],error);          // check the scripts before serving
+        if(c == NULL) panic(error,NULL,NULL);
+        bbe_free(c);
+    }
+    script_options = options;
+    sink_threads = 0;                   // I/O threads of w commands are shared by the process
+
+    if(workers < 1)
+    {
+        workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if(workers < 1) workers = 1;
+    }
+    if(workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) panic("Socket name too long",path,NULL);
+    if(lstat(path,&st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);     // left by previous daemon
+
+    listen_fd = socket(AF_UNIX,SOCK_SEQPACKET,0);
+    if(listen_fd == -1) panic("Cannot create socket",path,strerror(errno));
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+    if(bind(listen_fd,(struct sockaddr *) &addr,sizeof(addr)) == -1) panic("Cannot bind socket",path,strerror(errno));
+    if(listen(listen_fd,64) == -1) panic("Cannot listen socket",path,strerror(errno));
+    socket_path = path;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = remove_socket;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM,&sa,NULL);
+    sigaction(SIGINT,&sa,NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE,&sa,NULL);
+
+#ifdef _POSIX_THREADS
+    for(i = 1;i < workers;i++)
+    {
+        if(pthread_create(&thread,NULL,worker_main,NULL) != 0) panic("Cannot create thread",NULL,strerror(errno));
+    }
+#endif
+    worker_main(NULL);
+}
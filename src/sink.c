@@ -0,0 +1,336 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* output sinks of w commands. Data is collected to a private buffer of the sink.
+   A file given when the sink is created is opened at once, so that open errors are
+   found before processing and an old file is truncated, the file is removed at close
+   if nothing was written to it. Per block files (w commands having %B in file name)
+   are created when the buffer is written first time, so files which would be empty
+   are never created. When a sink moves to next file, the rest of the data and
+   closing of the previous file is handed to a small pool of I/O threads if there are
+   spare processors, so that opening, writing and closing of small per block files
+   does not stop the block processing. The I/O threads are shared by the whole
+   process, so they are used only when sink_threads is set (by the bbe program), not
+   by the library */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef SINK_BUFFER_SIZE
+#define SINK_BUFFER_SIZE (256 * 1024)
+#endif
+
+#define SINK_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
+
+/* per block files can be closed by I/O threads */
+int sink_threads = 0;
+
+struct w_sink {
+    char *file;             // current file name, NULL if no file
+    int fd;                 // -1 if file is not yet created
+    int written;            // something is written to file
+    unsigned char *buffer;
+    size_t length;          // bytes in buffer
+};
+
+/* create file */
+static int
+sink_open_file(char *file)
+{
+    int fd;
+
+    fd = open(file,O_WRONLY | O_CREAT | O_TRUNC,SINK_FILE_MODE);
+    if(fd == -1) panic("Cannot open file for writing",file,strerror(errno));
+    return fd;
+}
+
+static void
+sink_write_fd(int fd,char *file,unsigned char *buf,size_t length)
+{
+    ssize_t w;
+
+    while(length)
+    {
+        w = write(fd,buf,length);
+        if(w == -1)
+        {
+            if(errno == EINTR) continue;
+            panic("Cannot write to file",file,strerror(errno));
+        }
+        buf += w;
+        length -= (size_t) w;
+    }
+}
+
+/* write the rest of the data and close file */
+static void
+sink_finish_file(char *file,int fd,unsigned char *buf,size_t length)
+{
+    if(fd == -1) fd = sink_open_file(file);
+    sink_write_fd(fd,file,buf,length);
+    if(close(fd) == -1) panic("Error in closing file",file,strerror(errno));
+}
+
+#ifdef _POSIX_THREADS
+
+#define MAX_IO_THREADS 4
+#define IO_QUEUE_SIZE 64
+
+/* file to be finished by I/O thread */
+struct io_job {
+    char *file;
+    int fd;
+    unsigned char *data;
+    size_t length;
+};
+
+/* every thread has its own queue, jobs for same file name go to same thread
+   so they are done in order */
+struct io_queue {
+    pthread_t thread;
+    pthread_cond_t work;
+    pthread_cond_t space;
+    struct io_job jobs[IO_QUEUE_SIZE];
+    int head;
+    int count;
+};
+
+static struct io_queue io_queues[MAX_IO_THREADS];
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static int io_threads = 0;
+static int io_started = 0;
+static int io_quit = 0;
+
+static void *
+io_thread_main(void *arg)
+{
+    struct io_queue *q = arg;
+    struct io_job job;
+
+    pthread_mutex_lock(&io_lock);
+    for(;;)
+    {
+        while(!q->count && !io_quit) pthread_cond_wait(&q->work,&io_lock);
+        if(!q->count) break;
+        job = q->jobs[q->head];
+        q->head = (q->head + 1) % IO_QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->space);
+        pthread_mutex_unlock(&io_lock);
+
+        sink_finish_file(job.file,job.fd,job.data,job.length);
+        free(job.file);
+        if(job.data != NULL) free(job.data);
+
+        pthread_mutex_lock(&io_lock);
+    }
+    pthread_mutex_unlock(&io_lock);
+    return NULL;
+}
+
+/* threads are used only if there are processors left for them */
+static void
+start_io_threads()
+{
+    long cpus;
+    int i;
+
+    if(io_started || !sink_threads) return;
+    io_started = 1;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if(cpus < 1) return;
+    io_threads = cpus > MAX_IO_THREADS ? MAX_IO_THREADS : (int) cpus;
+    for(i = 0;i < io_threads;i++)
+    {
+        pthread_cond_init(&io_queues[i].work,NULL);
+        pthread_cond_init(&io_queues[i].space,NULL);
+        io_queues[i].head = 0;
+        io_queues[i].count = 0;
+        if(pthread_create(&io_queues[i].thread,NULL,io_thread_main,&io_queues[i]) != 0)
+            panic("Cannot create thread",NULL,strerror(errno));
+    }
+}
+
+/* give the current file of sink to I/O thread, sink is left without file */
+static void
+queue_file(struct w_sink *s)
+{
+    struct io_queue *q;
+    struct io_job *job;
+    unsigned int h = 0;
+    char *f;
+
+    for(f = s->file;*f;f++) h = h * 31 + (unsigned char) *f;
+    q = &io_queues[h % io_threads];
+
+    pthread_mutex_lock(&io_lock);
+    while(q->count == IO_QUEUE_SIZE) pthread_cond_wait(&q->space,&io_lock);
+    job = &q->jobs[(q->head + q->count) % IO_QUEUE_SIZE];
+    job->file = s->file;
+    job->fd = s->fd;
+    job->length = s->length;
+    job->data = NULL;
+    if(s->length)
+    {
+        job->data = xmalloc(s->length);
+        memcpy(job->data,s->buffer,s->length);
+    }
+    q->count++;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&io_lock);
+
+    s->file = NULL;
+    s->fd = -1;
+    s->length = 0;
+}
+#endif
+
+/* create sink, file can be NULL if the file is given later with sink_next_file */
+struct w_sink *
+sink_create(char *file)
+{
+    struct w_sink *s;
+
+    s = xmalloc(sizeof(struct w_sink));
+    s->file = file == NULL ? NULL : xstrdup(file);
+    s->fd = file == NULL ? -1 : sink_open_file(file);
+    s->written = 0;
+    s->buffer = xmalloc(SINK_BUFFER_SIZE);
+    s->length = 0;
+    return s;
+}
+
+/* write buffer of sink to file, file is created if needed */
+static void
+sink_flush(struct w_sink *s)
+{
+    if(s->fd == -1) s->fd = sink_open_file(s->file);
+    sink_write_fd(s->fd,s->file,s->buffer,s->length);
+    s->length = 0;
+}
+
+void
+sink_write(struct w_sink *s,unsigned char *buf,size_t length)
+{
+    if(!length || s->file == NULL) return;
+    s->written = 1;
+
+    if(s->length + length > SINK_BUFFER_SIZE)
+    {
+        sink_flush(s);
+        if(length >= SINK_BUFFER_SIZE)
+        {
+            sink_write_fd(s->fd,s->file,buf,length);
+            return;
+        }
+    }
+    memcpy(s->buffer + s->length,buf,length);
+    s->length += length;
+}
+
+/* finish current file, nothing is done for files without data */
+static void
+sink_finish(struct w_sink *s)
+{
+    if(s->file == NULL) return;
+    if(!s->written)
+    {
+        if(s->fd != -1)                  // opened at create, remove if empty
+        {
+            if(close(s->fd) == -1) panic("Error in closing file",s->file,strerror(errno));
+            unlink(s->file);
+            s->fd = -1;
+        }
+        free(s->file);
+        s->file = NULL;
+        return;
+    }
+    REPORT_ADD(w_files,1);
+#ifdef _POSIX_THREADS
+    if(io_threads)
+    {
+        queue_file(s);
+        return;
+    }
+#endif
+    sink_finish_file(s->file,s->fd,s->buffer,s->length);
+    free(s->file);
+    s->file = NULL;
+    s->fd = -1;
+    s->length = 0;
+}
+
+/* finish current file and start writing to new file */
+void
+sink_next_file(struct w_sink *s,char *file)
+{
+#ifdef _POSIX_THREADS
+    start_io_threads();
+#endif
+    sink_finish(s);
+    s->file = xstrdup(file);
+    s->written = 0;
+}
+
+void
+sink_close(struct w_sink *s)
+{
+    sink_finish(s);
+    free(s->buffer);
+    free(s);
+}
+
+/* close sink without writing the buffered data, used after errors */
+void
+sink_discard(struct w_sink *s)
+{
+    if(s->fd != -1) close(s->fd);
+    free(s->file);
+    free(s->buffer);
+    free(s);
+}
+
+/* wait until all files are written */
+void
+sink_shutdown()
+{
+#ifdef _POSIX_THREADS
+    int i;
+
+    if(!io_threads) return;
+    pthread_mutex_lock(&io_lock);
+    io_quit = 1;
+    for(i = 0;i < io_threads;i++) pthread_cond_signal(&io_queues[i].work);
+    pthread_mutex_unlock(&io_lock);
+    for(i = 0;i < io_threads;i++) pthread_join(io_queues[i].thread,NULL);
+    io_threads = 0;
+#endif
+}
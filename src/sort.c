@@ -0,0 +1,533 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* --sort-key mode: blocks are written sorted by an unsigned integer key at a fixed
+   offset of the block. Blocks are collected to runs in memory, a run is sorted with
+   LSD radix sort on the bytes of the key and written to a temporary file when the
+   next block does not fit to it. Full runs are sorted and written by threads while
+   the next run is read, if there are spare processors. At the end the runs are merged
+   using a heap. Sort is stable, blocks having equal keys are written in input order.
+   If all blocks fit in one run, no temporary files are used */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+#endif
+
+/* memory for the runs being read and sorted */
+#ifndef SORT_MEMORY
+#define SORT_MEMORY (256 * 1024 * 1024)
+#endif
+
+#define MAX_SORT_THREADS 4
+
+/* buffer for writing and merging one run file */
+#define RUN_IO_SIZE (256 * 1024)
+
+/* --sort-key is given */
+int sort_mode = 0;
+
+static off_t key_offset;
+static int key_length;
+static int key_little_endian;
+
+struct sort_record {
+    uint64_t key;
+    off_t start;                // offset of the block in arena
+    off_t length;
+};
+
+/* header of a block in run file */
+struct run_header {
+    uint64_t key;
+    off_t length;
+};
+
+struct sort_run {
+    unsigned char *arena;       // contents of the blocks
+    size_t arena_size;
+    size_t used;
+    struct sort_record *records;
+    struct sort_record *temp;   // second array for radix sort
+    size_t count;
+    size_t size;                // size of records and temp
+    int fd;                     // run file
+#ifdef _POSIX_THREADS
+    pthread_t thread;
+    int running;                // thread is sorting and writing the run
+#endif
+};
+
+/* state of merging one run file */
+struct merge_input {
+    int fd;
+    int run;                    // number of the run, equal keys are merged in run order
+    unsigned char *buffer;
+    size_t pos;
+    size_t length;
+    struct run_header header;   // header of the current block
+};
+
+static struct sort_run runs[MAX_SORT_THREADS + 1];
+static int run_slots;           // runs used, one more than sorting threads but at least two
+static int sort_threads;        // runs are sorted and written by threads
+static int *run_files = NULL;   // files of written runs, in input order
+static int run_file_count = 0;
+
+/* parse offset:length[:endian] of --sort-key */
+void
+parse_sort_key(char *key)
+{
+    char *copy,*length,*endian;
+
+    copy = xstrdup(key);
+    length = strchr(copy,':');
+    if(length == NULL) panic("Error in sort key",key,NULL);
+    *length++ = 0;
+    endian = strchr(length,':');
+    if(endian != NULL) *endian++ = 0;
+
+    key_offset = parse_long(copy);
+    key_length = (int) parse_long(length);
+    if(key_offset < 0 || key_length < 1 || key_length > 8) panic("Sort key length must be 1 to 8 bytes",key,NULL);
+    key_little_endian = 0;
+    if(endian != NULL)
+    {
+        if(strcmp(endian,"le") == 0)
+        {
+            key_little_endian = 1;
+        } else if(strcmp(endian,"be") != 0)
+        {
+            panic("Endian of sort key must be be or le",key,NULL);
+        }
+    }
+    free(copy);
+    sort_mode = 1;
+}
+
+/* key of the block at p, bytes beyond the end of the block are zero */
+static uint64_t
+block_key(unsigned char *p,off_t length)
+{
+    uint64_t key = 0;
+    unsigned char byte;
+    int i;
+
+    for(i = 0;i < key_length;i++)
+    {
+        byte = key_offset + i < length ? p[key_offset + i] : 0;
+        if(key_little_endian)
+        {
+            key |= (uint64_t) byte << (8 * i);
+        } else
+        {
+            key = key << 8 | byte;
+        }
+    }
+    return key;
+}
+
+/* LSD radix sort of the records by key, one pass for every byte of the key.
+   Passes where all keys have the same byte are skipped */
+static void
+radix_sort(struct sort_run *r)
+{
+    size_t count[256],pos[256];
+    struct sort_record *from,*to,*t;
+    size_t i;
+    int pass,b;
+
+    from = r->records;
+    to = r->temp;
+    for(pass = 0;pass < key_length;pass++)
+    {
+        memset(count,0,sizeof(count));
+        for(i = 0;i < r->count;i++) count[(from[i].key >> (8 * pass)) & 0xff]++;
+        for(b = 0;b < 256 && count[b] != r->count;b++);
+        if(b < 256) continue;       // count[b] is all, nothing to do
+
+        pos[0] = 0;
+        for(b = 1;b < 256;b++) pos[b] = pos[b - 1] + count[b - 1];
+        for(i = 0;i < r->count;i++) to[pos[(from[i].key >> (8 * pass)) & 0xff]++] = from[i];
+        t = from;
+        from = to;
+        to = t;
+    }
+    r->records = from;
+    r->temp = to;
+}
+
+static void
+write_fd(int fd,unsigned char *buf,size_t length)
+{
+    ssize_t w;
+
+    while(length)
+    {
+        w = write(fd,buf,length);
+        if(w == -1)
+        {
+            if(errno == EINTR) continue;
+            panic("Cannot write to temporary file",NULL,strerror(errno));
+        }
+        buf += w;
+        length -= (size_t) w;
+    }
+}
+
+/* write sorted run to its file, blocks with headers */
+static void
+write_run(struct sort_run *r)
+{
+    unsigned char *out;
+    struct run_header h;
+    struct sort_record *rec;
+    size_t used,i;
+
+    out = xmalloc(RUN_IO_SIZE);
+    used = 0;
+    for(i = 0;i < r->count;i++)
+    {
+        rec = &r->records[i];
+        h.key = rec->key;
+        h.length = rec->length;
+        if(used + sizeof(h) + (size_t) rec->length > RUN_IO_SIZE)
+        {
+            write_fd(r->fd,out,used);
+            used = 0;
+        }
+        memcpy(out + used,&h,sizeof(h));
+        used += sizeof(h);
+        if((size_t) rec->length > RUN_IO_SIZE - used)
+        {
+            write_fd(r->fd,out,used);
+            write_fd(r->fd,r->arena + rec->start,(size_t) rec->length);
+            used = 0;
+        } else
+        {
+            memcpy(out + used,r->arena + rec->start,(size_t) rec->length);
+            used += (size_t) rec->length;
+        }
+    }
+    write_fd(r->fd,out,used);
+    free(out);
+    if(lseek(r->fd,(off_t) 0,SEEK_SET) == -1) panic("Cannot seek temporary file",NULL,strerror(errno));
+}
+
+static void *
+sort_thread_main(void *arg)
+{
+    struct sort_run *r = arg;
+
+    radix_sort(r);
+    write_run(r);
+    return NULL;
+}
+
+/* temporary file, removed at once so it disappears when closed */
+static int
+temporary_file()
+{
+    char *dir,*file;
+    int fd;
+
+    dir = getenv("TMPDIR");
+    if(dir == NULL || !*dir) dir = "/tmp";
+    file = xmalloc(strlen(dir) + 16);
+    sprintf(file,"%s/bbesortXXXXXX",dir);
+    fd = mkstemp(file);
+    if(fd == -1) panic("Cannot create temporary file",file,strerror(errno));
+    unlink(file);
+    free(file);
+    return fd;
+}
+
+/* full run is sorted and written to a new run file, by a thread if there are
+   spare processors */
+static void
+spill_run(struct sort_run *r)
+{
+    r->fd = temporary_file();
+    run_files = xrealloc(run_files,(run_file_count + 1) * sizeof(int));
+    run_files[run_file_count++] = r->fd;
+#ifdef _POSIX_THREADS
+    if(sort_threads)
+    {
+        if(pthread_create(&r->thread,NULL,sort_thread_main,r) != 0) panic("Cannot create thread",NULL,strerror(errno));
+        r->running = 1;
+        return;
+    }
+#endif
+    sort_thread_main(r);
+}
+
+/* wait until run is written, it can then be filled again */
+static void
+wait_run(struct sort_run *r)
+{
+#ifdef _POSIX_THREADS
+    if(r->running) pthread_join(r->thread,NULL);
+    r->running = 0;
+#endif
+    r->used = 0;
+    r->count = 0;
+}
+
+/* add block, length bytes at p, to the run, arena is grown only for a block
+   which does not fit to an empty run */
+static void
+add_bytes(struct sort_run *r,unsigned char *p,off_t length)
+{
+    if(r->used + (size_t) length > r->arena_size)
+    {
+        r->arena_size = r->used + (size_t) length;
+        r->arena = xrealloc(r->arena,r->arena_size);
+    }
+    memcpy(r->arena + r->used,p,(size_t) length);
+    r->used += (size_t) length;
+}
+
+static void
+add_record(struct sort_run *r,off_t start)
+{
+    struct sort_record *rec;
+
+    if(r->count == r->size)
+    {
+        r->size = r->size ? 2 * r->size : 1024;
+        r->records = xrealloc(r->records,r->size * sizeof(struct sort_record));
+        r->temp = xrealloc(r->temp,r->size * sizeof(struct sort_record));
+    }
+    rec = &r->records[r->count++];
+    rec->start = start;
+    rec->length = (off_t) r->used - start;
+    rec->key = block_key(r->arena + start,rec->length);
+}
+
+/* read bytes from run file to buffer of merge input, returns false at end of file */
+static int
+fill_input(struct merge_input *m)
+{
+    ssize_t r;
+
+    if(m->pos < m->length) memmove(m->buffer,m->buffer + m->pos,m->length - m->pos);
+    m->length -= m->pos;
+    m->pos = 0;
+    do
+    {
+        r = read(m->fd,m->buffer + m->length,RUN_IO_SIZE - m->length);
+    } while(r == -1 && errno == EINTR);
+    if(r == -1) panic("Error reading temporary file",NULL,strerror(errno));
+    m->length += (size_t) r;
+    return r > 0;
+}
+
+/* read header of the next block, returns false if run is at end */
+static int
+next_block(struct merge_input *m)
+{
+    while(m->length - m->pos < sizeof(struct run_header))
+    {
+        if(!fill_input(m))
+        {
+            if(m->length != m->pos) panic("Temporary file truncated",NULL,NULL);
+            return 0;
+        }
+    }
+    memcpy(&m->header,m->buffer + m->pos,sizeof(struct run_header));
+    m->pos += sizeof(struct run_header);
+    return 1;
+}
+
+/* write contents of the current block */
+static void
+copy_block(struct merge_input *m)
+{
+    off_t left = m->header.length;
+    size_t n;
+
+    while(left)
+    {
+        if(m->pos == m->length && !fill_input(m)) panic("Temporary file truncated",NULL,NULL);
+        n = m->length - m->pos;
+        if((off_t) n > left) n = (size_t) left;
+        write_buffer(m->buffer + m->pos,(off_t) n);
+        m->pos += n;
+        left -= (off_t) n;
+    }
+}
+
+static int
+input_before(struct merge_input *a,struct merge_input *b)
+{
+    if(a->header.key != b->header.key) return a->header.key < b->header.key;
+    return a->run < b->run;
+}
+
+static void
+sift_down(struct merge_input **heap,int n,int i)
+{
+    struct merge_input *t;
+    int c;
+
+    for(;;)
+    {
+        c = 2 * i + 1;
+        if(c >= n) break;
+        if(c + 1 < n && input_before(heap[c + 1],heap[c])) c++;
+        if(!input_before(heap[c],heap[i])) break;
+        t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+        i = c;
+    }
+}
+
+/* k-way merge of the run files to output */
+static void
+merge_runs()
+{
+    struct merge_input *inputs,**heap;
+    int i,n;
+
+    inputs = xmalloc(run_file_count * sizeof(struct merge_input));
+    heap = xmalloc(run_file_count * sizeof(struct merge_input *));
+    n = 0;
+    for(i = 0;i < run_file_count;i++)
+    {
+        inputs[i].fd = run_files[i];
+        inputs[i].run = i;
+        inputs[i].buffer = xmalloc(RUN_IO_SIZE);
+        inputs[i].pos = 0;
+        inputs[i].length = 0;
+        if(next_block(&inputs[i])) heap[n++] = &inputs[i];
+    }
+    for(i = n / 2 - 1;i >= 0;i--) sift_down(heap,n,i);
+
+    while(n)
+    {
+        copy_block(heap[0]);
+        if(!next_block(heap[0])) heap[0] = heap[--n];
+        sift_down(heap,n,0);
+    }
+
+    for(i = 0;i < run_file_count;i++)
+    {
+        close(inputs[i].fd);
+        free(inputs[i].buffer);
+    }
+    free(inputs);
+    free(heap);
+}
+
+/* write the only run directly to output */
+static void
+write_sorted(struct sort_run *r)
+{
+    size_t i;
+
+    radix_sort(r);
+    for(i = 0;i < r->count;i++) write_buffer(r->arena + r->records[i].start,r->records[i].length);
+}
+
+/* execute --sort-key */
+void
+execute_sort()
+{
+    struct sort_run *r,*next;
+    size_t run_size,memory;
+    off_t start,span;
+    char *env;
+    int i,slot;
+#ifdef _POSIX_THREADS
+    long cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    sort_threads = cpus < 1 ? 0 : (cpus > MAX_SORT_THREADS ? MAX_SORT_THREADS : (int) cpus);
+#else
+    sort_threads = 0;
+#endif
+    run_slots = sort_threads < 1 ? 2 : sort_threads + 1;
+    memory = SORT_MEMORY;
+    env = getenv("BBE_SORT_MEMORY");     // smaller memory to test the merge
+    if(env != NULL && *env)
+    {
+        if(parse_long(env) < 1) panic("Error in BBE_SORT_MEMORY",env,NULL);
+        memory = (size_t) parse_long(env);
+    }
+    run_size = memory / run_slots;
+    for(i = 0;i < run_slots;i++)
+    {
+        memset(&runs[i],0,sizeof(struct sort_run));
+        runs[i].arena_size = run_size;
+        runs[i].arena = xmalloc(run_size);
+    }
+
+    slot = 0;
+    r = &runs[0];
+    while(find_block())
+    {
+        start = (off_t) r->used;
+        do
+        {
+            span = block_span();
+            if(r->used + (size_t) span > r->arena_size && r->count)
+            {
+                /* run is full, move the start of the current block to next run */
+                slot = (slot + 1) % run_slots;
+                next = &runs[slot];
+                wait_run(next);
+                add_bytes(next,r->arena + start,(off_t) r->used - start);
+                r->used = (size_t) start;
+                spill_run(r);
+                r = next;
+                start = 0;
+            }
+            add_bytes(r,read_pos(),span);
+        } while(!skip_span(span));
+        add_record(r,start);
+    }
+
+    if(!run_file_count)
+    {
+        write_sorted(r);
+    } else
+    {
+        if(r->count) spill_run(r);
+        for(i = 0;i < run_slots;i++) wait_run(&runs[i]);
+        merge_runs();
+    }
+    flush_buffer();
+
+    for(i = 0;i < run_slots;i++)
+    {
+        free(runs[i].arena);
+        free(runs[i].records);
+        free(runs[i].temp);
+    }
+    free(run_files);
+    close_output_stream();
+}
@@ -0,0 +1,188 @@
+/*
+ *    bbe - Binary block editor
+ *
+ *    Copyright (C) 2005 Timo Savinen
+ *    This file is part of bbe.
+ *
+ *    bbe is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    bbe is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with bbe; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* $Id$ */
+
+/* --stats mode: blocks are searched as usual, but instead of block contents
+   a report of block lengths, byte frequencies and entropy is written */
+
+#include "bbe.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* 0 = no stats, STATS_SUMMARY or STATS_BYTES (byte frequencies also for every block) */
+int stats_mode = 0;
+
+/* number of bins in length histogram, bin n has lengths 2^n .. 2^(n+1)-1 */
+#define LENGTH_BINS 64
+
+/* partial counts of count_bytes, four tables so that consecutive bytes
+   having same value do not wait for each others increments */
+static unsigned int partial[4][256];
+
+/* add byte counts of length bytes to freq */
+static void
+count_bytes(unsigned char *p,off_t length,off_t *freq)
+{
+    register unsigned int *c0 = partial[0],*c1 = partial[1],*c2 = partial[2],*c3 = partial[3];
+    unsigned long long w;
+    off_t n;
+    int i;
+
+    while(length)
+    {
+        n = length > (1 << 24) ? (1 << 24) : length;     // partial counts must not overflow
+        length -= n;
+
+        while(n >= 8)
+        {
+            memcpy(&w,p,8);
+            c0[w & 0xff]++;
+            c1[(w >> 8) & 0xff]++;
+            c2[(w >> 16) & 0xff]++;
+            c3[(w >> 24) & 0xff]++;
+            c0[(w >> 32) & 0xff]++;
+            c1[(w >> 40) & 0xff]++;
+            c2[(w >> 48) & 0xff]++;
+            c3[(w >> 56) & 0xff]++;
+            p += 8;
+            n -= 8;
+        }
+        while(n--) c0[*p++]++;
+
+        for(i = 0;i < 256;i++)
+        {
+            freq[i] += (off_t) c0[i] + c1[i] + c2[i] + c3[i];
+            c0[i] = c1[i] = c2[i] = c3[i] = 0;
+        }
+    }
+}
+
+/* Shannon entropy in bits per byte */
+static double
+entropy(off_t *freq,off_t total)
+{
+    double h = 0,p;
+    int i;
+
+    if(!total) return 0;
+    for(i = 0;i < 256;i++)
+    {
+        if(freq[i])
+        {
+            p = (double) freq[i] / (double) total;
+            h -= p * log2(p);
+        }
+    }
+    return h;
+}
+
+static void
+write_line(char *line)
+{
+    write_output_fd((unsigned char *) line,(ssize_t) strlen(line));
+}
+
+/* write name and 256 byte counts in one line */
+static void
+write_frequencies(char *name,off_t *freq)
+{
+    char line[256 * 22 + 64];
+    char *p;
+    int i;
+
+    p = line;
+    p += sprintf(p,"%s",name);
+    for(i = 0;i < 256;i++) p += sprintf(p," %lld",(long long) freq[i]);
+    strcpy(p,"\n");
+    write_line(line);
+}
+
+/* scan all blocks and write the report */
+void
+execute_stats()
+{
+    off_t freq[256],block_freq[256];
+    off_t histogram[LENGTH_BINS];
+    off_t length,span,offset,total,blocks,min_length,max_length;
+    char line[256];
+    int i,bin;
+
+    memset(freq,0,sizeof(freq));
+    memset(histogram,0,sizeof(histogram));
+    total = 0;
+    blocks = 0;
+    min_length = 0;
+    max_length = 0;
+
+    while(find_block())
+    {
+        offset = ctx->in_buffer.stream_offset + (off_t) (ctx->in_buffer.read_pos - ctx->in_buffer.buffer);
+        memset(block_freq,0,sizeof(block_freq));
+        length = 0;
+        do
+        {
+            span = block_span();
+            count_bytes(read_pos(),span,block_freq);
+            length += span;
+        } while(!skip_span(span));
+
+        for(i = 0;i < 256;i++) freq[i] += block_freq[i];
+        bin = 0;
+        while(bin < LENGTH_BINS - 1 && (length >> (bin + 1))) bin++;
+        histogram[bin]++;
+        if(!blocks || length < min_length) min_length = length;
+        if(length > max_length) max_length = length;
+        total += length;
+        blocks++;
+
+        sprintf(line,"block %lld %lld %lld %.4f\n",(long long) ctx->in_buffer.block_num,(long long) offset,
+                (long long) length,entropy(block_freq,length));
+        write_line(line);
+        if(stats_mode == STATS_BYTES)
+        {
+            sprintf(line,"block_frequency %lld",(long long) ctx->in_buffer.block_num);
+            write_frequencies(line,block_freq);
+        }
+    }
+
+    sprintf(line,"blocks %lld\n",(long long) blocks);
+    write_line(line);
+    sprintf(line,"bytes %lld\n",(long long) total);
+    write_line(line);
+    sprintf(line,"length %lld %lld %.2f\n",(long long) min_length,(long long) max_length,
+            blocks ? (double) total / (double) blocks : 0.0);
+    write_line(line);
+    for(bin = 0;bin < LENGTH_BINS;bin++)
+    {
+        if(histogram[bin])
+        {
+            sprintf(line,"histogram %llu %llu %lld\n",1ULL << bin,(2ULL << bin) - 1,(long long) histogram[bin]);
+            write_line(line);
+        }
+    }
+    sprintf(line,"entropy %.4f\n",entropy(freq,total));
+    write_line(line);
+    write_frequencies("frequency",freq);
+    close_output_stream();
+}
@@ -34,6 +34,14 @@ xmalloc (size_t size)
     return value;
 }
 
+void *
+xrealloc (void *ptr,size_t size)
+{
+    register void *value = realloc(ptr,size);
+    if (value == 0) panic("Out of memory",NULL,NULL);
+    return value;
+}
+
 char *
 xstrdup(char *str)
 {